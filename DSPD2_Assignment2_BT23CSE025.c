@@ -1,14 +1,50 @@
+#define _POSIX_C_SOURCE 200809L // open_memstream, which strict -std=c11 does not declare
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
 #include <limits.h>
-
-#define M 4 // Maximum degree of the B-tree
-#define MAX_FAMILY_MEMBERS 4
+#include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+#ifndef M
+#define M 4 // Maximum degree of the B-tree (override with -DM=<even number>)
+#endif
+#if M < 4 || M % 2 != 0
+#error "M must be an even number of at least 4"
+#endif
+#define FAMILY_INLINE_MEMBERS 4 // Members stored inside FamilyNode before spilling to the heap
 #define NAME_LEN 100
-#define MAX_EXPENSES_PER_USER 100
 #define MAX_CATEGORIES 5
+#define STRING_POOL_BLOCK_SIZE 4096
+#define PAGE_SIZE 4096 // Size of one page of the on-disk expense tree
+#define PAGE_MIN_DEGREE 64 // Pages hold between PAGE_MIN_DEGREE-1 and 2*PAGE_MIN_DEGREE-1 keys
+#define PAGE_MAX_KEYS (2 * PAGE_MIN_DEGREE - 1)
+#define PAGED_POOL_FRAMES 64 // Pages held in memory by the buffer pool
+#define PAGED_STORE_FILE "expenses.db"
+#define PAGED_STORE_MAGIC 0x45585032u
+#define LSM_MEMTABLE_SIZE 4096 // Expenses buffered before the memtable becomes a run
+#define LSM_MAX_RUNS 8 // Run levels kept; a flush past the last merges the two newest
+#define COMPRESSED_BLOCK_RECORDS 128 // Records per independently decodable block
+#define COMPRESSED_RECORD_MAX_BYTES 21 // Two 5-byte ids, day/category byte, 10-byte amount
+#define ARCHIVE_FILE "archive.dat"
+#define ARCHIVE_MAGIC 0x41524332u
+#define ARCHIVE_NO_FAMILY INT_MIN // Family column value of rows archived outside a family
+#define ARCHIVE_SCAN_ROWS 1024 // Rows read per column chunk when scanning the archive
+#define TOMBSTONE_COMPACT_PERCENT 25 // Share of tombstones in a month tree that triggers its compaction
+#define TOMBSTONE_COMPACT_BATCH 4 // Month trees compacted per idle pass
+#define EXECUTOR_MAX_THREADS 32 // Report threads, the caller included; the pool uses one per online core up to this
+#define EXECUTOR_TASKS_PER_THREAD 4 // Tasks a report scan is split into per thread, so idle threads have work to steal
+#define AMOUNT_SKIP_LEVELS 12 // Levels of a user's amount skip list; each holds about a quarter of the one below
+#define REPORT_CACHE_ENTRIES 64 // Reports whose output is kept for repeat reads
+#define REPORT_CACHE_MAX_OUTPUT (64 * 1024) // Longer reports are printed but not kept
 
 typedef enum {
     Rent = 0,
@@ -28,43 +64,112 @@ typedef struct {
     int year;
 } Date;
 
+//Dates are stored packed as yyyymmdd so that ordering is a single integer compare
+typedef unsigned int DateKey;
+
+#define DATE_DAY(key) ((int)((key) % 100))
+#define DATE_MONTH(key) ((int)((key) / 100 % 100))
+#define DATE_YEAR(key) ((int)((key) / 10000))
+
+//start <= date <= end as one unsigned compare (requires start <= end)
+static inline bool dateInRange(DateKey date, DateKey start, DateKey end){
+    return date - start <= end - start;
+}
+
 typedef struct ExpenseNode ExpenseNode;
 typedef struct UserNode UserNode;
 typedef struct FamilyNode FamilyNode;
 
+#define VERSION_CURRENT LONG_MAX
+
+//One state of an expense, visible to "as of" queries for versions in
+//[valid_from, valid_to). valid_to is VERSION_CURRENT while the state is live.
+typedef struct ExpenseVersion {
+    int expense_id;
+    ExpenseCategory category;
+    float amount;
+    DateKey date;
+    long valid_from;
+    long valid_to;
+    struct ExpenseVersion* next; //older states of the same user's expenses
+} ExpenseVersion;
+
 struct ExpenseNode {
     int expense_id;
     int user_id;
     float amount;
     ExpenseCategory category;
-    Date date;
+    DateKey date;
+    bool tombstone; //deleted, but still in its month tree until compaction
+    unsigned char amount_levels; //skip list levels the expense is linked on, next_by_amount being level 0
     ExpenseNode* next; //for chaining expenses by user
+    ExpenseNode* prev;
+    ExpenseNode* next_by_amount; //user's expenses in descending amount order
+    ExpenseNode* prev_by_amount;
+    ExpenseNode** amount_skip; //successors on levels 1.. of the amount skip list, NULL on level 0 only
+    UserNode* user; //owner while the record is in its lists, so unlinking needs no lookup
+    ExpenseVersion* version; //live state in the user's history
 };
 
+//Parts of a user that lookups and aggregation never read, kept out of the
+//user record so that tree walks over users touch fewer cache lines
+typedef struct {
+    const char* user_name; //interned in name_pool
+    ExpenseNode* amount_skip_head[AMOUNT_SKIP_LEVELS - 1]; //first expense on each upper skip list level
+    ExpenseVersion* history; //every state of the user's expenses, newest first
+    float folded_expenses[MAX_CATEGORIES]; //archived and paged spending, whose history was folded away
+    unsigned long generation; //report cache: last change to the user or its expenses
+} UserDetails;
+
+//Records keep the fields read by lookups and aggregation first;
+//the rest sits behind one pointer
 struct UserNode {
     int user_id;
-    char user_name[NAME_LEN];
-    float income;
-    FamilyNode* family;
-    ExpenseNode* expenses_head;
     int expense_count;
+    float income;
     float total_expense;
     float category_expenses[MAX_CATEGORIES];
+    FamilyNode* family;
+    ExpenseNode* expenses_head;
+    ExpenseNode* expenses_tail;
+    ExpenseNode* amount_head; //largest expense first
+    UserDetails* details;
 };
 
 struct FamilyNode {
     int family_id;
-    char family_name[NAME_LEN];
-    UserNode* members[MAX_FAMILY_MEMBERS];
     int member_count;
     float total_income;
     float total_expense;
     float category_expenses[MAX_CATEGORIES];
+    int member_capacity;
+    UserNode** members; //inline_members until the family outgrows it
+    const char* family_name; //interned in name_pool
+    unsigned long generation; //report cache: last change to the family or any member
+    UserNode* inline_members[FAMILY_INLINE_MEMBERS];
 };
 
+//String pool: arena blocks holding each distinct string once
+typedef struct StringPoolBlock {
+    struct StringPoolBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+} StringPoolBlock;
+
+typedef struct {
+    StringPoolBlock* blocks;
+    const char** slots; //open-addressed hash set over the interned strings
+    int count;
+    int capacity;
+} StringPool;
+
 //B-tree node structures
+//Node keys are kept inline (key_ids[i] is the id of keys[i]) so that
+//intra-node search scans a contiguous sorted array
 typedef struct BTreeNodeUser {
     int num_keys;
+    int key_ids[M-1];
     UserNode* keys[M-1];
     struct BTreeNodeUser* children[M];
     bool is_leaf;
@@ -72,25 +177,461 @@ typedef struct BTreeNodeUser {
 
 typedef struct BTreeNodeFamily {
     int num_keys;
+    int key_ids[M-1];
     FamilyNode* keys[M-1];
     struct BTreeNodeFamily* children[M];
     bool is_leaf;
 } BTreeNodeFamily;
 
+//(user_id, expense_id) packed so that unsigned order matches the signed pair order
+typedef unsigned long long ExpenseKey;
+
 typedef struct BTreeNodeExpense {
     int num_keys;
+    ExpenseKey key_codes[M-1]; //key_codes[i] is the packed key of keys[i]
     ExpenseNode* keys[M-1];
     struct BTreeNodeExpense* children[M];
     bool is_leaf;
 } BTreeNodeExpense;
 
+//Keys and children of up to two expense nodes, gathered while they are joined or rebalanced
+typedef struct {
+    int num_keys;
+    int num_children;
+    ExpenseNode* keys[2 * M];
+    BTreeNodeExpense* children[2 * M + 1];
+} ExpenseNodeBuffer;
+
+//Name index: sorted array of lower-cased names for exact and prefix lookup
+typedef struct {
+    const char* key; //interned lower-case name
+    int id;
+    void* record;
+} NameIndexEntry;
+
+typedef struct {
+    NameIndexEntry* entries;
+    int count;
+    int capacity;
+} NameIndex;
+
+//Start of each block of a compressed month, for binary search by key
+typedef struct {
+    ExpenseKey first_key;
+    unsigned int offset;
+    int count;
+} CompressedBlock;
+
+//Read-only, byte-encoded records of one month, sorted by key. Within a block
+//ids are delta-encoded varints, day and category share a byte and amounts are
+//varint cents.
+typedef struct {
+    int record_count;
+    int block_count;
+    size_t data_size;
+    CompressedBlock* blocks;
+    unsigned char* data;
+} CompressedMonth;
+
+//Expenses of one calendar month with their own tree and running totals
+typedef struct {
+    int month_key; //yyyymm
+    BTreeNodeExpense* root;
+    CompressedMonth* compressed; //older records moved out of the tree, or NULL
+    int expense_count;
+    int tombstone_count; //deleted records still in root, not part of expense_count
+    float total_expense;
+    float category_expenses[MAX_CATEGORIES];
+} ExpensePartition;
+
+//Partitions kept sorted by month_key
+typedef struct {
+    ExpensePartition* partitions;
+    int count;
+    int capacity;
+} ExpenseStore;
+
+//Read-only snapshot of the three trees as contiguous arrays in Eytzinger
+//(BFS) order, 1-based. Built by freezeIndexes, dropped by any tree mutation.
+typedef struct {
+    int user_count;
+    int* user_ids;
+    UserNode** users;
+    int family_count;
+    int* family_ids;
+    FamilyNode** families;
+    int expense_count;
+    ExpenseKey* expense_keys;
+    ExpenseNode** expenses;
+    bool valid;
+} FrozenIndex;
+
+//(user, expense) key -> expense held in its user's lists, so lookups and
+//duplicate checks do not walk the lists. Open-addressed with linear probing.
+typedef struct {
+    ExpenseKey* keys;
+    ExpenseNode** expenses; //NULL marks a free slot
+    int count;
+    int capacity;
+    bool partial; //an insert ran out of memory; lookups walk the lists instead
+} ExpenseIdIndex;
+
+typedef struct ReportTask ReportTask;
+typedef void (*ReportTaskFn)(ReportTask* task, FILE* out);
+
+//One piece of a report run on the executor. A task reads only its source,
+//writes its lines to its own buffer and its partial aggregates to its own
+//fields, so the caller can merge results in task order.
+struct ReportTask {
+    ReportTaskFn run;
+    const void* source; //subtree or compressed month
+    ExpenseNode* separator; //key that follows the subtree in tree order, or NULL
+    int key; //month of a scan task
+    DateKey start;
+    DateKey end;
+    const void* params; //query shared by the tasks of a batch, or NULL
+    void* partial; //task's own partial result, for tasks that build one
+    int count;
+    double total; //wide enough that the sum does not depend on how a scan is split
+    bool buffered; //output holds the task's lines; otherwise it has not run yet
+    char* output;
+    size_t output_size;
+};
+
+typedef struct {
+    ReportTask* tasks;
+    int count;
+    int capacity;
+} ReportTaskList;
+
+//Tasks of a batch are dealt round-robin, so queue q holds tasks q, q + n,
+//q + 2n, ... for n threads, as positions head..tail-1. The owner takes from
+//the back and idle threads steal from the front.
+typedef struct {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+} TaskQueue;
+
+//Thread pool for read-only reports. The calling thread is thread 0 and works
+//on the batch too; a batch runs while no tree is being changed.
+typedef struct {
+    int thread_count; //0 until the pool is started
+    bool stopping;
+    long batch; //bumped per batch, so each worker joins it once
+    int pending; //tasks of the batch not finished yet
+    ReportTask* tasks;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    pthread_t threads[EXECUTOR_MAX_THREADS];
+    TaskQueue queues[EXECUTOR_MAX_THREADS];
+} ReportExecutor;
+
+#define GROUP_FIELD_COUNT 8
+#define GROUP_NONE INT_MIN // Group value of users outside a family
+
+typedef enum {
+    GroupByUser = 0,
+    GroupByFamily,
+    GroupByCategory,
+    GroupByDay,
+    GroupByWeekday,
+    GroupByWeek,
+    GroupByMonth,
+    GroupByYear
+} GroupField;
+
+const char* group_field_names[GROUP_FIELD_COUNT] = {
+    "User", "Family", "Category", "Day", "Weekday", "Week", "Month", "Year"
+};
+
+//Group-by over expenses: grouping fields in output order, an inclusive date
+//window and a category filter (-1 for every category)
+typedef struct {
+    int field_count;
+    GroupField fields[GROUP_FIELD_COUNT];
+    DateKey start;
+    DateKey end;
+    int category;
+    bool parallel; //aggregate month trees on the report pool
+} GroupQuery;
+
+//Running aggregates of one group. Unused trailing values stay 0, so groups
+//compare over all GROUP_FIELD_COUNT values.
+typedef struct {
+    int values[GROUP_FIELD_COUNT];
+    int count;
+    double sum;
+    float min;
+    float max;
+} GroupEntry;
+
+//Groups in insertion order, found through an open-addressed index into entries
+typedef struct {
+    GroupEntry* entries;
+    int* slots; //-1 marks a free slot
+    int count;
+    int capacity; //of slots; entries holds up to 7/10 of it
+    bool failed; //an allocation failed; workers report it through this flag
+} GroupTable;
+
+//Expense as stored on disk; no pointers, so pages can be written as they are
+typedef struct {
+    int user_id;
+    int expense_id;
+    float amount;
+    int category;
+    DateKey date;
+} ExpenseRecord;
+
+//One row of a batch passed to addExpenses
+typedef struct {
+    int user_id;
+    int expense_id;
+    float amount;
+    ExpenseCategory category;
+    Date date;
+} ExpenseInput;
+
+//Expenses picked by a range delete: a key range and a date window, both inclusive
+typedef struct {
+    ExpenseKey low_key;
+    ExpenseKey high_key;
+    DateKey first_date;
+    DateKey last_date;
+} ExpenseRange;
+
+#define QUERY_LEN 256 // Longest query line read from the menu
+#define QUERY_TOKEN_LEN 32
+#define QUERY_COLUMN_COUNT 6
+#define QUERY_PATH_COUNT 4
+
+typedef enum {
+    ColumnUser = 0,
+    ColumnId,
+    ColumnFamily,
+    ColumnAmount,
+    ColumnCategory,
+    ColumnDate
+} QueryColumn;
+
+const char* query_column_names[QUERY_COLUMN_COUNT] = {
+    "user", "id", "family", "amount", "category", "date"
+};
+
+//Ways the planner can find the rows of a query
+typedef enum {
+    PathUserList = 0,
+    PathFamilyMembers,
+    PathMonthPartitions,
+    PathTotals
+} QueryPath;
+
+const char* query_path_names[QUERY_PATH_COUNT] = {
+    "user list", "family members", "month partitions", "precomputed totals"
+};
+
+//Parsed query. Every predicate is an inclusive range, so "=" is a range of one
+//value; fields without a predicate span their whole domain.
+typedef struct {
+    int column_count; //0 for an aggregate query
+    QueryColumn columns[QUERY_COLUMN_COUNT];
+    bool count;
+    bool sum;
+    int user_low;
+    int user_high;
+    bool family_filter;
+    int family_low;
+    int family_high;
+    int category_low;
+    int category_high;
+    int id_low;
+    int id_high;
+    DateKey date_low;
+    DateKey date_high;
+    float amount_low;
+    float amount_high;
+    bool ordered;
+    QueryColumn order_column;
+    bool descending;
+    int limit; //-1 for no limit
+    bool explain;
+} ExpenseQuery;
+
+typedef struct {
+    ExpenseRecord record;
+    int family_id;
+    double sort_key;
+} QueryRow;
+
+typedef struct {
+    QueryRow* rows;
+    int count;
+    int capacity;
+    bool needs_family; //family is filtered, projected or ordered on
+    bool failed;
+} QueryResult;
+
+typedef enum {
+    ReportCategorical = 0,
+    ReportHighestDay,
+    ReportIndividual,
+    ReportPeriod
+} ReportKind;
+
+//Printed output of one report, keyed by kind and arguments. It is served while
+//the generation it depends on is no newer than filled_at.
+typedef struct {
+    bool used;
+    bool referenced; //second chance for the clock hand
+    ReportKind kind;
+    long args[2];
+    unsigned long filled_at;
+    char* output;
+    size_t output_size;
+} CachedReport;
+
+//Few enough entries that a lookup scans them all; evicted by the clock algorithm
+typedef struct {
+    CachedReport entries[REPORT_CACHE_ENTRIES];
+    int clock_hand;
+} ReportCache;
+
+//Output of a report being run, collected so it can be cached
+typedef struct {
+    FILE* out; //stdout if no memory stream could be opened
+    char* text;
+    size_t size;
+} ReportCapture;
+
+//One node of the on-disk expense tree. Children are page ids; page 0 holds
+//the file header, so a child or root id of 0 means none.
+typedef struct {
+    unsigned int page_id;
+    unsigned short num_keys;
+    unsigned char is_leaf;
+    ExpenseKey key_codes[PAGE_MAX_KEYS];
+    ExpenseRecord records[PAGE_MAX_KEYS];
+    unsigned int children[PAGE_MAX_KEYS + 1];
+} ExpensePage;
+
+_Static_assert(sizeof(ExpensePage) <= PAGE_SIZE, "ExpensePage must fit in a page");
+
+typedef struct {
+    unsigned int magic;
+    unsigned int root_page;
+    unsigned int page_count;
+    long record_count;
+    int cutoff_month; //yyyymm; every paged expense is dated before it
+} PagedStoreHeader;
+
+typedef struct {
+    unsigned int page_id;
+    int pin_count;
+    bool used;
+    bool dirty;
+    bool referenced; //second chance for the clock hand
+    ExpensePage page;
+} BufferFrame;
+
+//Archive file: header, then one contiguous column per field over all rows
+//(sorted by user and expense id), then the per-user and per-family summaries.
+//The last column is the family each row's user was in when it was archived.
+typedef struct {
+    unsigned int magic;
+    int cutoff_month; //yyyymm; every archived expense is dated before it
+    int record_count;
+    int user_count;
+    int family_count;
+    float category_totals[MAX_CATEGORIES];
+} ArchiveHeader;
+
+typedef struct {
+    int user_id;
+    int expense_count;
+    float total_expense;
+    float category_expenses[MAX_CATEGORIES];
+} ArchiveUserSummary;
+
+typedef struct {
+    int family_id;
+    float total_expense;
+    float category_expenses[MAX_CATEGORIES];
+} ArchiveFamilySummary;
+
+//Read-only cold tier. Only the header and summaries are held in memory;
+//columns are read from the file as queries need them.
+typedef struct {
+    FILE* file;
+    ArchiveHeader header;
+    ArchiveUserSummary* users;
+    ArchiveFamilySummary* families;
+} ExpenseArchive;
+
+//Sorted, immutable batch of ingested expenses
+typedef struct {
+    ExpenseNode** expenses;
+    int count;
+} ExpenseRun;
+
+//LSM ingest mode: new expenses go to an append-only memtable, which is sorted
+//into a run when full. Runs are merged pairwise as they pile up. Buffered
+//expenses are only indexed and totalled; they reach their user's lists and
+//history and their month tree through lsmCompact.
+typedef struct {
+    bool enabled;
+    ExpenseNode** memtable;
+    int memtable_count;
+    ExpenseRun runs[LSM_MAX_RUNS];
+    int run_count;
+} LsmIngest;
+
+//Expense tree kept in a file of fixed-size pages; at most frame_count pages
+//are in memory, evicted by the clock algorithm and written back when dirty
+typedef struct {
+    FILE* file;
+    BufferFrame* frames;
+    int frame_count;
+    int clock_hand;
+    unsigned int root_page;
+    unsigned int page_count;
+    long record_count;
+    int cutoff_month;
+    long page_reads;
+    long page_writes;
+} PagedExpenseStore;
+
 BTreeNodeUser* user_root = NULL;
 BTreeNodeFamily* family_root = NULL;
-BTreeNodeExpense* expense_root = NULL;
+ReportExecutor report_executor; //locks are set up when the pool starts
+ExpenseStore expense_store = {NULL, 0, 0};
+long store_version = 0; //logical clock, advanced once per expense mutation
+long history_horizon = 0; //oldest version as-of reports can show; older history is compacted
+unsigned int amount_level_seed = 2463534242u; //xorshift state drawing skip list levels
+ReportCache report_cache;
+unsigned long generation_clock = 0; //every generation below is a value taken from it
+unsigned long global_generation = 0; //newest user or family generation
+FrozenIndex frozen_index = {0, NULL, NULL, 0, NULL, NULL, 0, NULL, NULL, false};
+ExpenseIdIndex expense_id_index = {NULL, NULL, 0, 0, false};
+PagedExpenseStore paged_store = {NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0};
+LsmIngest lsm = {false, NULL, 0, {{NULL, 0}}, 0};
+bool tombstone_deletes = false; //removeExpense marks records instead of rebalancing the tree
+ExpenseArchive archive = {NULL, {0, 0, 0, 0, 0, {0}}, NULL, NULL};
+
+StringPool name_pool = {NULL, NULL, 0, 0};
+
+NameIndex user_name_index = {NULL, 0, 0};
+NameIndex family_name_index = {NULL, 0, 0};
+
+int nodeLowerBound(const int* keys, int num_keys, int key);
+int nodeLowerBoundExpense(const ExpenseKey* keys, int num_keys, ExpenseKey key);
 
 BTreeNodeUser* createUserNode(bool is_leaf);
 BTreeNodeFamily* createFamilyNode(bool is_leaf);
 BTreeNodeExpense* createExpenseNode(bool is_leaf);
+void releaseExpenseTree(BTreeNodeExpense* root);
+ExpenseKey makeExpenseKey(int user_id, int expense_id);
 
 void insertUser(BTreeNodeUser** root, UserNode* user);
 void insertUserNonFull(BTreeNodeUser* node, UserNode* user);
@@ -103,35 +644,162 @@ FamilyNode* searchFamily(BTreeNodeFamily* root, int family_id);
 ExpenseNode* searchExpenseForUser(UserNode* user, int expense_id);
 ExpenseNode* searchExpense(BTreeNodeExpense* root, int user_id, int expense_id);
 
+// Expense id index functions
+ExpenseNode* expenseIndexFind(int user_id, int expense_id);
+void expenseIndexInsert(ExpenseNode* expense);
+void expenseIndexRemove(ExpenseNode* expense);
+void freeExpenseIdIndex();
+
 UserNode* addUser(int user_id, const char* name, float income);
 FamilyNode* createFamily(int family_id, const char* family_name);
 bool joinFamily(int user_id, int family_id);
+void leaveFamily(UserNode* user);
 ExpenseNode* addExpense(int user_id, int expense_id, float amount, ExpenseCategory category, Date date);
+int addExpenses(const ExpenseInput* batch, int count);
 bool removeUser(int user_id);
 bool removeFamily(int family_id);
-bool removeExpense(int expense_id);
+bool removeExpense(int user_id, int expense_id);
+int removeExpensesInRange(int user_id, int start_id, int end_id);
+int removeExpensesInPeriod(Date start, Date end);
 
-void getTotalExpense(int family_id);
-void getCategoricalExpense(int family_id, ExpenseCategory category);
-void getHighestExpenseDay(int family_id);
-void getIndividualExpense(int user_id);
-void getExpensesInPeriod(BTreeNodeExpense* root, Date start, Date end);
-void getExpensesInRange(int user_id, int start_id, int end_id);
+void getTotalExpense(int family_id, long as_of);
+void getCategoricalExpense(int family_id, ExpenseCategory category, long as_of);
+void getHighestExpenseDay(int family_id, long as_of);
+void getIndividualExpense(int user_id, long as_of);
+void getExpensesInPeriod(Date start, Date end, long as_of);
+void getExpensesInRange(int user_id, int start_id, int end_id, long as_of);
 
 void updateFamilyTotals(FamilyNode* family);
-int dateCompare(Date d1, Date d2);
+int dateCompare(DateKey d1, DateKey d2);
+bool isValidDate(Date date);
+DateKey packDate(Date date);
 void sortExpensesByAmount(ExpenseNode** expenses, int count);
 void sortExpensesByCategory(ExpenseNode** expenses, int count);
+void appendExpenseToUser(UserNode* user, ExpenseNode* expense);
+void linkExpenseToUser(UserNode* user, ExpenseNode* expense);
+void linkExpenseByAmount(UserNode* user, ExpenseNode* expense);
+void unlinkExpenseByAmount(UserNode* user, ExpenseNode* expense);
+void unlinkExpenseLists(UserNode* user, ExpenseNode* expense);
+void unlinkExpenseFromUser(ExpenseNode* expense);
+void adjustExpenseTotals(UserNode* user, ExpenseCategory category, float amount);
+
+// Expense partition functions
+int monthKey(DateKey date);
+ExpensePartition* findPartition(int month_key);
+ExpensePartition* getOrCreatePartition(int month_key);
+void removeEmptyPartition(ExpensePartition* partition);
+void addToPartition(ExpenseNode* expense);
+void addToPartitions(ExpenseNode** rows, int count);
+void removeFromPartition(ExpenseNode* expense);
+int dropExpensesBefore(int year, int month);
+void freeExpenseStore();
+
+// Version history functions
+void openExpenseVersion(UserNode* user, ExpenseNode* expense);
+void closeExpenseVersion(ExpenseNode* expense);
+bool isCurrentVersion(long as_of);
+float userExpenseAsOf(UserNode* user, long as_of, float* category_expenses);
+void compactHistory();
+long readAsOfVersion();
+
+// Paged expense store functions
+bool pagedStoreOpen(PagedExpenseStore* store, const char* path, int frame_count, bool create);
+bool pagedStoreFlush(PagedExpenseStore* store);
+void pagedStoreClose(PagedExpenseStore* store);
+ExpensePage* pinPage(PagedExpenseStore* store, unsigned int page_id);
+void unpinPage(PagedExpenseStore* store, ExpensePage* page, bool dirty);
+bool pagedInsert(PagedExpenseStore* store, const ExpenseRecord* record);
+bool pagedSearch(PagedExpenseStore* store, int user_id, int expense_id, ExpenseRecord* out);
+int pagedPrintRange(FILE* out, PagedExpenseStore* store, ExpenseKey low, ExpenseKey high,
+                    DateKey start, DateKey end, float* total);
+int pageOutExpensesBefore(int year, int month);
+void applyPagedTotals();
+int purgePagedExpenses(const ExpenseRange* range);
+
+// LSM ingest functions
+void setIngestMode(bool enabled);
+bool lsmAppend(ExpenseNode* expense);
+bool lsmRemove(ExpenseNode* expense);
+void lsmCompact();
+int lsmPrintInPeriod(FILE* out, DateKey start, DateKey end, float* total);
+void freeLsmIngest();
+
+// Tombstone delete functions
+void setTombstoneDeletes(bool enabled);
+void tombstoneExpense(ExpenseNode* expense);
+bool reviveTombstone(ExpensePartition* part, ExpenseNode* expense);
+int compactTombstones(bool all);
+
+// Compressed month functions
+int compressExpensesBefore(int year, int month);
+void releaseCompressedMonth(CompressedMonth* month);
+bool findCompressedExpense(int user_id, int expense_id, ExpenseRecord* out);
+int collectCompressedExpenses(int user_id, int start_id, int end_id, ExpenseRecord** out);
+int printCompressedInPeriod(FILE* out, const CompressedMonth* month, int month_key, DateKey start, DateKey end, float* total);
+int decodeCompressedMonth(const ExpensePartition* part, ExpenseRecord** out);
+void printExpenseRecord(const ExpenseRecord* record);
+void fprintExpenseRecord(FILE* out, const ExpenseRecord* record);
+
+// Archive functions
+bool openArchive(const char* path);
+void closeArchive();
+void applyArchiveSummaries();
+int archiveExpensesBefore(int year, int month);
+int releaseMonthsBefore(int cutoff_key);
+bool findArchivedExpense(int user_id, int expense_id, ExpenseRecord* out);
+int printArchivedInPeriod(FILE* out, DateKey start, DateKey end, float* total);
+int purgeArchivedExpenses(const ExpenseRange* range);
+int collectColdExpenses(int user_id, int start_id, int end_id, ExpenseRecord** out);
+float archivedFamilyExpense(int family_id);
+
+// Frozen index functions
+bool freezeIndexes();
+void invalidateFrozenIndex();
+UserNode* findUser(int user_id);
+FamilyNode* findFamily(int family_id);
+ExpenseNode* findExpense(int user_id, int expense_id);
+void getTopExpenses(int user_id, int n);
+
+// Report executor functions
+int reportThreadCount();
+bool addReportTask(ReportTaskList* list, const ReportTask* task);
+void runReportTasks(ReportTask* tasks, int count);
+void flushReportTasks(FILE* out, ReportTask* tasks, int count);
+void stopReportExecutor();
+
+// Group-by functions
+void groupExpenses(const GroupQuery* query);
+void freeGroupTable(GroupTable* table);
+
+// Query functions
+bool parseQuery(const char* text, ExpenseQuery* query);
+QueryPath planQuery(const ExpenseQuery* query, long* cost);
+bool runQuery(const char* text);
+
+// Report cache functions
+void bumpUserGeneration(UserNode* user);
+void bumpFamilyGeneration(FamilyNode* family);
+bool printCachedReport(ReportKind kind, long a, long b, unsigned long generation);
+FILE* beginReportCapture(ReportCapture* capture);
+void endReportCapture(ReportCapture* capture, ReportKind kind, long a, long b, bool keep);
+void clearReportCache();
 void freeUser(UserNode* user);
 void freeFamily(FamilyNode* family);
+bool addFamilyMember(FamilyNode* family, UserNode* user);
 void freeExpense(ExpenseNode* expense);
+void freeUserTree(BTreeNodeUser* root);
+void freeFamilyTree(BTreeNodeFamily* root);
+void freeExpenseTree(BTreeNodeExpense* root);
 
 void printUser(UserNode* user);
 void printFamily(FamilyNode* family);
 void printExpense(ExpenseNode* expense);
-void traverseAndPrintUsers(BTreeNodeUser* root);
-void traverseAndPrintFamilies(BTreeNodeFamily* root);
-void traverseAndPrintExpenses(BTreeNodeExpense* root);
+void fprintUser(FILE* out, UserNode* user);
+void fprintFamily(FILE* out, FamilyNode* family);
+void fprintExpense(FILE* out, ExpenseNode* expense);
+void traverseAndPrintUsers(FILE* out, BTreeNodeUser* root);
+void traverseAndPrintFamilies(FILE* out, BTreeNodeFamily* root);
+void traverseAndPrintExpenses(FILE* out, BTreeNodeExpense* root);
 void printAllUsers();
 void printAllFamilies();
 void printAllExpenses();
@@ -161,7 +829,7 @@ void deleteFromFamilySubtree(BTreeNodeFamily* node, int family_id);
 bool deleteFamily(BTreeNodeFamily** root, int family_id);
 
 // Expense B-tree deletion functions
-int find_key_index_expense(BTreeNodeExpense* node, int user_id, int expense_id);
+int find_key_index_expense(BTreeNodeExpense* node, ExpenseKey key);
 void removeFromLeafExpense(BTreeNodeExpense* node, int idx);
 ExpenseNode* getExpensePredecessor(BTreeNodeExpense* node, int idx);
 ExpenseNode* getExpenseSuccessor(BTreeNodeExpense* node, int idx);
@@ -169,12 +837,82 @@ void fillExpenseChild(BTreeNodeExpense* node, int idx);
 void borrowFromLeftExpense(BTreeNodeExpense* parent, int idx);
 void borrowFromRightExpense(BTreeNodeExpense* parent, int idx);
 void mergeExpenseNodes(BTreeNodeExpense* node, int idx);
-void deleteFromExpenseSubtree(BTreeNodeExpense* node, int user_id, int expense_id);
+void deleteFromExpenseSubtree(BTreeNodeExpense* node, ExpenseKey key);
 bool deleteExpense(BTreeNodeExpense** root, int user_id, int expense_id);
+void deleteExpenseRange(BTreeNodeExpense** root, ExpenseKey low, ExpenseKey high);
 
-void updateOrDeleteIndividualFamilyDetails(BTreeNodeUser** user_root,BTreeNodeFamily** family_root,BTreeNodeExpense** expense_root);
+void updateOrDeleteIndividualFamilyDetails(BTreeNodeUser** user_root,BTreeNodeFamily** family_root);
 void updateOrDeleteExpense();
 
+// String pool functions
+const char* internString(StringPool* pool, const char* str);
+void freeStringPool(StringPool* pool);
+
+// Name index functions
+int nameIndexLowerBound(NameIndex* index, const char* key, int id);
+bool nameIndexInsert(NameIndex* index, const char* name, int id, void* record);
+void nameIndexRemove(NameIndex* index, const char* name, int id);
+void freeNameIndex(NameIndex* index);
+void searchUsersByName(const char* name, bool prefix);
+void searchFamiliesByName(const char* name, bool prefix);
+
+
+// Intra-node search: number of keys less than key, i.e. the index of the first
+// key >= key. Keys are sorted, so counting matches of "key > keys[i]" over the
+// whole node gives the position without a data-dependent branch per key.
+int nodeLowerBound(const int* keys, int num_keys, int key){
+    int idx = 0;
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i needle = _mm256_set1_epi32(key);
+    for (; i + 8 <= num_keys; i += 8) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(keys + i));
+        __m256i less = _mm256_cmpgt_epi32(needle, block);
+        idx += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+    }
+#elif defined(__SSE4_2__)
+    __m128i needle = _mm_set1_epi32(key);
+    for (; i + 4 <= num_keys; i += 4) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(keys + i));
+        __m128i less = _mm_cmpgt_epi32(needle, block);
+        idx += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+    }
+#endif
+    for (; i < num_keys; i++) {
+        idx += (keys[i] < key);
+    }
+    return idx;
+}
+
+int nodeLowerBoundExpense(const ExpenseKey* keys, int num_keys, ExpenseKey key){
+    int idx = 0;
+    int i = 0;
+#if defined(__AVX2__) || defined(__SSE4_2__)
+    //flip the sign bit so the signed 64-bit compare orders unsigned keys
+    const long long bias = (long long)0x8000000000000000ULL;
+#endif
+#if defined(__AVX2__)
+    __m256i needle = _mm256_set1_epi64x((long long)key ^ bias);
+    __m256i flip = _mm256_set1_epi64x(bias);
+    for (; i + 4 <= num_keys; i += 4) {
+        __m256i block = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), flip);
+        __m256i less = _mm256_cmpgt_epi64(needle, block);
+        idx += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+    }
+#elif defined(__SSE4_2__)
+    __m128i needle = _mm_set1_epi64x((long long)key ^ bias);
+    __m128i flip = _mm_set1_epi64x(bias);
+    for (; i + 2 <= num_keys; i += 2) {
+        __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), flip);
+        __m128i less = _mm_cmpgt_epi64(needle, block);
+        idx += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(less)));
+    }
+#endif
+    for (; i < num_keys; i++) {
+        idx += (keys[i] < key);
+    }
+    return idx;
+}
 
 BTreeNodeUser* createUserNode(bool is_leaf){
     BTreeNodeUser* node = (BTreeNodeUser*)malloc(sizeof(BTreeNodeUser));
@@ -192,8 +930,11 @@ BTreeNodeUser* createUserNode(bool is_leaf){
 }
 
 void insertUser(BTreeNodeUser** root, UserNode* user){
+    invalidateFrozenIndex();
+
     if(*root == NULL){
         *root = createUserNode(true);
+        (*root)->key_ids[0] = user->user_id;
         (*root)->keys[0] = user;
         (*root)->num_keys = 1;
     }
@@ -211,25 +952,21 @@ void insertUser(BTreeNodeUser** root, UserNode* user){
 }
 
 void insertUserNonFull(BTreeNodeUser* node, UserNode* user) {
-    int i = node->num_keys - 1;
+    int i = nodeLowerBound(node->key_ids, node->num_keys, user->user_id);
 
     if(node->is_leaf){
-        while (i >= 0 && user->user_id < node->keys[i]->user_id){
-            node->keys[i + 1] = node->keys[i];
-            i--;
+        for (int j = node->num_keys; j > i; j--) {
+            node->key_ids[j] = node->key_ids[j - 1];
+            node->keys[j] = node->keys[j - 1];
         }
-        node->keys[i + 1] = user;
+        node->key_ids[i] = user->user_id;
+        node->keys[i] = user;
         node->num_keys++;
     }
     else{
-        while (i >= 0 && user->user_id < node->keys[i]->user_id){
-            i--;
-        }
-        i++;
-
         if(node->children[i]->num_keys == M - 1){
             splitUserChild(node, i);
-            if (user->user_id > node->keys[i]->user_id){
+            if (user->user_id > node->key_ids[i]){
                 i++;
             }
         }
@@ -244,6 +981,7 @@ void splitUserChild(BTreeNodeUser* parent, int idx) {
 
     for (int j = 0; j < M / 2 - 1; j++) {
         new_child->keys[j] = child->keys[j + M / 2];
+        new_child->key_ids[j] = child->key_ids[j + M / 2];
     }
 
     if (!child->is_leaf) {
@@ -261,51 +999,34 @@ void splitUserChild(BTreeNodeUser* parent, int idx) {
 
     for (int j = parent->num_keys - 1; j >= idx; j--) {
         parent->keys[j + 1] = parent->keys[j];
+        parent->key_ids[j + 1] = parent->key_ids[j];
     }
     parent->keys[idx] = child->keys[M / 2 - 1];
+    parent->key_ids[idx] = child->key_ids[M / 2 - 1];
     parent->num_keys++;
 }
 
 UserNode* searchUser(BTreeNodeUser* root, int user_id){
     UserNode* ret_node = NULL;
-    if(!root){
-        ret_node =  NULL;
-    }
-    else{
-        int i = 0;
-        while (i < root->num_keys && user_id > root->keys[i]->user_id) {
-            i++;
-        }
+    while (root && !ret_node) {
+        int i = nodeLowerBound(root->key_ids, root->num_keys, user_id);
 
-        if(i < root->num_keys && user_id == root->keys[i]->user_id) {
+        if(i < root->num_keys && user_id == root->key_ids[i]) {
             ret_node = root->keys[i];
         }
-
-        else if(root->is_leaf) {
-            ret_node = NULL;
-        }
         else{
-            ret_node = searchUser(root->children[i], user_id);
-        }    
+            root = root->is_leaf ? NULL : root->children[i];
+        }
     }
     return ret_node;
-    
 }
 
 int findUserKeyIndex(BTreeNodeUser* node, int user_id){
-    int index = 0;
-    while (index < node->num_keys && user_id > node->keys[index]->user_id){
-        index++;
-    }
-    return index;
+    return nodeLowerBound(node->key_ids, node->num_keys, user_id);
 }
 
 int findFamilyKeyIndex(BTreeNodeFamily *node, int family_id){
-    int index = 0;
-    while (index < node->num_keys && family_id > node->keys[index]->family_id){
-        index++;
-    }
-    return index;
+    return nodeLowerBound(node->key_ids, node->num_keys, family_id);
 }
 
 int findExpenseKeyIndex(BTreeNodeExpense *node, int expense_id){
@@ -341,6 +1062,7 @@ void splitFamilyChild(BTreeNodeFamily *parent, int index){
     //move keys to the new node
     for(int i = 0; i < M/2 - 1; i++){
         newNode->keys[i] = child->keys[i + M/2];
+        newNode->key_ids[i] = child->key_ids[i + M/2];
     }
     
     if(!child->is_leaf){
@@ -362,39 +1084,36 @@ void splitFamilyChild(BTreeNodeFamily *parent, int index){
     //shift parent's keys to insert the middle key from the child
     for(int i = parent->num_keys - 1; i >= index; i--){
         parent->keys[i + 1] = parent->keys[i];
+        parent->key_ids[i + 1] = parent->key_ids[i];
     }
     
     //move the middle key from child to parent
     parent->keys[index] = child->keys[M/2 - 1];
+    parent->key_ids[index] = child->key_ids[M/2 - 1];
     parent->num_keys++;
 }
 
 //insert a family into a non-full node
 void insertFamilyNonFull(BTreeNodeFamily *node, FamilyNode* family) {
-    int i = node->num_keys - 1;
+    int i = nodeLowerBound(node->key_ids, node->num_keys, family->family_id);
     
     if(node->is_leaf){
         //insert key into the sorted order
-        while(i >= 0 && node->keys[i]->family_id > family->family_id){
-            node->keys[i + 1] = node->keys[i];
-            i--;
+        for (int j = node->num_keys; j > i; j--) {
+            node->key_ids[j] = node->key_ids[j - 1];
+            node->keys[j] = node->keys[j - 1];
         }
-        node->keys[i + 1] = family;
+        node->key_ids[i] = family->family_id;
+        node->keys[i] = family;
         node->num_keys++;
     }
     else{
-        // Find the child to insert the key
-        while(i >= 0 && node->keys[i]->family_id > family->family_id){
-            i--;
-        }
-        i++;
-        
         if(node->children[i]->num_keys == M - 1){
             // Split child if it's full
             splitFamilyChild(node, i);
             
             // Determine which of the two children is the new one
-            if(node->keys[i]->family_id < family->family_id){
+            if(node->key_ids[i] < family->family_id){
                 i++;
             }
         }
@@ -404,10 +1123,13 @@ void insertFamilyNonFull(BTreeNodeFamily *node, FamilyNode* family) {
 
 //insert a family into the B-tree
 void insertFamily(BTreeNodeFamily **root, FamilyNode* family){
+    invalidateFrozenIndex();
+
     BTreeNodeFamily *node = *root;
 
     if(node == NULL){
         *root = createFamilyNode(true);
+        (*root)->key_ids[0] = family->family_id;
         (*root)->keys[0] = family;
         (*root)->num_keys = 1;
     }
@@ -421,7 +1143,7 @@ void insertFamily(BTreeNodeFamily **root, FamilyNode* family){
             
             //determine which child to insert into
             int i = 0;
-            if (new_root->keys[0]->family_id < family->family_id) {
+            if (new_root->key_ids[0] < family->family_id) {
                 i++;
             }
             insertFamilyNonFull(new_root->children[i], family);
@@ -440,7 +1162,7 @@ FamilyNode *searchFamily(BTreeNodeFamily *root, int family_id){
     else{
         int index = findFamilyKeyIndex(root, family_id);
     
-        if(index < root->num_keys && root->keys[index]->family_id == family_id) {
+        if(index < root->num_keys && root->key_ids[index] == family_id) {
             ret_node = root->keys[index];
         }
         
@@ -471,6 +1193,23 @@ BTreeNodeExpense *createExpenseNode(bool is_leaf){
     return newNode;
 }
 
+// Free the nodes of a tree; the records are not freed
+void releaseExpenseTree(BTreeNodeExpense* root){
+    if (root) {
+        if (!root->is_leaf) {
+            for (int i = 0; i <= root->num_keys; i++) {
+                releaseExpenseTree(root->children[i]);
+            }
+        }
+        free(root);
+    }
+}
+
+ExpenseKey makeExpenseKey(int user_id, int expense_id){
+    return ((ExpenseKey)((unsigned int)user_id ^ 0x80000000u) << 32) |
+           (ExpenseKey)((unsigned int)expense_id ^ 0x80000000u);
+}
+
 void splitExpenseChild(BTreeNodeExpense *parent, int index){
     BTreeNodeExpense *child = parent->children[index];
     BTreeNodeExpense *newNode = createExpenseNode(child->is_leaf);
@@ -479,6 +1218,7 @@ void splitExpenseChild(BTreeNodeExpense *parent, int index){
     
     // Move keys to the new node
     for (int i = 0; i < M/2 - 1; i++){
+        newNode->key_codes[i] = child->key_codes[i + M/2];
         newNode->keys[i] = child->keys[i + M/2];
     }
     
@@ -500,56 +1240,49 @@ void splitExpenseChild(BTreeNodeExpense *parent, int index){
     
     //shift parent's keys to insert the middle key from the child
     for (int i = parent->num_keys - 1; i >= index; i--) {
+        parent->key_codes[i + 1] = parent->key_codes[i];
         parent->keys[i + 1] = parent->keys[i];
     }
     
     //move the middle key from child to parent
+    parent->key_codes[index] = child->key_codes[M/2 - 1];
     parent->keys[index] = child->keys[M/2 - 1];
     parent->num_keys++;
 }
 
-void insertExpenseNonFull(BTreeNodeExpense* node, ExpenseNode* expense){
-    int i = node->num_keys - 1;
+void insertExpenseNonFull(BTreeNodeExpense* node, ExpenseKey key, ExpenseNode* expense){
+    int i = find_key_index_expense(node, key);
     
     if(node->is_leaf){
-        while(i >= 0 && 
-              (node->keys[i]->user_id > expense->user_id ||
-               (node->keys[i]->user_id == expense->user_id && 
-                node->keys[i]->expense_id > expense->expense_id))){
-            node->keys[i + 1] = node->keys[i];
-            i--;
-        }
-        node->keys[i + 1] = expense;
+        for (int j = node->num_keys; j > i; j--) {
+            node->key_codes[j] = node->key_codes[j - 1];
+            node->keys[j] = node->keys[j - 1];
+        }
+        node->key_codes[i] = key;
+        node->keys[i] = expense;
         node->num_keys++;
     }
     else{
-        //find child to insert into
-        while(i >= 0 && 
-              (node->keys[i]->user_id > expense->user_id ||
-               (node->keys[i]->user_id == expense->user_id && 
-                node->keys[i]->expense_id > expense->expense_id))){
-            i--;
-        }
-        i++;
-        
         if(node->children[i]->num_keys == M - 1){
             splitExpenseChild(node, i);
-            if (node->keys[i]->user_id < expense->user_id ||
-                (node->keys[i]->user_id == expense->user_id && 
-                 node->keys[i]->expense_id < expense->expense_id)){
+            if (node->key_codes[i] < key){
                 i++;
             }
         }
-        insertExpenseNonFull(node->children[i], expense);
+        insertExpenseNonFull(node->children[i], key, expense);
     }
 }
 
 // Insert an expense into the B-tree
 void insertExpense(BTreeNodeExpense **root, ExpenseNode* expense) {
+    invalidateFrozenIndex();
+
     BTreeNodeExpense *node = *root;
+    ExpenseKey key = makeExpenseKey(expense->user_id, expense->expense_id);
 
     if(node == NULL){
         *root = createExpenseNode(true);
+        (*root)->key_codes[0] = key;
         (*root)->keys[0] = expense;
         (*root)->num_keys = 1;
     }
@@ -563,21 +1296,135 @@ void insertExpense(BTreeNodeExpense **root, ExpenseNode* expense) {
             
             //determine which child to insert into
             int i = 0;
-            if(new_root->keys[0]->expense_id < expense->expense_id){
+            if(new_root->key_codes[0] < key){
                 i++;
             }
-            insertExpenseNonFull(new_root->children[i], expense);
+            insertExpenseNonFull(new_root->children[i], key, expense);
         }
         else{
-            insertExpenseNonFull(node, expense);
+            insertExpenseNonFull(node, key, expense);
+        }
+    }
+}
+
+//murmur3 finaliser; the seed chains several values into one hash
+static unsigned int mixHashKey(unsigned int key, unsigned int seed){
+    key ^= seed;
+    key ^= key >> 16;
+    key *= 0x85ebca6bu;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35u;
+    key ^= key >> 16;
+    return key;
+}
+
+//slot holding key, or the free slot where it would go
+static int expenseIndexSlot(ExpenseKey key){
+    int mask = expense_id_index.capacity - 1;
+    int pos = mixHashKey((unsigned int)key, (unsigned int)(key >> 32)) & mask;
+    while (expense_id_index.expenses[pos] && expense_id_index.keys[pos] != key) {
+        pos = (pos + 1) & mask;
+    }
+    return pos;
+}
+
+static bool growExpenseIdIndex(){
+    int new_capacity = (expense_id_index.capacity == 0) ? 1024 : expense_id_index.capacity * 2;
+    ExpenseKey* keys = (ExpenseKey*)malloc(new_capacity * sizeof(ExpenseKey));
+    ExpenseNode** expenses = (ExpenseNode**)calloc(new_capacity, sizeof(ExpenseNode*));
+    if (!keys || !expenses) {
+        printf("Failed to allocate memory for expense index\n");
+        free(keys);
+        free(expenses);
+        return false;
+    }
+
+    int old_capacity = expense_id_index.capacity;
+    ExpenseKey* old_keys = expense_id_index.keys;
+    ExpenseNode** old_expenses = expense_id_index.expenses;
+    expense_id_index.keys = keys;
+    expense_id_index.expenses = expenses;
+    expense_id_index.capacity = new_capacity;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_expenses[i]) {
+            int pos = expenseIndexSlot(old_keys[i]);
+            keys[pos] = old_keys[i];
+            expenses[pos] = old_expenses[i];
+        }
+    }
+    free(old_keys);
+    free(old_expenses);
+    return true;
+}
+
+ExpenseNode* expenseIndexFind(int user_id, int expense_id){
+    ExpenseNode* ret_node = NULL;
+    if (expense_id_index.count > 0) {
+        ret_node = expense_id_index.expenses[expenseIndexSlot(makeExpenseKey(user_id, expense_id))];
+    }
+    return ret_node;
+}
+
+void expenseIndexInsert(ExpenseNode* expense){
+    if ((expense_id_index.count + 1) * 10 > expense_id_index.capacity * 7 && !growExpenseIdIndex()) {
+        expense_id_index.partial = true;
+        return;
+    }
+    ExpenseKey key = makeExpenseKey(expense->user_id, expense->expense_id);
+    int pos = expenseIndexSlot(key);
+    if (!expense_id_index.expenses[pos]) {
+        expense_id_index.count++;
+    }
+    expense_id_index.keys[pos] = key;
+    expense_id_index.expenses[pos] = expense;
+}
+
+// Later entries of the probe run are shifted back into the gap, so lookups
+// never stop early
+void expenseIndexRemove(ExpenseNode* expense){
+    if (expense_id_index.count == 0) {
+        return;
+    }
+    int gap = expenseIndexSlot(makeExpenseKey(expense->user_id, expense->expense_id));
+    if (expense_id_index.expenses[gap] != expense) {
+        return;
+    }
+    int mask = expense_id_index.capacity - 1;
+    int pos = (gap + 1) & mask;
+    while (expense_id_index.expenses[pos]) {
+        ExpenseKey key = expense_id_index.keys[pos];
+        int home = mixHashKey((unsigned int)key, (unsigned int)(key >> 32)) & mask;
+        //move the entry unless its home lies cyclically in (gap, pos]
+        if (((pos - home) & mask) >= ((pos - gap) & mask)) {
+            expense_id_index.keys[gap] = key;
+            expense_id_index.expenses[gap] = expense_id_index.expenses[pos];
+            gap = pos;
         }
+        pos = (pos + 1) & mask;
     }
+    expense_id_index.expenses[gap] = NULL;
+    expense_id_index.count--;
+}
+
+void freeExpenseIdIndex(){
+    free(expense_id_index.keys);
+    free(expense_id_index.expenses);
+    expense_id_index.keys = NULL;
+    expense_id_index.expenses = NULL;
+    expense_id_index.count = 0;
+    expense_id_index.capacity = 0;
+    expense_id_index.partial = false;
 }
 
 ExpenseNode* searchExpenseForUser(UserNode* user, int expense_id) {
     if (!user){
         return NULL;
-    }  
+    }
+    if (!expense_id_index.partial) {
+        return expenseIndexFind(user->user_id, expense_id);
+    }
+    //buffered expenses are only in the index until they are compacted
+    lsmCompact();
     ExpenseNode* current = user->expenses_head;
     while (current) {
         if (current->expense_id == expense_id) {
@@ -590,363 +1437,5101 @@ ExpenseNode* searchExpenseForUser(UserNode* user, int expense_id) {
 
 // Search for an expense in the B-tree
 ExpenseNode* searchExpense(BTreeNodeExpense* root, int user_id, int expense_id){
-    if(root == NULL){
-        return NULL;
-    }
-    
-    int i = 0;
-    while(i < root->num_keys && 
-          (root->keys[i]->user_id < user_id || 
-           (root->keys[i]->user_id == user_id && 
-            root->keys[i]->expense_id < expense_id))){
-        i++;
-    }
-    
-    if(i < root->num_keys && 
-        root->keys[i]->user_id == user_id && 
-        root->keys[i]->expense_id == expense_id){
-        return root->keys[i];
+    ExpenseKey key = makeExpenseKey(user_id, expense_id);
+
+    while(root != NULL){
+        int i = find_key_index_expense(root, key);
+        if(i < root->num_keys && root->key_codes[i] == key){
+            return root->keys[i]->tombstone ? NULL : root->keys[i];
+        }
+        root = root->is_leaf ? NULL : root->children[i];
     }
-    
-    return root->is_leaf ? NULL : searchExpense(root->children[i], user_id, expense_id);
+    return NULL;
 }
 
 
-UserNode* addUser(int user_id, const char* name, float income){
-    UserNode* ret_node;
-    if(searchUser(user_root, user_id)){
-        ret_node = NULL; //user already exists
+static unsigned int hashString(const char* str, size_t len){
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
     }
-    else{
-        UserNode* new_user = (UserNode*)malloc(sizeof(UserNode));
-        new_user->user_id = user_id;
-        strncpy(new_user->user_name, name, NAME_LEN);
-        new_user->income = income;
-        new_user->family = NULL;
-        new_user->expenses_head = NULL;
-        new_user->expense_count = 0;
-        new_user->total_expense = 0.0f;
-        memset(new_user->category_expenses, 0, sizeof(new_user->category_expenses));
+    return hash;
+}
 
-        insertUser(&user_root, new_user);
-        ret_node = new_user;
-    }
-    
-    return ret_node;
+static char* stringPoolAlloc(StringPool* pool, size_t size){
+    StringPoolBlock* block = pool->blocks;
+    if (!block || block->size - block->used < size) {
+        size_t block_size = (size > STRING_POOL_BLOCK_SIZE) ? size : STRING_POOL_BLOCK_SIZE;
+        block = (StringPoolBlock*)malloc(sizeof(StringPoolBlock) + block_size);
+        if (!block) {
+            printf("Failed to allocate memory for string pool\n");
+            return NULL;
+        }
+        block->used = 0;
+        block->size = block_size;
+        block->next = pool->blocks;
+        pool->blocks = block;
+    }
+    char* ret = block->data + block->used;
+    block->used += size;
+    return ret;
 }
 
-FamilyNode* createFamily(int family_id, const char* family_name){
-    FamilyNode* ret_node;
-    if(searchFamily(family_root, family_id)){
-        ret_node = NULL; //Family already exists
+static bool growStringPool(StringPool* pool){
+    int new_capacity = (pool->capacity == 0) ? 64 : pool->capacity * 2;
+    const char** slots = (const char**)calloc(new_capacity, sizeof(const char*));
+    if (!slots) {
+        printf("Failed to allocate memory for string pool\n");
+        return false;
     }
-    else{
-        FamilyNode* new_family = (FamilyNode*)malloc(sizeof(FamilyNode));
-        new_family->family_id = family_id;
-        strncpy(new_family->family_name, family_name, NAME_LEN);
-        new_family->member_count = 0;
-        new_family->total_income = 0.0f;
-        new_family->total_expense = 0.0f;
-        memset(new_family->category_expenses, 0, sizeof(new_family->category_expenses));
-        for (int i = 0; i < MAX_FAMILY_MEMBERS; i++) {
-            new_family->members[i] = NULL;
+    for (int i = 0; i < pool->capacity; i++) {
+        if (pool->slots[i]) {
+            int pos = hashString(pool->slots[i], strlen(pool->slots[i])) & (new_capacity - 1);
+            while (slots[pos]) {
+                pos = (pos + 1) & (new_capacity - 1);
+            }
+            slots[pos] = pool->slots[i];
         }
-
-        insertFamily(&family_root, new_family);
-        ret_node = new_family;
     }
-    
-    return ret_node;
+    free(pool->slots);
+    pool->slots = slots;
+    pool->capacity = new_capacity;
+    return true;
 }
 
-bool joinFamily(int user_id, int family_id){
+// Return the pooled copy of str (truncated to NAME_LEN-1), adding it if new
+const char* internString(StringPool* pool, const char* str){
+    size_t len = strlen(str);
+    if (len > NAME_LEN - 1) {
+        len = NAME_LEN - 1;
+    }
+
+    if ((pool->count + 1) * 10 > pool->capacity * 7 && !growStringPool(pool)) {
+        return NULL;
+    }
+
+    int pos = hashString(str, len) & (pool->capacity - 1);
+    while (pool->slots[pos]) {
+        if (strncmp(pool->slots[pos], str, len) == 0 && pool->slots[pos][len] == '\0') {
+            return pool->slots[pos];
+        }
+        pos = (pos + 1) & (pool->capacity - 1);
+    }
+
+    char* copy = stringPoolAlloc(pool, len + 1);
+    if (copy) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+        pool->slots[pos] = copy;
+        pool->count++;
+    }
+    return copy;
+}
+
+void freeStringPool(StringPool* pool){
+    StringPoolBlock* block = pool->blocks;
+    while (block) {
+        StringPoolBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    free(pool->slots);
+    pool->blocks = NULL;
+    pool->slots = NULL;
+    pool->count = 0;
+    pool->capacity = 0;
+}
+
+//yyyymm of a packed date
+int monthKey(DateKey date){
+    return (int)(date / 100);
+}
+
+//first partition whose month_key is not less than month_key
+static int partitionLowerBound(int month_key){
+    int lo = 0;
+    int hi = expense_store.count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (expense_store.partitions[mid].month_key < month_key) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+ExpensePartition* findPartition(int month_key){
+    int pos = partitionLowerBound(month_key);
+    ExpensePartition* ret_part = NULL;
+    if (pos < expense_store.count && expense_store.partitions[pos].month_key == month_key) {
+        ret_part = &expense_store.partitions[pos];
+    }
+    return ret_part;
+}
+
+ExpensePartition* getOrCreatePartition(int month_key){
+    int pos = partitionLowerBound(month_key);
+    if (pos < expense_store.count && expense_store.partitions[pos].month_key == month_key) {
+        return &expense_store.partitions[pos];
+    }
+
+    if (expense_store.count == expense_store.capacity) {
+        int new_capacity = (expense_store.capacity == 0) ? 16 : expense_store.capacity * 2;
+        ExpensePartition* grown = (ExpensePartition*)realloc(expense_store.partitions,
+                                                             new_capacity * sizeof(ExpensePartition));
+        if (!grown) {
+            printf("Failed to allocate memory for expense partition\n");
+            return NULL;
+        }
+        expense_store.partitions = grown;
+        expense_store.capacity = new_capacity;
+    }
+
+    memmove(&expense_store.partitions[pos + 1], &expense_store.partitions[pos],
+            (expense_store.count - pos) * sizeof(ExpensePartition));
+    ExpensePartition* part = &expense_store.partitions[pos];
+    part->month_key = month_key;
+    part->root = NULL;
+    part->compressed = NULL;
+    part->expense_count = 0;
+    part->tombstone_count = 0;
+    part->total_expense = 0.0f;
+    memset(part->category_expenses, 0, sizeof(part->category_expenses));
+    expense_store.count++;
+    return part;
+}
+
+void removeEmptyPartition(ExpensePartition* partition){
+    if (partition->expense_count == 0 && partition->tombstone_count == 0) {
+        int pos = (int)(partition - expense_store.partitions);
+        memmove(&expense_store.partitions[pos], &expense_store.partitions[pos + 1],
+                (expense_store.count - pos - 1) * sizeof(ExpensePartition));
+        expense_store.count--;
+    }
+}
+
+// Insert an expense into the tree of its month and update that month's totals
+void addToPartition(ExpenseNode* expense){
+    ExpensePartition* part = getOrCreatePartition(monthKey(expense->date));
+    if (part) {
+        if (!part->tombstone_count || !reviveTombstone(part, expense)) {
+            insertExpense(&part->root, expense);
+        }
+        part->expense_count++;
+        part->total_expense += expense->amount;
+        part->category_expenses[expense->category] += expense->amount;
+    }
+}
+
+void removeFromPartition(ExpenseNode* expense){
+    lsmCompact();
+    ExpensePartition* part = findPartition(monthKey(expense->date));
+    if (part && deleteExpense(&part->root, expense->user_id, expense->expense_id)) {
+        part->expense_count--;
+        part->total_expense -= expense->amount;
+        part->category_expenses[expense->category] -= expense->amount;
+        removeEmptyPartition(part);
+    }
+}
+
+static bool expenseInRange(const ExpenseRange* range, int user_id, int expense_id, DateKey date){
+    ExpenseKey key = makeExpenseKey(user_id, expense_id);
+    return key >= range->low_key && key <= range->high_key &&
+           date >= range->first_date && date <= range->last_date;
+}
+
+// Drop a user's expenses in range from its lists, closing their versions.
+// Totals are adjusted once per category. Returns the number dropped.
+static int pruneUserExpenses(UserNode* user, const ExpenseRange* range){
+    float category_sums[MAX_CATEGORIES] = {0};
+    int pruned = 0;
+    ExpenseNode* expense = user->expenses_head;
+    while (expense) {
+        ExpenseNode* next = expense->next;
+        if (expenseInRange(range, expense->user_id, expense->expense_id, expense->date)) {
+            closeExpenseVersion(expense);
+            unlinkExpenseLists(user, expense);
+            category_sums[expense->category] += expense->amount;
+            pruned++;
+        }
+        expense = next;
+    }
+
+    user->expense_count -= pruned;
+    for (int c = 0; c < MAX_CATEGORIES; c++) {
+        if (category_sums[c] != 0.0f) {
+            adjustExpenseTotals(user, c, -category_sums[c]);
+        }
+    }
+    return pruned;
+}
+
+static void pruneUserTreeExpenses(BTreeNodeUser* root, const ExpenseRange* range){
+    if (root) {
+        for (int i = 0; i < root->num_keys; i++) {
+            if (!root->is_leaf) {
+                pruneUserTreeExpenses(root->children[i], range);
+            }
+            pruneUserExpenses(root->keys[i], range);
+        }
+        if (!root->is_leaf) {
+            pruneUserTreeExpenses(root->children[root->num_keys], range);
+        }
+    }
+}
+
+//take a compressed record out of its user's totals and history
+static void dropColdExpense(UserNode* user, const ExpenseRecord* record){
+    user->expense_count--;
+    adjustExpenseTotals(user, record->category, -record->amount);
+    for (ExpenseVersion* version = user->details->history; version; version = version->next) {
+        if (version->expense_id == record->expense_id && version->valid_to == VERSION_CURRENT) {
+            version->valid_to = store_version;
+            break;
+        }
+    }
+}
+
+//take a month's compressed records out of their users' totals and histories
+static void dropCompressedExpenses(ExpensePartition* part){
+    ExpenseRecord* records;
+    int count = decodeCompressedMonth(part, &records);
+    UserNode* user = NULL;
+    for (int i = 0; i < count; i++) {
+        if (!user || user->user_id != records[i].user_id) {
+            user = searchUser(user_root, records[i].user_id);
+        }
+        if (user) {
+            dropColdExpense(user, &records[i]);
+        }
+    }
+    free(records);
+    releaseCompressedMonth(part->compressed);
+    part->compressed = NULL;
+}
+
+// Drop every month before year/month. Whole partition trees are freed without
+// any per-record rebalancing; users are unlinked in a single pass over them.
+int dropExpensesBefore(int year, int month){
+    invalidateFrozenIndex();
+    lsmCompact();
+
+    int cutoff_key = year * 100 + month;
+    int drop_count = partitionLowerBound(cutoff_key);
+    int dropped = 0;
+
+    if (drop_count > 0) {
+        store_version++;
+        clearReportCache();
+        ExpenseRange range = {makeExpenseKey(INT_MIN, INT_MIN), makeExpenseKey(INT_MAX, INT_MAX),
+                              0, (DateKey)cutoff_key * 100};
+        pruneUserTreeExpenses(user_root, &range);
+
+        for (int i = 0; i < drop_count; i++) {
+            dropped += expense_store.partitions[i].expense_count;
+            dropCompressedExpenses(&expense_store.partitions[i]);
+            freeExpenseTree(expense_store.partitions[i].root);
+        }
+        memmove(&expense_store.partitions[0], &expense_store.partitions[drop_count],
+                (expense_store.count - drop_count) * sizeof(ExpensePartition));
+        expense_store.count -= drop_count;
+        compactHistory();
+    }
+    return dropped;
+}
+
+// Record the current state of an expense as a new entry in its user's history
+void openExpenseVersion(UserNode* user, ExpenseNode* expense){
+    ExpenseVersion* version = (ExpenseVersion*)malloc(sizeof(ExpenseVersion));
+    if (!version) {
+        printf("Failed to allocate memory for expense history\n");
+        expense->version = NULL;
+        return;
+    }
+    version->expense_id = expense->expense_id;
+    version->category = expense->category;
+    version->amount = expense->amount;
+    version->date = expense->date;
+    version->valid_from = store_version;
+    version->valid_to = VERSION_CURRENT;
+    version->next = user->details->history;
+    user->details->history = version;
+    expense->version = version;
+}
+
+// End the live state of an expense at the current version
+void closeExpenseVersion(ExpenseNode* expense){
+    if (expense->version) {
+        expense->version->valid_to = store_version;
+        expense->version = NULL;
+    }
+}
+
+bool isCurrentVersion(long as_of){
+    return as_of < 0 || as_of >= store_version;
+}
+
+// Totals of a user's expenses as they stood at version as_of. The history is
+// newest first, so entries created after as_of are skipped before any test.
+// Archived and paged expenses have not changed since the history horizon and
+// count through the folded totals.
+float userExpenseAsOf(UserNode* user, long as_of, float* category_expenses){
+    float total = 0.0f;
+    for (int c = 0; c < MAX_CATEGORIES; c++) {
+        total += user->details->folded_expenses[c];
+        if (category_expenses) {
+            category_expenses[c] = user->details->folded_expenses[c];
+        }
+    }
+    ExpenseVersion* version = user->details->history;
+    while (version && version->valid_from > as_of) {
+        version = version->next;
+    }
+    for (; version; version = version->next) {
+        if (as_of < version->valid_to) {
+            total += version->amount;
+            if (category_expenses) {
+                category_expenses[version->category] += version->amount;
+            }
+        }
+    }
+    return total;
+}
+
+//free a user's history entries no as-of report can reach. A live entry whose
+//expense is neither in the user's lists nor in a resident compressed month has
+//moved to the archive or the page file, so its amount is folded in.
+static void compactUserHistory(UserNode* user){
+    ExpenseVersion** link = &user->details->history;
+    while (*link) {
+        ExpenseVersion* version = *link;
+        bool keep = version->valid_to == VERSION_CURRENT;
+        if (keep && !searchExpenseForUser(user, version->expense_id) &&
+            !findPartition(monthKey(version->date))) {
+            user->details->folded_expenses[version->category] += version->amount;
+            keep = false;
+        }
+        if (keep) {
+            link = &version->next;
+        }
+        else {
+            *link = version->next;
+            free(version);
+        }
+    }
+}
+
+static void compactUserTreeHistory(BTreeNodeUser* root){
+    if (root) {
+        for (int i = 0; i < root->num_keys; i++) {
+            if (!root->is_leaf) {
+                compactUserTreeHistory(root->children[i]);
+            }
+            compactUserHistory(root->keys[i]);
+        }
+        if (!root->is_leaf) {
+            compactUserTreeHistory(root->children[root->num_keys]);
+        }
+    }
+}
+
+// Move the history horizon up to the current version and free every entry
+// only older versions could see. Called once months leave memory or are
+// purged, since the cold tiers keep no history of their own.
+void compactHistory(){
+    history_horizon = store_version;
+    compactUserTreeHistory(user_root);
+}
+
+// Open the paged store at path, creating an empty file if create is set
+bool pagedStoreOpen(PagedExpenseStore* store, const char* path, int frame_count, bool create){
+    FILE* file = fopen(path, "r+b");
+    PagedStoreHeader header = {PAGED_STORE_MAGIC, 0, 1, 0, 0};
+    if (file) {
+        if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != PAGED_STORE_MAGIC) {
+            printf("%s is not an expense page file\n", path);
+            fclose(file);
+            return false;
+        }
+    }
+    else if (create) {
+        file = fopen(path, "w+b");
+    }
+    if (!file) {
+        if (create) {
+            perror("Error opening page file");
+        }
+        return false;
+    }
+
+    store->frames = (BufferFrame*)calloc(frame_count, sizeof(BufferFrame));
+    if (!store->frames) {
+        printf("Failed to allocate memory for buffer pool\n");
+        fclose(file);
+        return false;
+    }
+    store->file = file;
+    store->frame_count = frame_count;
+    store->clock_hand = 0;
+    store->root_page = header.root_page;
+    store->page_count = header.page_count;
+    store->record_count = header.record_count;
+    store->cutoff_month = header.cutoff_month;
+    store->page_reads = 0;
+    store->page_writes = 0;
+    return true;
+}
+
+static bool writeFrame(PagedExpenseStore* store, BufferFrame* frame){
+    bool ok = fseek(store->file, (long)frame->page_id * PAGE_SIZE, SEEK_SET) == 0 &&
+              fwrite(&frame->page, sizeof(ExpensePage), 1, store->file) == 1;
+    if (ok) {
+        frame->dirty = false;
+        store->page_writes++;
+    }
+    else {
+        printf("Failed to write page %u\n", frame->page_id);
+    }
+    return ok;
+}
+
+// Write back every dirty page and the header
+bool pagedStoreFlush(PagedExpenseStore* store){
+    bool ok = store->file != NULL;
+    for (int i = 0; ok && i < store->frame_count; i++) {
+        if (store->frames[i].used && store->frames[i].dirty) {
+            ok = writeFrame(store, &store->frames[i]);
+        }
+    }
+    if (ok) {
+        PagedStoreHeader header = {PAGED_STORE_MAGIC, store->root_page, store->page_count, store->record_count,
+                                   store->cutoff_month};
+        ok = fseek(store->file, 0, SEEK_SET) == 0 &&
+             fwrite(&header, sizeof(header), 1, store->file) == 1 &&
+             fflush(store->file) == 0;
+    }
+    return ok;
+}
+
+void pagedStoreClose(PagedExpenseStore* store){
+    if (store->file) {
+        pagedStoreFlush(store);
+        fclose(store->file);
+        free(store->frames);
+        store->file = NULL;
+        store->frames = NULL;
+        store->frame_count = 0;
+    }
+}
+
+// Pick a frame for a new page: the clock hand skips pinned frames and clears
+// the referenced bit of recently used ones before taking one
+static BufferFrame* evictFrame(PagedExpenseStore* store){
+    for (int step = 0; step < 2 * store->frame_count; step++) {
+        BufferFrame* frame = &store->frames[store->clock_hand];
+        store->clock_hand = (store->clock_hand + 1) % store->frame_count;
+        if (!frame->used) {
+            return frame;
+        }
+        if (frame->pin_count == 0) {
+            if (frame->referenced) {
+                frame->referenced = false;
+            }
+            else if (!frame->dirty || writeFrame(store, frame)) {
+                frame->used = false;
+                return frame;
+            }
+        }
+    }
+    printf("Buffer pool exhausted: all %d pages are pinned\n", store->frame_count);
+    return NULL;
+}
+
+// Bring a page into the pool and pin it; unpinPage must be called once done
+ExpensePage* pinPage(PagedExpenseStore* store, unsigned int page_id){
+    for (int i = 0; i < store->frame_count; i++) {
+        BufferFrame* frame = &store->frames[i];
+        if (frame->used && frame->page_id == page_id) {
+            frame->pin_count++;
+            frame->referenced = true;
+            return &frame->page;
+        }
+    }
+
+    BufferFrame* frame = evictFrame(store);
+    if (!frame) {
+        return NULL;
+    }
+    if (fseek(store->file, (long)page_id * PAGE_SIZE, SEEK_SET) != 0 ||
+        fread(&frame->page, sizeof(ExpensePage), 1, store->file) != 1) {
+        printf("Failed to read page %u\n", page_id);
+        return NULL;
+    }
+    store->page_reads++;
+    frame->page_id = page_id;
+    frame->used = true;
+    frame->dirty = false;
+    frame->referenced = true;
+    frame->pin_count = 1;
+    return &frame->page;
+}
+
+void unpinPage(PagedExpenseStore* store, ExpensePage* page, bool dirty){
+    BufferFrame* frame = (BufferFrame*)((char*)page - offsetof(BufferFrame, page));
+    frame->pin_count--;
+    frame->dirty = frame->dirty || dirty;
+    (void)store;
+}
+
+// Append a new page to the file and return it pinned and dirty
+static ExpensePage* allocatePage(PagedExpenseStore* store, bool is_leaf){
+    BufferFrame* frame = evictFrame(store);
+    if (!frame) {
+        return NULL;
+    }
+    memset(&frame->page, 0, sizeof(ExpensePage));
+    frame->page.page_id = store->page_count++;
+    frame->page.is_leaf = is_leaf;
+    frame->page_id = frame->page.page_id;
+    frame->used = true;
+    frame->dirty = true;
+    frame->referenced = true;
+    frame->pin_count = 1;
+    return &frame->page;
+}
+
+// Split the full child at index of parent; both pages are pinned by the caller
+static bool splitPageChild(PagedExpenseStore* store, ExpensePage* parent, int index, ExpensePage* child){
+    ExpensePage* sibling = allocatePage(store, child->is_leaf);
+    if (!sibling) {
+        return false;
+    }
+    int t = PAGE_MIN_DEGREE;
+    sibling->num_keys = t - 1;
+    memcpy(sibling->key_codes, &child->key_codes[t], (t - 1) * sizeof(ExpenseKey));
+    memcpy(sibling->records, &child->records[t], (t - 1) * sizeof(ExpenseRecord));
+    if (!child->is_leaf) {
+        memcpy(sibling->children, &child->children[t], t * sizeof(unsigned int));
+    }
+    child->num_keys = t - 1;
+
+    memmove(&parent->children[index + 2], &parent->children[index + 1],
+            (parent->num_keys - index) * sizeof(unsigned int));
+    memmove(&parent->key_codes[index + 1], &parent->key_codes[index],
+            (parent->num_keys - index) * sizeof(ExpenseKey));
+    memmove(&parent->records[index + 1], &parent->records[index],
+            (parent->num_keys - index) * sizeof(ExpenseRecord));
+    parent->children[index + 1] = sibling->page_id;
+    parent->key_codes[index] = child->key_codes[t - 1];
+    parent->records[index] = child->records[t - 1];
+    parent->num_keys++;
+    unpinPage(store, sibling, true);
+    return true;
+}
+
+// Insert a record, replacing any stored record with the same key. Full pages
+// are split on the way down, so at most three pages are pinned at a time.
+bool pagedInsert(PagedExpenseStore* store, const ExpenseRecord* record){
+    ExpenseKey key = makeExpenseKey(record->user_id, record->expense_id);
+    ExpensePage* node;
+
+    if (store->root_page == 0) {
+        node = allocatePage(store, true);
+        if (!node) {
+            return false;
+        }
+        store->root_page = node->page_id;
+    }
+    else {
+        node = pinPage(store, store->root_page);
+        if (!node) {
+            return false;
+        }
+        if (node->num_keys == PAGE_MAX_KEYS) {
+            ExpensePage* new_root = allocatePage(store, false);
+            if (!new_root) {
+                unpinPage(store, node, false);
+                return false;
+            }
+            new_root->children[0] = node->page_id;
+            if (!splitPageChild(store, new_root, 0, node)) {
+                unpinPage(store, node, false);
+                unpinPage(store, new_root, false);
+                return false;
+            }
+            store->root_page = new_root->page_id;
+            unpinPage(store, node, true);
+            node = new_root;
+        }
+    }
+
+    while (true) {
+        int i = nodeLowerBoundExpense(node->key_codes, node->num_keys, key);
+        if (i < node->num_keys && node->key_codes[i] == key) {
+            node->records[i] = *record;
+            break;
+        }
+        if (node->is_leaf) {
+            memmove(&node->key_codes[i + 1], &node->key_codes[i], (node->num_keys - i) * sizeof(ExpenseKey));
+            memmove(&node->records[i + 1], &node->records[i], (node->num_keys - i) * sizeof(ExpenseRecord));
+            node->key_codes[i] = key;
+            node->records[i] = *record;
+            node->num_keys++;
+            store->record_count++;
+            break;
+        }
+
+        ExpensePage* child = pinPage(store, node->children[i]);
+        if (!child) {
+            unpinPage(store, node, true);
+            return false;
+        }
+        if (child->num_keys == PAGE_MAX_KEYS) {
+            if (!splitPageChild(store, node, i, child)) {
+                unpinPage(store, child, false);
+                unpinPage(store, node, true);
+                return false;
+            }
+            unpinPage(store, child, true);
+            if (node->key_codes[i] == key) {
+                node->records[i] = *record;
+                break;
+            }
+            child = pinPage(store, node->children[i + (key > node->key_codes[i])]);
+            if (!child) {
+                unpinPage(store, node, true);
+                return false;
+            }
+        }
+        unpinPage(store, node, true);
+        node = child;
+    }
+    unpinPage(store, node, true);
+    return true;
+}
+
+bool pagedSearch(PagedExpenseStore* store, int user_id, int expense_id, ExpenseRecord* out){
+    ExpenseKey key = makeExpenseKey(user_id, expense_id);
+    unsigned int page_id = store->file ? store->root_page : 0;
+    bool found = false;
+    while (page_id != 0 && !found) {
+        ExpensePage* page = pinPage(store, page_id);
+        if (!page) {
+            break;
+        }
+        int i = nodeLowerBoundExpense(page->key_codes, page->num_keys, key);
+        if (i < page->num_keys && page->key_codes[i] == key) {
+            *out = page->records[i];
+            found = true;
+        }
+        page_id = page->is_leaf ? 0 : page->children[i];
+        unpinPage(store, page, false);
+    }
+    return found;
+}
+
+static int pagedPrintSubtree(FILE* out, PagedExpenseStore* store, unsigned int page_id, ExpenseKey low, ExpenseKey high,
+                             DateKey start, DateKey end, float* total){
+    ExpensePage* page = pinPage(store, page_id);
+    if (!page) {
+        return 0;
+    }
+    int count = 0;
+    int i = nodeLowerBoundExpense(page->key_codes, page->num_keys, low);
+    for (; i <= page->num_keys; i++) {
+        if (!page->is_leaf) {
+            count += pagedPrintSubtree(out, store, page->children[i], low, high, start, end, total);
+        }
+        if (i == page->num_keys || page->key_codes[i] > high) {
+            break;
+        }
+        ExpenseRecord* record = &page->records[i];
+        if (dateInRange(record->date, start, end)) {
+            fprintf(out, "User: %d, ID: %d, Amount: %.2f, Category: %s, Date: %d/%d/%d (on disk)\n",
+                   record->user_id, record->expense_id, record->amount,
+                   category_names[record->category],
+                   DATE_DAY(record->date), DATE_MONTH(record->date), DATE_YEAR(record->date));
+            if (total) {
+                *total += record->amount;
+            }
+            count++;
+        }
+    }
+    unpinPage(store, page, false);
+    return count;
+}
+
+// Print stored records with keys in [low, high] dated within [start, end].
+// Only subtrees overlapping the key range are read; one page per level is pinned.
+int pagedPrintRange(FILE* out, PagedExpenseStore* store, ExpenseKey low, ExpenseKey high,
+                    DateKey start, DateKey end, float* total){
+    int count = 0;
+    if (store->file && store->root_page != 0) {
+        count = pagedPrintSubtree(out, store, store->root_page, low, high, start, end, total);
+    }
+    return count;
+}
+
+static bool pageOutExpenseTree(BTreeNodeExpense* root){
+    bool ok = true;
+    if (root) {
+        for (int i = 0; i < root->num_keys && ok; i++) {
+            ExpenseNode* expense = root->keys[i];
+            ExpenseRecord record = {expense->user_id, expense->expense_id, expense->amount,
+                                    expense->category, expense->date};
+            ok = pagedInsert(&paged_store, &record);
+        }
+        for (int i = 0; i <= root->num_keys && ok && !root->is_leaf; i++) {
+            ok = pageOutExpenseTree(root->children[i]);
+        }
+    }
+    return ok;
+}
+
+// Move every month before year/month from memory into the paged store. The
+// records stay queryable by id and period and stay in the user and family
+// totals; applyPagedTotals restores them on the next start.
+int pageOutExpensesBefore(int year, int month){
+    if (!paged_store.file &&
+        !pagedStoreOpen(&paged_store, PAGED_STORE_FILE, PAGED_POOL_FRAMES, true)) {
+        return -1;
+    }
+
+    lsmCompact();
+    compactTombstones(true);
+    int cutoff_key = year * 100 + month;
+    bool ok = true;
+    for (int i = 0; i < expense_store.count && expense_store.partitions[i].month_key < cutoff_key && ok; i++) {
+        ok = pageOutExpenseTree(expense_store.partitions[i].root);
+
+        ExpenseRecord* records;
+        int count = decodeCompressedMonth(&expense_store.partitions[i], &records);
+        for (int j = 0; j < count && ok; j++) {
+            ok = pagedInsert(&paged_store, &records[j]);
+        }
+        free(records);
+    }
+    if (ok && cutoff_key > paged_store.cutoff_month) {
+        paged_store.cutoff_month = cutoff_key;
+    }
+    if (!ok || !pagedStoreFlush(&paged_store)) {
+        printf("Paging out failed; expenses kept in memory\n");
+        return -1;
+    }
+    return releaseMonthsBefore(cutoff_key);
+}
+
+//take records purged from a cold tier out of their users' and families' totals
+static void dropColdTotals(const ExpenseRecord* records, long count){
+    UserNode* user = NULL;
+    for (long i = 0; i < count; i++) {
+        if (!user || user->user_id != records[i].user_id) {
+            user = searchUser(user_root, records[i].user_id);
+        }
+        if (user) {
+            user->expense_count--;
+            user->details->folded_expenses[records[i].category] -= records[i].amount;
+            adjustExpenseTotals(user, records[i].category, -records[i].amount);
+        }
+    }
+}
+
+//move the records outside the range to the front, keeping their order, and
+//family_ids with them if given; returns how many there are
+static long keepRecordsOutside(ExpenseRecord* records, int* family_ids, long count, const ExpenseRange* range){
+    long kept = 0;
+    for (long i = 0; i < count; i++) {
+        if (!expenseInRange(range, records[i].user_id, records[i].expense_id, records[i].date)) {
+            ExpenseRecord record = records[kept];
+            records[kept] = records[i];
+            records[i] = record;
+            if (family_ids) {
+                int family_id = family_ids[kept];
+                family_ids[kept] = family_ids[i];
+                family_ids[i] = family_id;
+            }
+            kept++;
+        }
+    }
+    return kept;
+}
+
+static void applyPagedSubtreeTotals(unsigned int page_id, UserNode** user){
+    ExpensePage* page = pinPage(&paged_store, page_id);
+    if (page) {
+        for (int i = 0; i <= page->num_keys; i++) {
+            if (!page->is_leaf) {
+                applyPagedSubtreeTotals(page->children[i], user);
+            }
+            if (i < page->num_keys) {
+                const ExpenseRecord* record = &page->records[i];
+                if (!*user || (*user)->user_id != record->user_id) {
+                    *user = searchUser(user_root, record->user_id);
+                }
+                if (*user) {
+                    (*user)->expense_count++;
+                    (*user)->details->folded_expenses[record->category] += record->amount;
+                    adjustExpenseTotals(*user, record->category, record->amount);
+                }
+            }
+        }
+        unpinPage(&paged_store, page, false);
+    }
+}
+
+// Add the paged expenses back into the user and family totals. Called once at
+// startup, like applyArchiveSummaries; the page file keeps no summaries, so
+// its records are read once in key order.
+void applyPagedTotals(){
+    UserNode* user = NULL;
+    if (paged_store.file && paged_store.root_page != 0) {
+        applyPagedSubtreeTotals(paged_store.root_page, &user);
+    }
+}
+
+static void collectPagedSubtree(unsigned int page_id, ExpenseRecord* records, long* pos){
+    ExpensePage* page = pinPage(&paged_store, page_id);
+    if (page) {
+        for (int i = 0; i <= page->num_keys; i++) {
+            if (!page->is_leaf) {
+                collectPagedSubtree(page->children[i], records, pos);
+            }
+            if (i < page->num_keys) {
+                records[(*pos)++] = page->records[i];
+            }
+        }
+        unpinPage(&paged_store, page, false);
+    }
+}
+
+//append a record to a growable array; false if it could not grow
+static bool appendRecord(ExpenseRecord** records, int* count, int* capacity, const ExpenseRecord* record){
+    if (*count == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 16;
+        ExpenseRecord* grown = (ExpenseRecord*)realloc(*records, new_capacity * sizeof(ExpenseRecord));
+        if (!grown) {
+            printf("Failed to allocate memory for expense records\n");
+            return false;
+        }
+        *records = grown;
+        *capacity = new_capacity;
+    }
+    (*records)[(*count)++] = *record;
+    return true;
+}
+
+//append the stored records with keys in [low, high], in key order
+static void collectPagedRange(unsigned int page_id, ExpenseKey low, ExpenseKey high,
+                              ExpenseRecord** records, int* count, int* capacity){
+    ExpensePage* page = pinPage(&paged_store, page_id);
+    if (page) {
+        bool ok = true;
+        for (int i = nodeLowerBoundExpense(page->key_codes, page->num_keys, low); ok && i <= page->num_keys; i++) {
+            if (!page->is_leaf) {
+                collectPagedRange(page->children[i], low, high, records, count, capacity);
+            }
+            ok = i < page->num_keys && page->key_codes[i] <= high &&
+                 appendRecord(records, count, capacity, &page->records[i]);
+        }
+        unpinPage(&paged_store, page, false);
+    }
+}
+
+//whether any paged record falls in the range; reads only the pages of its key range
+static bool pagedRangeHasRecords(const ExpenseRange* range){
+    ExpenseRecord* records = NULL;
+    int count = 0;
+    int capacity = 0;
+    collectPagedRange(paged_store.root_page, range->low_key, range->high_key, &records, &count, &capacity);
+    bool found = false;
+    for (int i = 0; i < count && !found; i++) {
+        found = dateInRange(records[i].date, range->first_date, range->last_date);
+    }
+    free(records);
+    return found;
+}
+
+// Remove the paged expenses in a range and take them out of the user and
+// family totals. Pages cannot shrink in place, so the kept records are
+// written to a new page file that is swapped in. Returns the number removed,
+// or -1 if the file could not be rewritten.
+int purgePagedExpenses(const ExpenseRange* range){
+    long count = paged_store.record_count;
+    if (!paged_store.file || count == 0 || monthKey(range->first_date) >= paged_store.cutoff_month) {
+        return 0;
+    }
+    //a narrow key range, such as one user's, rarely touches the file at all
+    bool whole_keys = range->low_key == 0 && range->high_key == ~(ExpenseKey)0;
+    if (!whole_keys && !pagedRangeHasRecords(range)) {
+        return 0;
+    }
+    ExpenseRecord* records = (ExpenseRecord*)malloc(count * sizeof(ExpenseRecord));
+    if (!records) {
+        printf("Failed to allocate memory for page file\n");
+        return -1;
+    }
+    long pos = 0;
+    collectPagedSubtree(paged_store.root_page, records, &pos);
+    long kept = keepRecordsOutside(records, NULL, pos, range);
+    if (pos != count || kept == count) {
+        free(records);
+        return (pos == count) ? 0 : -1;
+    }
+
+    //build the new file beside the old one, so a failed write leaves it intact
+    PagedExpenseStore fresh;
+    remove(PAGED_STORE_FILE ".tmp");
+    bool ok = pagedStoreOpen(&fresh, PAGED_STORE_FILE ".tmp", PAGED_POOL_FRAMES, true);
+    if (ok) {
+        for (long i = 0; i < kept && ok; i++) {
+            ok = pagedInsert(&fresh, &records[i]);
+        }
+        fresh.cutoff_month = paged_store.cutoff_month;
+        ok = ok && pagedStoreFlush(&fresh);
+        pagedStoreClose(&fresh);
+    }
+    if (ok) {
+        pagedStoreClose(&paged_store);
+        ok = rename(PAGED_STORE_FILE ".tmp", PAGED_STORE_FILE) == 0;
+    }
+    if (!ok || !pagedStoreOpen(&paged_store, PAGED_STORE_FILE, PAGED_POOL_FRAMES, false)) {
+        printf("Purging %s failed; paged expenses kept\n", PAGED_STORE_FILE);
+        if (!paged_store.file) {
+            pagedStoreOpen(&paged_store, PAGED_STORE_FILE, PAGED_POOL_FRAMES, false);
+        }
+        free(records);
+        return -1;
+    }
+
+    dropColdTotals(records + kept, count - kept);
+    free(records);
+    return (int)(count - kept);
+}
+
+//count the keys of a tree
+static int countUserKeys(BTreeNodeUser* root){
+    int count = 0;
+    if (root) {
+        count = root->num_keys;
+        if (!root->is_leaf) {
+            for (int i = 0; i <= root->num_keys; i++) {
+                count += countUserKeys(root->children[i]);
+            }
+        }
+    }
+    return count;
+}
+
+static int countFamilyKeys(BTreeNodeFamily* root){
+    int count = 0;
+    if (root) {
+        count = root->num_keys;
+        if (!root->is_leaf) {
+            for (int i = 0; i <= root->num_keys; i++) {
+                count += countFamilyKeys(root->children[i]);
+            }
+        }
+    }
+    return count;
+}
+
+//flatten a tree into sorted arrays
+static void collectUsers(BTreeNodeUser* root, int* ids, UserNode** users, int* pos){
+    if (root) {
+        for (int i = 0; i < root->num_keys; i++) {
+            if (!root->is_leaf) {
+                collectUsers(root->children[i], ids, users, pos);
+            }
+            ids[*pos] = root->key_ids[i];
+            users[*pos] = root->keys[i];
+            (*pos)++;
+        }
+        if (!root->is_leaf) {
+            collectUsers(root->children[root->num_keys], ids, users, pos);
+        }
+    }
+}
+
+static void collectFamilies(BTreeNodeFamily* root, int* ids, FamilyNode** families, int* pos){
+    if (root) {
+        for (int i = 0; i < root->num_keys; i++) {
+            if (!root->is_leaf) {
+                collectFamilies(root->children[i], ids, families, pos);
+            }
+            ids[*pos] = root->key_ids[i];
+            families[*pos] = root->keys[i];
+            (*pos)++;
+        }
+        if (!root->is_leaf) {
+            collectFamilies(root->children[root->num_keys], ids, families, pos);
+        }
+    }
+}
+
+static void collectExpenses(BTreeNodeExpense* root, ExpenseNode** expenses, int* pos){
+    if (root) {
+        for (int i = 0; i < root->num_keys; i++) {
+            if (!root->is_leaf) {
+                collectExpenses(root->children[i], expenses, pos);
+            }
+            expenses[(*pos)++] = root->keys[i];
+        }
+        if (!root->is_leaf) {
+            collectExpenses(root->children[root->num_keys], expenses, pos);
+        }
+    }
+}
+
+static int compareExpenseKeys(const void* a, const void* b){
+    const ExpenseNode* ea = *(ExpenseNode* const*)a;
+    const ExpenseNode* eb = *(ExpenseNode* const*)b;
+    ExpenseKey ka = makeExpenseKey(ea->user_id, ea->expense_id);
+    ExpenseKey kb = makeExpenseKey(eb->user_id, eb->expense_id);
+    return (ka > kb) - (ka < kb);
+}
+
+//in-order walk of the implicit tree rooted at k fills sorted values in BFS layout
+static void layoutUsers(const int* ids, UserNode** users, int count, int* pos, int k){
+    if (k <= count) {
+        layoutUsers(ids, users, count, pos, 2 * k);
+        frozen_index.user_ids[k] = ids[*pos];
+        frozen_index.users[k] = users[*pos];
+        (*pos)++;
+        layoutUsers(ids, users, count, pos, 2 * k + 1);
+    }
+}
+
+static void layoutFamilies(const int* ids, FamilyNode** families, int count, int* pos, int k){
+    if (k <= count) {
+        layoutFamilies(ids, families, count, pos, 2 * k);
+        frozen_index.family_ids[k] = ids[*pos];
+        frozen_index.families[k] = families[*pos];
+        (*pos)++;
+        layoutFamilies(ids, families, count, pos, 2 * k + 1);
+    }
+}
+
+static void layoutExpenses(ExpenseNode** expenses, int count, int* pos, int k){
+    if (k <= count) {
+        layoutExpenses(expenses, count, pos, 2 * k);
+        ExpenseNode* expense = expenses[(*pos)++];
+        frozen_index.expense_keys[k] = makeExpenseKey(expense->user_id, expense->expense_id);
+        frozen_index.expenses[k] = expense;
+        layoutExpenses(expenses, count, pos, 2 * k + 1);
+    }
+}
+
+void invalidateFrozenIndex(){
+    free(frozen_index.user_ids);
+    free(frozen_index.users);
+    free(frozen_index.family_ids);
+    free(frozen_index.families);
+    free(frozen_index.expense_keys);
+    free(frozen_index.expenses);
+    memset(&frozen_index, 0, sizeof(frozen_index));
+}
+
+// Snapshot all trees into Eytzinger arrays; lookups use them until the next mutation
+bool freezeIndexes(){
+    invalidateFrozenIndex();
+    lsmCompact();
+    compactTombstones(true);
+
+    int user_count = countUserKeys(user_root);
+    int family_count = countFamilyKeys(family_root);
+    int expense_count = 0;
+    for (int i = 0; i < expense_store.count; i++) {
+        expense_count += expense_store.partitions[i].expense_count;
+    }
+
+    int* sorted_ids = (int*)malloc((user_count + family_count + 1) * sizeof(int));
+    UserNode** sorted_users = (UserNode**)malloc((user_count + 1) * sizeof(UserNode*));
+    FamilyNode** sorted_families = (FamilyNode**)malloc((family_count + 1) * sizeof(FamilyNode*));
+    ExpenseNode** sorted_expenses = (ExpenseNode**)malloc((expense_count + 1) * sizeof(ExpenseNode*));
+    frozen_index.user_ids = (int*)malloc((user_count + 1) * sizeof(int));
+    frozen_index.users = (UserNode**)malloc((user_count + 1) * sizeof(UserNode*));
+    frozen_index.family_ids = (int*)malloc((family_count + 1) * sizeof(int));
+    frozen_index.families = (FamilyNode**)malloc((family_count + 1) * sizeof(FamilyNode*));
+    frozen_index.expense_keys = (ExpenseKey*)malloc((expense_count + 1) * sizeof(ExpenseKey));
+    frozen_index.expenses = (ExpenseNode**)malloc((expense_count + 1) * sizeof(ExpenseNode*));
+
+    bool done = sorted_ids && sorted_users && sorted_families && sorted_expenses &&
+                frozen_index.user_ids && frozen_index.users &&
+                frozen_index.family_ids && frozen_index.families &&
+                frozen_index.expense_keys && frozen_index.expenses;
+    if (!done) {
+        printf("Failed to allocate memory for frozen index\n");
+        invalidateFrozenIndex();
+    }
+    else {
+        int pos = 0;
+        collectUsers(user_root, sorted_ids, sorted_users, &pos);
+        pos = 0;
+        layoutUsers(sorted_ids, sorted_users, user_count, &pos, 1);
+
+        pos = 0;
+        collectFamilies(family_root, sorted_ids, sorted_families, &pos);
+        pos = 0;
+        layoutFamilies(sorted_ids, sorted_families, family_count, &pos, 1);
+
+        //each partition is sorted on its own; the global order needs a sort
+        pos = 0;
+        for (int i = 0; i < expense_store.count; i++) {
+            collectExpenses(expense_store.partitions[i].root, sorted_expenses, &pos);
+        }
+        expense_count = pos; //compressed months are not indexed
+        qsort(sorted_expenses, expense_count, sizeof(ExpenseNode*), compareExpenseKeys);
+        pos = 0;
+        layoutExpenses(sorted_expenses, expense_count, &pos, 1);
+
+        frozen_index.user_count = user_count;
+        frozen_index.family_count = family_count;
+        frozen_index.expense_count = expense_count;
+        frozen_index.valid = true;
+    }
+
+    free(sorted_ids);
+    free(sorted_users);
+    free(sorted_families);
+    free(sorted_expenses);
+    return done;
+}
+
+// Branch-free descent: k walks the implicit tree, and the trailing ones of k
+// (the right turns taken after the last left turn) are stripped to land on
+// the first element >= key. Returns 0 when every element is smaller.
+// Descendants four levels down are prefetched only while they are inside the
+// array: forming a pointer past its end is undefined even if never read.
+static int eytzingerLowerBound(const int* keys, int count, int key){
+    int k = 1;
+    while (k <= count) {
+        if (k <= count / 16) {
+            __builtin_prefetch(keys + 16 * k);
+        }
+        k = 2 * k + (keys[k] < key);
+    }
+    return k >> __builtin_ffs(~k);
+}
+
+static int eytzingerLowerBoundExpense(const ExpenseKey* keys, int count, ExpenseKey key){
+    int k = 1;
+    while (k <= count) {
+        if (k <= count / 8) {
+            __builtin_prefetch(keys + 8 * k);
+        }
+        k = 2 * k + (keys[k] < key);
+    }
+    return k >> __builtin_ffs(~k);
+}
+
+// Lookups used by the reports: frozen arrays when valid, otherwise the trees
+UserNode* findUser(int user_id){
+    UserNode* ret_node;
+    if (frozen_index.valid) {
+        int k = eytzingerLowerBound(frozen_index.user_ids, frozen_index.user_count, user_id);
+        ret_node = (k != 0 && frozen_index.user_ids[k] == user_id) ? frozen_index.users[k] : NULL;
+    }
+    else {
+        ret_node = searchUser(user_root, user_id);
+    }
+    return ret_node;
+}
+
+FamilyNode* findFamily(int family_id){
+    FamilyNode* ret_node;
+    if (frozen_index.valid) {
+        int k = eytzingerLowerBound(frozen_index.family_ids, frozen_index.family_count, family_id);
+        ret_node = (k != 0 && frozen_index.family_ids[k] == family_id) ? frozen_index.families[k] : NULL;
+    }
+    else {
+        ret_node = searchFamily(family_root, family_id);
+    }
+    return ret_node;
+}
+
+ExpenseNode* findExpense(int user_id, int expense_id){
+    ExpenseNode* ret_node;
+    if (frozen_index.valid) {
+        ExpenseKey key = makeExpenseKey(user_id, expense_id);
+        int k = eytzingerLowerBoundExpense(frozen_index.expense_keys, frozen_index.expense_count, key);
+        ret_node = (k != 0 && frozen_index.expense_keys[k] == key) ? frozen_index.expenses[k] : NULL;
+    }
+    else {
+        ret_node = searchExpenseForUser(searchUser(user_root, user_id), expense_id);
+    }
+    return ret_node;
+}
+
+//merge the two newest runs into one
+static bool lsmMergeNewestRuns(){
+    ExpenseRun* older = &lsm.runs[lsm.run_count - 2];
+    ExpenseRun* newer = &lsm.runs[lsm.run_count - 1];
+    int total = older->count + newer->count;
+    ExpenseNode** merged = (ExpenseNode**)malloc((total + 1) * sizeof(ExpenseNode*));
+    if (!merged) {
+        printf("Failed to allocate memory for run merge\n");
+        return false;
+    }
+
+    int i = 0, j = 0;
+    for (int out = 0; out < total; out++) {
+        bool take_older = j == newer->count ||
+                          (i < older->count && compareExpenseKeys(&older->expenses[i], &newer->expenses[j]) < 0);
+        merged[out] = take_older ? older->expenses[i++] : newer->expenses[j++];
+    }
+
+    free(older->expenses);
+    free(newer->expenses);
+    older->expenses = merged;
+    older->count = total;
+    lsm.run_count--;
+    return true;
+}
+
+// Sort the memtable into a new run. Runs form levels like a binary counter:
+// while the run before the newest is no larger, the two are merged, so sizes
+// double from newest to oldest and each expense is merged O(log n) times.
+static bool lsmFlushMemtable(){
+    if (lsm.memtable_count == 0) {
+        return true;
+    }
+    if (lsm.run_count == LSM_MAX_RUNS && !lsmMergeNewestRuns()) {
+        return false;
+    }
+    ExpenseNode** run = (ExpenseNode**)malloc(lsm.memtable_count * sizeof(ExpenseNode*));
+    if (!run) {
+        printf("Failed to allocate memory for run\n");
+        return false;
+    }
+    memcpy(run, lsm.memtable, lsm.memtable_count * sizeof(ExpenseNode*));
+    qsort(run, lsm.memtable_count, sizeof(ExpenseNode*), compareExpenseKeys);
+    lsm.runs[lsm.run_count].expenses = run;
+    lsm.runs[lsm.run_count].count = lsm.memtable_count;
+    lsm.run_count++;
+    lsm.memtable_count = 0;
+
+    bool merged = true;
+    while (merged && lsm.run_count > 1 &&
+           lsm.runs[lsm.run_count - 2].count <= lsm.runs[lsm.run_count - 1].count) {
+        merged = lsmMergeNewestRuns();
+    }
+    return true;
+}
+
+// Buffer a new expense instead of inserting it into its month tree. Returns
+// false if the expense could not be buffered and must be inserted directly.
+bool lsmAppend(ExpenseNode* expense){
+    if (!lsm.memtable) {
+        lsm.memtable = (ExpenseNode**)malloc(LSM_MEMTABLE_SIZE * sizeof(ExpenseNode*));
+        if (!lsm.memtable) {
+            printf("Failed to allocate memory for memtable\n");
+            return false;
+        }
+    }
+    if (lsm.memtable_count == LSM_MEMTABLE_SIZE && !lsmFlushMemtable()) {
+        return false;
+    }
+    invalidateFrozenIndex();
+    lsm.memtable[lsm.memtable_count++] = expense;
+    return true;
+}
+
+// Take a still-buffered expense out of the memtable or its run. Returns false
+// if the expense is not buffered, i.e. it already sits in its month tree.
+bool lsmRemove(ExpenseNode* expense){
+    for (int i = 0; i < lsm.memtable_count; i++) {
+        if (lsm.memtable[i] == expense) {
+            invalidateFrozenIndex();
+            lsm.memtable[i] = lsm.memtable[--lsm.memtable_count];
+            return true;
+        }
+    }
+
+    ExpenseKey key = makeExpenseKey(expense->user_id, expense->expense_id);
+    for (int r = 0; r < lsm.run_count; r++) {
+        ExpenseRun* run = &lsm.runs[r];
+        int low = 0, high = run->count - 1;
+        while (low <= high) {
+            int mid = low + (high - low) / 2;
+            ExpenseKey mid_key = makeExpenseKey(run->expenses[mid]->user_id, run->expenses[mid]->expense_id);
+            if (mid_key == key) {
+                if (run->expenses[mid] != expense) {
+                    break;
+                }
+                invalidateFrozenIndex();
+                memmove(&run->expenses[mid], &run->expenses[mid + 1],
+                        (run->count - mid - 1) * sizeof(ExpenseNode*));
+                run->count--;
+                return true;
+            }
+            if (mid_key < key) {
+                low = mid + 1;
+            }
+            else {
+                high = mid - 1;
+            }
+        }
+    }
+    return false;
+}
+
+//give a buffered expense the list entry, amount order and version it was added without
+static void settleBufferedExpense(ExpenseNode* expense){
+    linkExpenseToUser(expense->user, expense);
+    openExpenseVersion(expense->user, expense);
+    linkExpenseByAmount(expense->user, expense);
+}
+
+// Move every buffered expense into its user's lists and its month tree. The
+// runs are merged down to one in key order, so each user's expenses join its
+// list in id order under one new version, as a batch's do, and each month is
+// filled from its share of the run by addToPartitions.
+void lsmCompact(){
+    if (lsm.memtable_count > 0 || lsm.run_count > 0) {
+        clearReportCache();
+        invalidateFrozenIndex();
+        store_version++;
+        bool merged = lsmFlushMemtable();
+        while (merged && lsm.run_count > 1) {
+            merged = lsmMergeNewestRuns();
+        }
+        if (merged) {
+            ExpenseRun* run = &lsm.runs[0];
+            for (int i = 0; i < run->count; i++) {
+                settleBufferedExpense(run->expenses[i]);
+            }
+            addToPartitions(run->expenses, run->count);
+            free(run->expenses);
+        }
+        else {
+            //out of memory: settle and insert straight from wherever the expenses are
+            for (int i = 0; i < lsm.memtable_count; i++) {
+                settleBufferedExpense(lsm.memtable[i]);
+                addToPartition(lsm.memtable[i]);
+            }
+            lsm.memtable_count = 0;
+            for (int r = 0; r < lsm.run_count; r++) {
+                for (int i = 0; i < lsm.runs[r].count; i++) {
+                    settleBufferedExpense(lsm.runs[r].expenses[i]);
+                    addToPartition(lsm.runs[r].expenses[i]);
+                }
+                free(lsm.runs[r].expenses);
+            }
+        }
+        lsm.run_count = 0;
+    }
+}
+
+void setIngestMode(bool enabled){
+    if (!enabled) {
+        lsmCompact();
+    }
+    lsm.enabled = enabled;
+}
+
+// Print buffered expenses dated within [start, end]; they are not yet in any
+// month tree, so period queries add them to what the trees report
+int lsmPrintInPeriod(FILE* out, DateKey start, DateKey end, float* total){
+    int count = 0;
+    for (int i = 0; i < lsm.memtable_count; i++) {
+        if (dateInRange(lsm.memtable[i]->date, start, end)) {
+            fprintExpense(out, lsm.memtable[i]);
+            if (total) {
+                *total += lsm.memtable[i]->amount;
+            }
+            count++;
+        }
+    }
+    for (int r = 0; r < lsm.run_count; r++) {
+        for (int i = 0; i < lsm.runs[r].count; i++) {
+            ExpenseNode* expense = lsm.runs[r].expenses[i];
+            if (dateInRange(expense->date, start, end)) {
+                fprintExpense(out, expense);
+                if (total) {
+                    *total += expense->amount;
+                }
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+// Free buffered expenses together with the memtable and runs
+void freeLsmIngest(){
+    for (int i = 0; i < lsm.memtable_count; i++) {
+        free(lsm.memtable[i]->amount_skip);
+        free(lsm.memtable[i]);
+    }
+    for (int r = 0; r < lsm.run_count; r++) {
+        for (int i = 0; i < lsm.runs[r].count; i++) {
+            free(lsm.runs[r].expenses[i]->amount_skip);
+            free(lsm.runs[r].expenses[i]);
+        }
+        free(lsm.runs[r].expenses);
+    }
+    free(lsm.memtable);
+    lsm.memtable = NULL;
+    lsm.memtable_count = 0;
+    lsm.run_count = 0;
+}
+
+static unsigned char* putVarint(unsigned char* p, unsigned long long value){
+    while (value >= 0x80) {
+        *p++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (unsigned char)value;
+    return p;
+}
+
+static const unsigned char* getVarint(const unsigned char* p, unsigned long long* value){
+    unsigned long long result = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        result |= (unsigned long long)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *value = result | ((unsigned long long)*p++ << shift);
+    return p;
+}
+
+static unsigned long long zigzag(long long value){
+    return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+}
+
+static long long unzigzag(unsigned long long value){
+    return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+//encode one record; prev is NULL for the first record of a block
+static unsigned char* encodeRecord(unsigned char* p, const ExpenseNode* expense, const ExpenseNode* prev){
+    if (!prev) {
+        p = putVarint(p, zigzag(expense->user_id));
+        p = putVarint(p, zigzag(expense->expense_id));
+    }
+    else {
+        unsigned long long user_delta = (unsigned long long)((long long)expense->user_id - prev->user_id);
+        p = putVarint(p, user_delta);
+        if (user_delta == 0) {
+            p = putVarint(p, (unsigned long long)((long long)expense->expense_id - prev->expense_id));
+        }
+        else {
+            p = putVarint(p, zigzag(expense->expense_id));
+        }
+    }
+    *p++ = (unsigned char)(DATE_DAY(expense->date) << 3 | expense->category);
+    float cents = expense->amount * 100.0f;
+    return putVarint(p, zigzag((long long)(cents + (cents >= 0 ? 0.5f : -0.5f))));
+}
+
+//decode the record after prev (or the first of a block when first is set)
+static const unsigned char* decodeRecord(const unsigned char* p, int month_key, bool first, ExpenseRecord* record){
+    unsigned long long value;
+    p = getVarint(p, &value);
+    if (first) {
+        record->user_id = (int)unzigzag(value);
+        p = getVarint(p, &value);
+        record->expense_id = (int)unzigzag(value);
+    }
+    else if (value == 0) {
+        p = getVarint(p, &value);
+        record->expense_id += (int)value;
+    }
+    else {
+        record->user_id += (int)value;
+        p = getVarint(p, &value);
+        record->expense_id = (int)unzigzag(value);
+    }
+    record->date = (DateKey)(month_key * 100 + (*p >> 3));
+    record->category = *p++ & 7;
+    p = getVarint(p, &value);
+    record->amount = (float)unzigzag(value) / 100.0f;
+    return p;
+}
+
+//decode a whole block into records
+static int decodeBlock(const CompressedMonth* month, int block, int month_key, ExpenseRecord* records){
+    const unsigned char* p = month->data + month->blocks[block].offset;
+    for (int i = 0; i < month->blocks[block].count; i++) {
+        if (i > 0) {
+            records[i] = records[i - 1];
+        }
+        p = decodeRecord(p, month_key, i == 0, &records[i]);
+    }
+    return month->blocks[block].count;
+}
+
+//last block whose first key is not greater than key (0 if none)
+static int compressedBlockFor(const CompressedMonth* month, ExpenseKey key){
+    int lo = 0;
+    int hi = month->block_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (month->blocks[mid].first_key <= key) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? lo - 1 : 0;
+}
+
+void releaseCompressedMonth(CompressedMonth* month){
+    if (month) {
+        free(month->blocks);
+        free(month->data);
+        free(month);
+    }
+}
+
+//encode records sorted by key into a new compressed month
+static CompressedMonth* encodeMonth(ExpenseNode** expenses, int count){
+    CompressedMonth* month = (CompressedMonth*)malloc(sizeof(CompressedMonth));
+    int block_count = (count + COMPRESSED_BLOCK_RECORDS - 1) / COMPRESSED_BLOCK_RECORDS;
+    if (month) {
+        month->blocks = (CompressedBlock*)malloc((block_count + 1) * sizeof(CompressedBlock));
+        month->data = (unsigned char*)malloc((size_t)count * COMPRESSED_RECORD_MAX_BYTES + 1);
+    }
+    if (!month || !month->blocks || !month->data) {
+        printf("Failed to allocate memory for compressed month\n");
+        if (month) {
+            free(month->blocks);
+            free(month->data);
+            free(month);
+        }
+        return NULL;
+    }
+
+    unsigned char* p = month->data;
+    for (int b = 0; b < block_count; b++) {
+        int first = b * COMPRESSED_BLOCK_RECORDS;
+        int end = (first + COMPRESSED_BLOCK_RECORDS < count) ? first + COMPRESSED_BLOCK_RECORDS : count;
+        month->blocks[b].first_key = makeExpenseKey(expenses[first]->user_id, expenses[first]->expense_id);
+        month->blocks[b].offset = (unsigned int)(p - month->data);
+        month->blocks[b].count = end - first;
+        for (int i = first; i < end; i++) {
+            p = encodeRecord(p, expenses[i], (i == first) ? NULL : expenses[i - 1]);
+        }
+    }
+    month->data_size = (size_t)(p - month->data);
+    unsigned char* shrunk = (unsigned char*)realloc(month->data, month->data_size + 1);
+    if (shrunk) {
+        month->data = shrunk;
+    }
+    month->record_count = count;
+    month->block_count = block_count;
+    return month;
+}
+
+//drop a month's records from a user's lists; they stay in the user's totals
+static void detachUserMonth(UserNode* user, int month_key){
+    ExpenseNode* expense = user->expenses_head;
+    while (expense) {
+        ExpenseNode* next = expense->next;
+        if (monthKey(expense->date) == month_key) {
+            unlinkExpenseLists(user, expense);
+        }
+        expense = next;
+    }
+}
+
+// Re-encode a month's tree (and any earlier compressed records) as a
+// compressed month. The ExpenseNodes and the tree are released.
+static bool compressPartition(ExpensePartition* part){
+    int live_count = part->expense_count - (part->compressed ? part->compressed->record_count : 0);
+    if (live_count == 0) {
+        return true;
+    }
+
+    //decoded older records are wrapped in temporary nodes so one encoder serves both
+    int old_count = part->compressed ? part->compressed->record_count : 0;
+    ExpenseNode** expenses = (ExpenseNode**)malloc((part->expense_count + 1) * sizeof(ExpenseNode*));
+    ExpenseNode* old_nodes = (ExpenseNode*)malloc((old_count + 1) * sizeof(ExpenseNode));
+    ExpenseRecord* block = (ExpenseRecord*)malloc(COMPRESSED_BLOCK_RECORDS * sizeof(ExpenseRecord));
+    bool ok = expenses && old_nodes && block;
+    CompressedMonth* month = NULL;
+    if (ok) {
+        int pos = 0;
+        collectExpenses(part->root, expenses, &pos);
+        for (int b = 0; part->compressed && b < part->compressed->block_count; b++) {
+            int n = decodeBlock(part->compressed, b, part->month_key, block);
+            for (int i = 0; i < n; i++) {
+                ExpenseNode* node = &old_nodes[pos - live_count];
+                memset(node, 0, sizeof(ExpenseNode));
+                node->user_id = block[i].user_id;
+                node->expense_id = block[i].expense_id;
+                node->amount = block[i].amount;
+                node->category = block[i].category;
+                node->date = block[i].date;
+                expenses[pos++] = node;
+            }
+        }
+        qsort(expenses, pos, sizeof(ExpenseNode*), compareExpenseKeys);
+        month = encodeMonth(expenses, pos);
+        ok = month != NULL;
+    }
+
+    if (ok) {
+        //expenses is sorted by user, so each user is detached once
+        store_version++;
+        clearReportCache();
+        for (int i = 0; i < part->expense_count; i++) {
+            if (i == 0 || expenses[i]->user_id != expenses[i - 1]->user_id) {
+                UserNode* user = searchUser(user_root, expenses[i]->user_id);
+                if (user) {
+                    detachUserMonth(user, part->month_key);
+                }
+            }
+        }
+        freeExpenseTree(part->root);
+        part->root = NULL;
+        releaseCompressedMonth(part->compressed);
+        part->compressed = month;
+    }
+    else {
+        printf("Failed to compress month %d/%d\n", part->month_key % 100, part->month_key / 100);
+    }
+    free(expenses);
+    free(old_nodes);
+    free(block);
+    return ok;
+}
+
+// Compress every month before year/month. Their expenses stay in all totals
+// and reports but become read-only. Returns the number of records compressed.
+int compressExpensesBefore(int year, int month){
+    invalidateFrozenIndex();
+    lsmCompact();
+    compactTombstones(true);
+
+    int cutoff_key = year * 100 + month;
+    int compressed = 0;
+    for (int i = 0; i < expense_store.count && expense_store.partitions[i].month_key < cutoff_key; i++) {
+        ExpensePartition* part = &expense_store.partitions[i];
+        int before = part->compressed ? part->compressed->record_count : 0;
+        if (compressPartition(part)) {
+            compressed += (part->compressed ? part->compressed->record_count : 0) - before;
+        }
+    }
+    return compressed;
+}
+
+bool findCompressedExpense(int user_id, int expense_id, ExpenseRecord* out){
+    ExpenseKey key = makeExpenseKey(user_id, expense_id);
+    ExpenseRecord block[COMPRESSED_BLOCK_RECORDS];
+    bool found = false;
+    for (int i = 0; i < expense_store.count && !found; i++) {
+        const CompressedMonth* month = expense_store.partitions[i].compressed;
+        if (month && month->blocks[0].first_key <= key) {
+            int b = compressedBlockFor(month, key);
+            int n = decodeBlock(month, b, expense_store.partitions[i].month_key, block);
+            for (int j = 0; j < n && !found; j++) {
+                if (block[j].user_id == user_id && block[j].expense_id == expense_id) {
+                    *out = block[j];
+                    found = true;
+                }
+            }
+        }
+    }
+    return found;
+}
+
+// Decode a user's compressed records with ids in [start_id, end_id] into a
+// malloc'd array (freed by the caller). Only blocks that can hold the user
+// are decoded.
+int collectCompressedExpenses(int user_id, int start_id, int end_id, ExpenseRecord** out){
+    int count = 0;
+    int capacity = 0;
+    ExpenseRecord* records = NULL;
+    ExpenseRecord block[COMPRESSED_BLOCK_RECORDS];
+    ExpenseKey low = makeExpenseKey(user_id, start_id);
+    ExpenseKey high = makeExpenseKey(user_id, end_id);
+
+    for (int i = 0; i < expense_store.count; i++) {
+        const CompressedMonth* month = expense_store.partitions[i].compressed;
+        for (int b = month ? compressedBlockFor(month, low) : 0;
+             month && b < month->block_count && month->blocks[b].first_key <= high; b++) {
+            int n = decodeBlock(month, b, expense_store.partitions[i].month_key, block);
+            for (int j = 0; j < n; j++) {
+                if (block[j].user_id == user_id && block[j].expense_id >= start_id && block[j].expense_id <= end_id) {
+                    if (count == capacity) {
+                        capacity = capacity ? capacity * 2 : 16;
+                        ExpenseRecord* grown = (ExpenseRecord*)realloc(records, capacity * sizeof(ExpenseRecord));
+                        if (!grown) {
+                            printf("Failed to allocate memory for compressed expenses\n");
+                            *out = records;
+                            return count;
+                        }
+                        records = grown;
+                    }
+                    records[count++] = block[j];
+                }
+            }
+        }
+    }
+    *out = records;
+    return count;
+}
+
+void printExpenseRecord(const ExpenseRecord* record){
+    fprintExpenseRecord(stdout, record);
+}
+
+void fprintExpenseRecord(FILE* out, const ExpenseRecord* record){
+    ExpenseNode expense;
+    memset(&expense, 0, sizeof(expense));
+    expense.expense_id = record->expense_id;
+    expense.user_id = record->user_id;
+    expense.amount = record->amount;
+    expense.category = record->category;
+    expense.date = record->date;
+    fprintExpense(out, &expense);
+}
+
+// Decode every compressed record of a month into a malloc'd array
+int decodeCompressedMonth(const ExpensePartition* part, ExpenseRecord** out){
+    const CompressedMonth* month = part->compressed;
+    int count = 0;
+    *out = NULL;
+    if (month) {
+        *out = (ExpenseRecord*)malloc((month->record_count + 1) * sizeof(ExpenseRecord));
+        if (!*out) {
+            printf("Failed to allocate memory for compressed expenses\n");
+            return 0;
+        }
+        for (int b = 0; b < month->block_count; b++) {
+            count += decodeBlock(month, b, part->month_key, *out + count);
+        }
+    }
+    return count;
+}
+
+// Print a compressed month's records dated within [start, end]
+int printCompressedInPeriod(FILE* out, const CompressedMonth* month, int month_key, DateKey start, DateKey end, float* total){
+    int count = 0;
+    ExpenseRecord block[COMPRESSED_BLOCK_RECORDS];
+    for (int b = 0; month && b < month->block_count; b++) {
+        int n = decodeBlock(month, b, month_key, block);
+        for (int i = 0; i < n; i++) {
+            if (dateInRange(block[i].date, start, end)) {
+                fprintExpenseRecord(out, &block[i]);
+                if (total) {
+                    *total += block[i].amount;
+                }
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+//byte offset of row in a column; columns follow the header in field order
+static long archiveColumnOffset(int column, int row){
+    long n = archive.header.record_count;
+    long offset = sizeof(ArchiveHeader);
+    long widths[6] = {sizeof(int), sizeof(int), sizeof(float), sizeof(unsigned char), sizeof(DateKey), sizeof(int)};
+    for (int c = 0; c < column; c++) {
+        offset += widths[c] * n;
+    }
+    return offset + widths[column] * row;
+}
+
+static bool readArchiveColumn(int column, int first, int count, void* out, size_t width){
+    return fseek(archive.file, archiveColumnOffset(column, first), SEEK_SET) == 0 &&
+           fread(out, width, count, archive.file) == (size_t)count;
+}
+
+//read rows [first, first+count) of every column into records
+static bool readArchiveRows(int first, int count, ExpenseRecord* records){
+    int ids[ARCHIVE_SCAN_ROWS];
+    float amounts[ARCHIVE_SCAN_ROWS];
+    unsigned char categories[ARCHIVE_SCAN_ROWS];
+    DateKey dates[ARCHIVE_SCAN_ROWS];
+    bool ok = count <= ARCHIVE_SCAN_ROWS && readArchiveColumn(0, first, count, ids, sizeof(int));
+    for (int i = 0; ok && i < count; i++) {
+        records[i].user_id = ids[i];
+    }
+    ok = ok && readArchiveColumn(1, first, count, ids, sizeof(int)) &&
+         readArchiveColumn(2, first, count, amounts, sizeof(float)) &&
+         readArchiveColumn(3, first, count, categories, sizeof(unsigned char)) &&
+         readArchiveColumn(4, first, count, dates, sizeof(DateKey));
+    for (int i = 0; ok && i < count; i++) {
+        records[i].expense_id = ids[i];
+        records[i].amount = amounts[i];
+        records[i].category = categories[i];
+        records[i].date = dates[i];
+    }
+    return ok;
+}
+
+//first row whose key is not less than key, reading only the two id columns
+static int archiveLowerBound(ExpenseKey key){
+    int lo = 0;
+    int hi = archive.header.record_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int user_id = 0;
+        int expense_id = 0;
+        readArchiveColumn(0, mid, 1, &user_id, sizeof(int));
+        readArchiveColumn(1, mid, 1, &expense_id, sizeof(int));
+        if (makeExpenseKey(user_id, expense_id) < key) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void closeArchive(){
+    if (archive.file) {
+        fclose(archive.file);
+    }
+    free(archive.users);
+    free(archive.families);
+    memset(&archive, 0, sizeof(archive));
+}
+
+// Open an archive file and load its header and summaries
+bool openArchive(const char* path){
+    closeArchive();
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    ArchiveHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == ARCHIVE_MAGIC;
+    if (ok) {
+        archive.file = file;
+        archive.header = header;
+        archive.users = (ArchiveUserSummary*)malloc((header.user_count + 1) * sizeof(ArchiveUserSummary));
+        archive.families = (ArchiveFamilySummary*)malloc((header.family_count + 1) * sizeof(ArchiveFamilySummary));
+        ok = archive.users && archive.families &&
+             fseek(file, archiveColumnOffset(5, header.record_count), SEEK_SET) == 0 &&
+             fread(archive.users, sizeof(ArchiveUserSummary), header.user_count, file) == (size_t)header.user_count &&
+             fread(archive.families, sizeof(ArchiveFamilySummary), header.family_count, file) == (size_t)header.family_count;
+    }
+    if (!ok) {
+        printf("%s is not a valid expense archive\n", path);
+        if (archive.file) {
+            closeArchive();
+        }
+        else {
+            fclose(file);
+        }
+    }
+    return ok;
+}
+
+// Add the archived expenses back into the user (and so family) totals. Used
+// at startup, once the live expenses of the open months have been loaded.
+void applyArchiveSummaries(){
+    for (int i = 0; i < archive.header.user_count; i++) {
+        UserNode* user = searchUser(user_root, archive.users[i].user_id);
+        if (user) {
+            user->expense_count += archive.users[i].expense_count;
+            for (int c = 0; c < MAX_CATEGORIES; c++) {
+                user->details->folded_expenses[c] += archive.users[i].category_expenses[c];
+                adjustExpenseTotals(user, c, archive.users[i].category_expenses[c]);
+            }
+        }
+    }
+}
+
+float archivedFamilyExpense(int family_id){
+    float total = 0.0f;
+    for (int i = 0; i < archive.header.family_count; i++) {
+        if (archive.families[i].family_id == family_id) {
+            total = archive.families[i].total_expense;
+        }
+    }
+    return total;
+}
+
+static int compareRecordKeys(const void* a, const void* b){
+    const ExpenseRecord* ra = (const ExpenseRecord*)a;
+    const ExpenseRecord* rb = (const ExpenseRecord*)b;
+    ExpenseKey ka = makeExpenseKey(ra->user_id, ra->expense_id);
+    ExpenseKey kb = makeExpenseKey(rb->user_id, rb->expense_id);
+    return (ka > kb) - (ka < kb);
+}
+
+static int compareFamilySummaries(const void* a, const void* b){
+    int fa = ((const ArchiveFamilySummary*)a)->family_id;
+    int fb = ((const ArchiveFamilySummary*)b)->family_id;
+    return (fa > fb) - (fa < fb);
+}
+
+static void collectTreeRecords(BTreeNodeExpense* root, ExpenseRecord* records, int* pos){
+    if (root) {
+        for (int i = 0; i < root->num_keys; i++) {
+            if (!root->is_leaf) {
+                collectTreeRecords(root->children[i], records, pos);
+            }
+            ExpenseNode* expense = root->keys[i];
+            ExpenseRecord record = {expense->user_id, expense->expense_id, expense->amount,
+                                    expense->category, expense->date};
+            records[(*pos)++] = record;
+        }
+        if (!root->is_leaf) {
+            collectTreeRecords(root->children[root->num_keys], records, pos);
+        }
+    }
+}
+
+//write rows, their families and the summaries to path; rows must be sorted by key
+static bool writeArchive(const char* path, const ExpenseRecord* records, const int* family_ids, int count,
+                         int cutoff_month){
+    ArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ARCHIVE_MAGIC;
+    header.cutoff_month = cutoff_month;
+    header.record_count = count;
+
+    ArchiveUserSummary* users = (ArchiveUserSummary*)calloc(count + 1, sizeof(ArchiveUserSummary));
+    ArchiveFamilySummary* families = (ArchiveFamilySummary*)calloc(count + 1, sizeof(ArchiveFamilySummary));
+    FILE* file = fopen(path, "wb");
+    bool ok = users && families && file;
+
+    //rows are grouped by user, so each user summary is built in one run
+    for (int i = 0; ok && i < count; i++) {
+        if (i == 0 || records[i].user_id != records[i - 1].user_id) {
+            users[header.user_count++].user_id = records[i].user_id;
+        }
+        ArchiveUserSummary* user = &users[header.user_count - 1];
+        user->expense_count++;
+        user->total_expense += records[i].amount;
+        user->category_expenses[records[i].category] += records[i].amount;
+        header.category_totals[records[i].category] += records[i].amount;
+    }
+
+    //families as they stood when each row was archived, not as they stand now
+    for (int i = 0; ok && i < count; i++) {
+        if (family_ids[i] != ARCHIVE_NO_FAMILY) {
+            if (header.family_count == 0 || families[header.family_count - 1].family_id != family_ids[i]) {
+                families[header.family_count++].family_id = family_ids[i];
+            }
+            ArchiveFamilySummary* family = &families[header.family_count - 1];
+            family->total_expense += records[i].amount;
+            family->category_expenses[records[i].category] += records[i].amount;
+        }
+    }
+    qsort(families, header.family_count, sizeof(ArchiveFamilySummary), compareFamilySummaries);
+    int merged = 0;
+    for (int i = 0; i < header.family_count; i++) {
+        if (merged > 0 && families[merged - 1].family_id == families[i].family_id) {
+            families[merged - 1].total_expense += families[i].total_expense;
+            for (int c = 0; c < MAX_CATEGORIES; c++) {
+                families[merged - 1].category_expenses[c] += families[i].category_expenses[c];
+            }
+        }
+        else {
+            families[merged++] = families[i];
+        }
+    }
+    header.family_count = merged;
+
+    ok = ok && fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; ok && i < count; i++) {
+        ok = fwrite(&records[i].user_id, sizeof(int), 1, file) == 1;
+    }
+    for (int i = 0; ok && i < count; i++) {
+        ok = fwrite(&records[i].expense_id, sizeof(int), 1, file) == 1;
+    }
+    for (int i = 0; ok && i < count; i++) {
+        ok = fwrite(&records[i].amount, sizeof(float), 1, file) == 1;
+    }
+    for (int i = 0; ok && i < count; i++) {
+        unsigned char category = (unsigned char)records[i].category;
+        ok = fwrite(&category, sizeof(category), 1, file) == 1;
+    }
+    for (int i = 0; ok && i < count; i++) {
+        ok = fwrite(&records[i].date, sizeof(DateKey), 1, file) == 1;
+    }
+    ok = ok && fwrite(family_ids, sizeof(int), count, file) == (size_t)count;
+    ok = ok && fwrite(users, sizeof(ArchiveUserSummary), header.user_count, file) == (size_t)header.user_count &&
+         fwrite(families, sizeof(ArchiveFamilySummary), header.family_count, file) == (size_t)header.family_count;
+
+    if (file && fclose(file) != 0) {
+        ok = false;
+    }
+    free(users);
+    free(families);
+    return ok;
+}
+
+//unlink expenses dated before cutoff_key from every user's lists; totals stay
+static void detachUserTreeBefore(BTreeNodeUser* root, int cutoff_key){
+    if (root) {
+        for (int i = 0; i <= root->num_keys; i++) {
+            if (!root->is_leaf) {
+                detachUserTreeBefore(root->children[i], cutoff_key);
+            }
+            if (i < root->num_keys) {
+                UserNode* user = root->keys[i];
+                ExpenseNode* expense = user->expenses_head;
+                while (expense) {
+                    ExpenseNode* next = expense->next;
+                    if (monthKey(expense->date) < cutoff_key) {
+                        unlinkExpenseLists(user, expense);
+                    }
+                    expense = next;
+                }
+            }
+        }
+    }
+}
+
+// Free every month before cutoff_key once its records are safe in a cold tier.
+// Users only unlink the expenses; their totals and the families' stay, and
+// the expenses' history is folded into the users' folded totals.
+// Returns the number of expenses released.
+int releaseMonthsBefore(int cutoff_key){
+    invalidateFrozenIndex();
+    int drop_count = partitionLowerBound(cutoff_key);
+    int released = 0;
+    for (int i = 0; i < drop_count; i++) {
+        released += expense_store.partitions[i].expense_count;
+    }
+
+    store_version++;
+    clearReportCache();
+    detachUserTreeBefore(user_root, cutoff_key);
+    for (int i = 0; i < drop_count; i++) {
+        freeExpenseTree(expense_store.partitions[i].root);
+        releaseCompressedMonth(expense_store.partitions[i].compressed);
+    }
+    memmove(&expense_store.partitions[0], &expense_store.partitions[drop_count],
+            (expense_store.count - drop_count) * sizeof(ExpensePartition));
+    expense_store.count -= drop_count;
+    compactHistory();
+    return released;
+}
+
+// Move every month before year/month into the archive file, merged with what
+// it already holds. The expenses stay in the user and family totals; the
+// archive's summaries restore them on the next start.
+int archiveExpensesBefore(int year, int month){
+    invalidateFrozenIndex();
+    lsmCompact();
+    compactTombstones(true);
+
+    int cutoff_key = year * 100 + month;
+    int drop_count = partitionLowerBound(cutoff_key);
+    int moved = 0;
+    for (int i = 0; i < drop_count; i++) {
+        moved += expense_store.partitions[i].expense_count;
+    }
+    if (moved == 0) {
+        return 0;
+    }
+
+    int old_count = archive.header.record_count;
+    ExpenseRecord* records = (ExpenseRecord*)malloc((old_count + moved + 1) * sizeof(ExpenseRecord));
+    int* family_ids = (int*)malloc((old_count + moved + 1) * sizeof(int));
+    ExpenseRecord* added = (ExpenseRecord*)malloc((moved + 1) * sizeof(ExpenseRecord));
+    if (!records || !family_ids || !added) {
+        printf("Failed to allocate memory for archive\n");
+        free(records);
+        free(family_ids);
+        free(added);
+        return -1;
+    }
+    bool ok = old_count == 0 || readArchiveColumn(5, 0, old_count, family_ids, sizeof(int));
+    for (int first = 0; first < old_count && ok; first += ARCHIVE_SCAN_ROWS) {
+        int n = (old_count - first < ARCHIVE_SCAN_ROWS) ? old_count - first : ARCHIVE_SCAN_ROWS;
+        ok = readArchiveRows(first, n, records + first);
+    }
+    int pos = 0;
+    for (int i = 0; i < drop_count && ok; i++) {
+        collectTreeRecords(expense_store.partitions[i].root, added, &pos);
+        ExpenseRecord* decoded;
+        int n = decodeCompressedMonth(&expense_store.partitions[i], &decoded);
+        if (n > 0) {
+            memcpy(added + pos, decoded, n * sizeof(ExpenseRecord));
+            pos += n;
+        }
+        free(decoded);
+    }
+    qsort(added, pos, sizeof(ExpenseRecord), compareRecordKeys);
+
+    //archived rows are already in key order, so the new ones are merged in from
+    //the back, each tagged with its user's family as it stands now
+    UserNode* user = NULL;
+    int old_row = old_count - 1;
+    for (int i = pos - 1, out = old_count + pos - 1; i >= 0; out--) {
+        if (old_row >= 0 && compareRecordKeys(&records[old_row], &added[i]) > 0) {
+            records[out] = records[old_row];
+            family_ids[out] = family_ids[old_row--];
+        }
+        else {
+            if (!user || user->user_id != added[i].user_id) {
+                user = searchUser(user_root, added[i].user_id);
+            }
+            records[out] = added[i--];
+            family_ids[out] = (user && user->family) ? user->family->family_id : ARCHIVE_NO_FAMILY;
+        }
+    }
+    free(added);
+
+    //write a new file and swap it in, so a failed write leaves the old archive
+    int new_cutoff = (cutoff_key > archive.header.cutoff_month) ? cutoff_key : archive.header.cutoff_month;
+    ok = ok && writeArchive(ARCHIVE_FILE ".tmp", records, family_ids, old_count + pos, new_cutoff);
+    free(records);
+    free(family_ids);
+    if (ok) {
+        closeArchive();
+        ok = rename(ARCHIVE_FILE ".tmp", ARCHIVE_FILE) == 0;
+    }
+    if (!ok || !openArchive(ARCHIVE_FILE)) {
+        printf("Archiving failed; expenses kept in memory\n");
+        openArchive(ARCHIVE_FILE);
+        return -1;
+    }
+
+    return releaseMonthsBefore(cutoff_key);
+}
+
+bool findArchivedExpense(int user_id, int expense_id, ExpenseRecord* out){
+    bool found = false;
+    if (archive.file) {
+        int row = archiveLowerBound(makeExpenseKey(user_id, expense_id));
+        found = row < archive.header.record_count && readArchiveRows(row, 1, out) &&
+                out->user_id == user_id && out->expense_id == expense_id;
+    }
+    return found;
+}
+
+// Print archived expenses dated within [start, end]. Only the date column is
+// read for rows that do not match.
+int printArchivedInPeriod(FILE* out, DateKey start, DateKey end, float* total){
+    int count = 0;
+    DateKey dates[ARCHIVE_SCAN_ROWS];
+    ExpenseRecord rows[ARCHIVE_SCAN_ROWS];
+    bool ok = archive.file && monthKey(start) < archive.header.cutoff_month;
+    for (int first = 0; ok && first < archive.header.record_count; first += ARCHIVE_SCAN_ROWS) {
+        int n = archive.header.record_count - first;
+        n = (n < ARCHIVE_SCAN_ROWS) ? n : ARCHIVE_SCAN_ROWS;
+        ok = readArchiveColumn(4, first, n, dates, sizeof(DateKey));
+        bool any = false;
+        for (int i = 0; ok && i < n && !any; i++) {
+            any = dateInRange(dates[i], start, end);
+        }
+        if (any && (ok = readArchiveRows(first, n, rows))) {
+            for (int i = 0; i < n; i++) {
+                if (dateInRange(rows[i].date, start, end)) {
+                    fprintExpenseRecord(out, &rows[i]);
+                    if (total) {
+                        *total += rows[i].amount;
+                    }
+                    count++;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// Remove the archived expenses in a range by rewriting the archive without
+// them, and take them out of the user and family totals. Returns the number
+// removed, or -1 if the archive could not be rewritten.
+int purgeArchivedExpenses(const ExpenseRange* range){
+    int count = archive.header.record_count;
+    if (!archive.file || count == 0 || monthKey(range->first_date) >= archive.header.cutoff_month) {
+        return 0;
+    }
+    //rows are in key order, so an empty key range is found from the id columns
+    int first = archiveLowerBound(range->low_key);
+    int last = (range->high_key == ~(ExpenseKey)0) ? count : archiveLowerBound(range->high_key + 1);
+    if (first == last) {
+        return 0;
+    }
+    ExpenseRecord* records = (ExpenseRecord*)malloc(count * sizeof(ExpenseRecord));
+    int* family_ids = (int*)malloc(count * sizeof(int));
+    if (!records || !family_ids) {
+        printf("Failed to allocate memory for archive\n");
+        free(records);
+        free(family_ids);
+        return -1;
+    }
+    bool ok = readArchiveColumn(5, 0, count, family_ids, sizeof(int));
+    for (int first = 0; first < count && ok; first += ARCHIVE_SCAN_ROWS) {
+        int n = (count - first < ARCHIVE_SCAN_ROWS) ? count - first : ARCHIVE_SCAN_ROWS;
+        ok = readArchiveRows(first, n, records + first);
+    }
+    int kept = ok ? (int)keepRecordsOutside(records, family_ids, count, range) : count;
+    if (kept == count) {
+        free(records);
+        free(family_ids);
+        return ok ? 0 : -1;
+    }
+
+    //kept rows stay in key order and keep their families, so they are written out as they are
+    ok = writeArchive(ARCHIVE_FILE ".tmp", records, family_ids, kept, archive.header.cutoff_month);
+    free(family_ids);
+    if (ok) {
+        closeArchive();
+        ok = rename(ARCHIVE_FILE ".tmp", ARCHIVE_FILE) == 0;
+    }
+    if (!ok || !openArchive(ARCHIVE_FILE)) {
+        printf("Purging the archive failed; archived expenses kept\n");
+        if (!archive.file) {
+            openArchive(ARCHIVE_FILE);
+        }
+        free(records);
+        return -1;
+    }
+
+    dropColdTotals(records + kept, count - kept);
+    free(records);
+    return count - kept;
+}
+
+//append a user's archived expenses with ids in [start_id, end_id] to the count in *out
+static int appendArchivedExpenses(int user_id, int start_id, int end_id, ExpenseRecord** out, int count){
+    if (archive.file) {
+        ExpenseKey high = makeExpenseKey(user_id, end_id);
+        int first = archiveLowerBound(makeExpenseKey(user_id, start_id));
+        int last = (high == ~(ExpenseKey)0) ? archive.header.record_count : archiveLowerBound(high + 1);
+        if (last > first) {
+            ExpenseRecord* grown = (ExpenseRecord*)realloc(*out, (count + last - first) * sizeof(ExpenseRecord));
+            if (grown) {
+                *out = grown;
+                for (int row = first; row < last; row += ARCHIVE_SCAN_ROWS) {
+                    int n = (last - row < ARCHIVE_SCAN_ROWS) ? last - row : ARCHIVE_SCAN_ROWS;
+                    if (readArchiveRows(row, n, *out + count)) {
+                        count += n;
+                    }
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// Expenses of a user with ids in [start_id, end_id] that are not held as
+// ExpenseNodes: compressed months, then the archive, then the page file.
+// Caller frees *out.
+int collectColdExpenses(int user_id, int start_id, int end_id, ExpenseRecord** out){
+    int count = collectCompressedExpenses(user_id, start_id, end_id, out);
+    count = appendArchivedExpenses(user_id, start_id, end_id, out, count);
+    int capacity = count;
+    if (paged_store.file && paged_store.root_page != 0) {
+        collectPagedRange(paged_store.root_page, makeExpenseKey(user_id, start_id), makeExpenseKey(user_id, end_id),
+                          out, &count, &capacity);
+    }
+    return count;
+}
+
+// Archived and paged expenses of a user with ids in [start_id, end_id]: the
+// ones whose history has been folded away. Caller frees *out.
+static int collectFoldedExpenses(int user_id, int start_id, int end_id, ExpenseRecord** out){
+    *out = NULL;
+    int count = appendArchivedExpenses(user_id, start_id, end_id, out, 0);
+    int capacity = count;
+    if (paged_store.file && paged_store.root_page != 0) {
+        collectPagedRange(paged_store.root_page, makeExpenseKey(user_id, start_id), makeExpenseKey(user_id, end_id),
+                          out, &count, &capacity);
+    }
+    return count;
+}
+
+//copy a name into a lower-cased index key
+static void makeNameKey(char* key, const char* name){
+    int i = 0;
+    while (name[i] != '\0' && i < NAME_LEN - 1) {
+        key[i] = (char)tolower((unsigned char)name[i]);
+        i++;
+    }
+    key[i] = '\0';
+}
+
+static int compareNameEntry(const NameIndexEntry* entry, const char* key, int id){
+    int cmp = strcmp(entry->key, key);
+    if (cmp == 0) {
+        cmp = (entry->id > id) - (entry->id < id);
+    }
+    return cmp;
+}
+
+// First position whose (key, id) is not less than the given one
+int nameIndexLowerBound(NameIndex* index, const char* key, int id){
+    int lo = 0;
+    int hi = index->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (compareNameEntry(&index->entries[mid], key, id) < 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool nameIndexInsert(NameIndex* index, const char* name, int id, void* record){
+    if (index->count == index->capacity) {
+        int new_capacity = (index->capacity == 0) ? 16 : index->capacity * 2;
+        NameIndexEntry* grown = (NameIndexEntry*)realloc(index->entries, new_capacity * sizeof(NameIndexEntry));
+        if (!grown) {
+            printf("Failed to allocate memory for name index\n");
+            return false;
+        }
+        index->entries = grown;
+        index->capacity = new_capacity;
+    }
+
+    char key[NAME_LEN];
+    makeNameKey(key, name);
+    const char* pooled_key = internString(&name_pool, key);
+    if (!pooled_key) {
+        return false;
+    }
+    int pos = nameIndexLowerBound(index, key, id);
+
+    memmove(&index->entries[pos + 1], &index->entries[pos],
+            (index->count - pos) * sizeof(NameIndexEntry));
+    index->entries[pos].key = pooled_key;
+    index->entries[pos].id = id;
+    index->entries[pos].record = record;
+    index->count++;
+    return true;
+}
+
+void nameIndexRemove(NameIndex* index, const char* name, int id){
+    char key[NAME_LEN];
+    makeNameKey(key, name);
+    int pos = nameIndexLowerBound(index, key, id);
+
+    if (pos < index->count && compareNameEntry(&index->entries[pos], key, id) == 0) {
+        memmove(&index->entries[pos], &index->entries[pos + 1],
+                (index->count - pos - 1) * sizeof(NameIndexEntry));
+        index->count--;
+    }
+}
+
+void freeNameIndex(NameIndex* index){
+    free(index->entries);
+    index->entries = NULL;
+    index->count = 0;
+    index->capacity = 0;
+}
+
+// Walk the index entries matching name exactly or as a prefix (case-insensitive)
+static int nameIndexMatches(NameIndex* index, const char* name, bool prefix, int* first){
+    char key[NAME_LEN];
+    makeNameKey(key, name);
+    size_t key_len = strlen(key);
+
+    int pos = nameIndexLowerBound(index, key, INT_MIN);
+    int end = pos;
+    while (end < index->count) {
+        const char* entry_key = index->entries[end].key;
+        bool match = prefix ? (strncmp(entry_key, key, key_len) == 0)
+                            : (strcmp(entry_key, key) == 0);
+        if (!match) {
+            break;
+        }
+        end++;
+    }
+    *first = pos;
+    return end - pos;
+}
+
+void searchUsersByName(const char* name, bool prefix){
+    int first;
+    int count = nameIndexMatches(&user_name_index, name, prefix, &first);
+
+    if (count == 0) {
+        printf("No users found matching '%s'\n", name);
+    }
+    else {
+        printf("Users matching '%s' (%d):\n", name, count);
+        for (int i = first; i < first + count; i++) {
+            UserNode* user = (UserNode*)user_name_index.entries[i].record;
+            printf("  %s (ID: %d), Family: %s\n", user->details->user_name, user->user_id,
+                   user->family ? user->family->family_name : "None");
+        }
+    }
+}
+
+void searchFamiliesByName(const char* name, bool prefix){
+    int first;
+    int count = nameIndexMatches(&family_name_index, name, prefix, &first);
+
+    if (count == 0) {
+        printf("No families found matching '%s'\n", name);
+    }
+    else {
+        printf("Families matching '%s' (%d):\n", name, count);
+        for (int i = first; i < first + count; i++) {
+            FamilyNode* family = (FamilyNode*)family_name_index.entries[i].record;
+            printf("  %s (ID: %d), Members: %d\n", family->family_name,
+                   family->family_id, family->member_count);
+        }
+    }
+}
+
+
+//next task for thread self: its own queue from the back, then other queues from the front
+static int takeReportTask(int self){
+    ReportExecutor* ex = &report_executor;
+    int n = ex->thread_count;
+    int task = -1;
+
+    TaskQueue* own = &ex->queues[self];
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail) {
+        own->tail--;
+        task = self + own->tail * n;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    for (int i = 1; task < 0 && i < n; i++) {
+        int victim = (self + i) % n;
+        TaskQueue* queue = &ex->queues[victim];
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail) {
+            task = victim + queue->head * n;
+            queue->head++;
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return task;
+}
+
+//run a task into its own memory stream; if no stream can be opened it is
+//left for flushReportTasks to run directly on its stream
+static void executeReportTask(ReportTask* task){
+    FILE* out = open_memstream(&task->output, &task->output_size);
+    if (out) {
+        task->run(task, out);
+        fclose(out);
+        task->buffered = true;
+    }
+}
+
+static void drainReportTasks(int self){
+    ReportExecutor* ex = &report_executor;
+    int task;
+    while ((task = takeReportTask(self)) >= 0) {
+        executeReportTask(&ex->tasks[task]);
+        pthread_mutex_lock(&ex->lock);
+        if (--ex->pending == 0) {
+            pthread_cond_signal(&ex->work_done);
+        }
+        pthread_mutex_unlock(&ex->lock);
+    }
+}
+
+static void* reportWorker(void* arg){
+    ReportExecutor* ex = &report_executor;
+    int self = (int)(intptr_t)arg;
+    long seen = 0;
+
+    pthread_mutex_lock(&ex->lock);
+    while (!ex->stopping) {
+        if (ex->batch == seen) {
+            pthread_cond_wait(&ex->work_ready, &ex->lock);
+        }
+        else {
+            seen = ex->batch;
+            pthread_mutex_unlock(&ex->lock);
+            drainReportTasks(self);
+            pthread_mutex_lock(&ex->lock);
+        }
+    }
+    pthread_mutex_unlock(&ex->lock);
+    return NULL;
+}
+
+// Start the report pool on first use: one thread per online core, the caller
+// included. Threads that fail to start just leave the pool smaller.
+int reportThreadCount(){
+    ReportExecutor* ex = &report_executor;
+    if (ex->thread_count == 0) {
+#ifdef EXECUTOR_THREADS
+        long cores = EXECUTOR_THREADS; //fixed pool size (-DEXECUTOR_THREADS=<n>)
+#else
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        int wanted = (cores < 1) ? 1 : (cores > EXECUTOR_MAX_THREADS) ? EXECUTOR_MAX_THREADS : (int)cores;
+        pthread_mutex_init(&ex->lock, NULL);
+        pthread_cond_init(&ex->work_ready, NULL);
+        pthread_cond_init(&ex->work_done, NULL);
+        for (int i = 0; i < wanted; i++) {
+            pthread_mutex_init(&ex->queues[i].lock, NULL);
+        }
+        ex->stopping = false;
+        ex->batch = 0;
+        ex->thread_count = 1;
+        while (ex->thread_count < wanted &&
+               pthread_create(&ex->threads[ex->thread_count], NULL, reportWorker,
+                              (void*)(intptr_t)ex->thread_count) == 0) {
+            ex->thread_count++;
+        }
+    }
+    return ex->thread_count;
+}
+
+bool addReportTask(ReportTaskList* list, const ReportTask* task){
+    if (list->count == list->capacity) {
+        int new_capacity = (list->capacity == 0) ? 64 : list->capacity * 2;
+        ReportTask* grown = (ReportTask*)realloc(list->tasks, new_capacity * sizeof(ReportTask));
+        if (!grown) {
+            printf("Failed to allocate memory for report tasks\n");
+            return false;
+        }
+        list->tasks = grown;
+        list->capacity = new_capacity;
+    }
+    list->tasks[list->count++] = *task;
+    return true;
+}
+
+// Run a batch of report tasks on the pool and return when all are done. The
+// caller works on the batch as thread 0.
+void runReportTasks(ReportTask* tasks, int count){
+    ReportExecutor* ex = &report_executor;
+    int n = (count > 1) ? reportThreadCount() : 1;
+    if (n == 1) {
+        for (int i = 0; i < count; i++) {
+            executeReportTask(&tasks[i]);
+        }
+        return;
+    }
+
+    //a worker still draining the last batch can take these tasks as soon as
+    //they are queued, so the batch must be in place before the queues fill
+    pthread_mutex_lock(&ex->lock);
+    ex->tasks = tasks;
+    ex->pending = count;
+    pthread_mutex_unlock(&ex->lock);
+    for (int q = 0; q < n; q++) {
+        pthread_mutex_lock(&ex->queues[q].lock);
+        ex->queues[q].head = 0;
+        ex->queues[q].tail = (q < count) ? (count - q + n - 1) / n : 0;
+        pthread_mutex_unlock(&ex->queues[q].lock);
+    }
+
+    pthread_mutex_lock(&ex->lock);
+    ex->batch++;
+    pthread_cond_broadcast(&ex->work_ready);
+    pthread_mutex_unlock(&ex->lock);
+
+    drainReportTasks(0);
+
+    pthread_mutex_lock(&ex->lock);
+    while (ex->pending > 0) {
+        pthread_cond_wait(&ex->work_done, &ex->lock);
+    }
+    pthread_mutex_unlock(&ex->lock);
+}
+
+// Write the tasks' output to out in task order and free the buffers
+void flushReportTasks(FILE* out, ReportTask* tasks, int count){
+    for (int i = 0; i < count; i++) {
+        if (tasks[i].buffered) {
+            fwrite(tasks[i].output, 1, tasks[i].output_size, out);
+        }
+        else if (tasks[i].run) {
+            tasks[i].run(&tasks[i], out);
+        }
+        free(tasks[i].output);
+        tasks[i].output = NULL;
+    }
+}
+
+void stopReportExecutor(){
+    ReportExecutor* ex = &report_executor;
+    if (ex->thread_count > 0) {
+        pthread_mutex_lock(&ex->lock);
+        ex->stopping = true;
+        pthread_cond_broadcast(&ex->work_ready);
+        pthread_mutex_unlock(&ex->lock);
+        for (int i = 1; i < ex->thread_count; i++) {
+            pthread_join(ex->threads[i], NULL);
+        }
+        for (int i = 0; i < ex->thread_count; i++) {
+            pthread_mutex_destroy(&ex->queues[i].lock);
+        }
+        pthread_mutex_destroy(&ex->lock);
+        pthread_cond_destroy(&ex->work_ready);
+        pthread_cond_destroy(&ex->work_done);
+        ex->thread_count = 0;
+    }
+}
+
+
+UserNode* addUser(int user_id, const char* name, float income){
+    UserNode* ret_node;
+    if(searchUser(user_root, user_id)){
+        ret_node = NULL; //user already exists
+    }
+    else{
+        UserNode* new_user = (UserNode*)malloc(sizeof(UserNode));
+        UserDetails* details = (UserDetails*)calloc(1, sizeof(UserDetails));
+        if (!new_user || !details) {
+            printf("Failed to allocate memory for user\n");
+            free(new_user);
+            free(details);
+            return NULL;
+        }
+        new_user->user_id = user_id;
+        new_user->details = details;
+        details->user_name = internString(&name_pool, name);
+        new_user->income = income;
+        new_user->family = NULL;
+        new_user->expenses_head = NULL;
+        new_user->expenses_tail = NULL;
+        new_user->amount_head = NULL;
+        new_user->expense_count = 0;
+        new_user->total_expense = 0.0f;
+        memset(new_user->category_expenses, 0, sizeof(new_user->category_expenses));
+        bumpUserGeneration(new_user);
+
+        insertUser(&user_root, new_user);
+        nameIndexInsert(&user_name_index, new_user->details->user_name, user_id, new_user);
+        ret_node = new_user;
+    }
+    
+    return ret_node;
+}
+
+FamilyNode* createFamily(int family_id, const char* family_name){
+    FamilyNode* ret_node;
+    if(searchFamily(family_root, family_id)){
+        ret_node = NULL; //Family already exists
+    }
+    else{
+        FamilyNode* new_family = (FamilyNode*)malloc(sizeof(FamilyNode));
+        new_family->family_id = family_id;
+        new_family->family_name = internString(&name_pool, family_name);
+        new_family->member_count = 0;
+        new_family->total_income = 0.0f;
+        new_family->total_expense = 0.0f;
+        memset(new_family->category_expenses, 0, sizeof(new_family->category_expenses));
+        bumpFamilyGeneration(new_family);
+        new_family->members = new_family->inline_members;
+        new_family->member_capacity = FAMILY_INLINE_MEMBERS;
+        for (int i = 0; i < FAMILY_INLINE_MEMBERS; i++) {
+            new_family->inline_members[i] = NULL;
+        }
+
+        insertFamily(&family_root, new_family);
+        nameIndexInsert(&family_name_index, new_family->family_name, family_id, new_family);
+        ret_node = new_family;
+    }
+    
+    return ret_node;
+}
+
+//append a member, moving from inline storage to a growable buffer once full
+bool addFamilyMember(FamilyNode* family, UserNode* user){
+    if (family->member_count == family->member_capacity) {
+        int new_capacity = family->member_capacity * 2;
+        UserNode** grown;
+        if (family->members == family->inline_members) {
+            grown = (UserNode**)malloc(new_capacity * sizeof(UserNode*));
+            if (grown) {
+                memcpy(grown, family->inline_members, family->member_count * sizeof(UserNode*));
+            }
+        }
+        else {
+            grown = (UserNode**)realloc(family->members, new_capacity * sizeof(UserNode*));
+        }
+        if (!grown) {
+            printf("Failed to allocate memory for family members\n");
+            return false;
+        }
+        family->members = grown;
+        family->member_capacity = new_capacity;
+    }
+    family->members[family->member_count++] = user;
+    return true;
+}
+
+void freeFamily(FamilyNode* family){
+    if (family) {
+        if (family->members != family->inline_members) {
+            free(family->members);
+        }
+        free(family);
+    }
+}
+
+bool joinFamily(int user_id, int family_id){
+    UserNode* user = searchUser(user_root, user_id);
+    FamilyNode* family = searchFamily(family_root, family_id);
+    bool done;
+
+    if(!user || !family){
+        printf("Error: User %d or Family %d not found\n", user_id, family_id);
+        done = false;
+    }
+    else if(user->family){
+        printf("Error: User %d already belongs to family %d\n", user_id, user->family->family_id);
+        done = false;
+    }
+    else if(!addFamilyMember(family, user)) {
+        printf("Error: Could not add user %d to family %d\n", user_id, family_id);
+        done = false;
+    }
+    else{
+        family->total_income += user->income;
+        family->total_expense += user->total_expense;
+        
+        //update category expenses
+        for (int i = 0; i < MAX_CATEGORIES; i++) {
+            family->category_expenses[i] += user->category_expenses[i];
+        }
+
+        //set user's family
+        user->family = family;
+        bumpUserGeneration(user);
+        done = true;
+    }
+    return done;
+}
+
+// Take a user out of its family, along with the user's income and totals
+void leaveFamily(UserNode* user){
+    FamilyNode* family = user->family;
+    if (!family) {
+        return;
+    }
+    bumpUserGeneration(user);
+    //search from the back: removeFamily empties a family from its last member
+    for (int i = family->member_count - 1; i >= 0; i--) {
+        if (family->members[i] == user) {
+            memmove(&family->members[i], &family->members[i + 1],
+                    (family->member_count - i - 1) * sizeof(UserNode*));
+            family->member_count--;
+            break;
+        }
+    }
+    family->total_income -= user->income;
+    family->total_expense -= user->total_expense;
+    for (int i = 0; i < MAX_CATEGORIES; i++) {
+        family->category_expenses[i] -= user->category_expenses[i];
+    }
+    user->family = NULL;
+}
+
+//whether a compressed, archived or paged record already holds the key
+static bool coldExpenseExists(int user_id, int expense_id){
+    ExpenseRecord record;
+    return findCompressedExpense(user_id, expense_id, &record) ||
+           findArchivedExpense(user_id, expense_id, &record) ||
+           pagedSearch(&paged_store, user_id, expense_id, &record);
+}
+
+ExpenseNode* addExpense(int user_id, int expense_id, float amount, ExpenseCategory category, Date date) {
+    UserNode* user = searchUser(user_root, user_id);
+    if (!user) {
+        printf("Error: User %d not found\n", user_id);
+        return NULL;
+    }
+
+    if (!isValidDate(date)) {
+        printf("Error: Invalid date %d/%d/%d\n", date.day, date.month, date.year);
+        return NULL;
+    }
+
+    if (category < 0 || category >= MAX_CATEGORIES) {
+        printf("Error: Invalid category %d\n", category);
+        return NULL;
+    }
+
+    // Check if this user already has an expense with this ID, in memory or in a cold tier
+    if (searchExpenseForUser(user, expense_id) || coldExpenseExists(user_id, expense_id)) {
+        printf("Error: User %d already has expense with ID %d\n", user_id, expense_id);
+        return NULL;
+    }
+
+    ExpenseNode* new_expense = (ExpenseNode*)malloc(sizeof(ExpenseNode));
+    if (!new_expense) {
+        perror("Error allocating memory for expense");
+        return NULL;
+    }
+
+    new_expense->expense_id = expense_id;
+    new_expense->user_id = user_id;
+    new_expense->amount = amount;
+    new_expense->category = category;
+    new_expense->date = packDate(date);
+    new_expense->tombstone = false;
+    new_expense->prev_by_amount = NULL;
+    new_expense->next_by_amount = NULL;
+    new_expense->amount_skip = NULL;
+    new_expense->amount_levels = 0;
+    new_expense->version = NULL;
+    new_expense->prev = NULL;
+    new_expense->next = NULL;
+    new_expense->user = user;
+    expenseIndexInsert(new_expense);
+
+    // While ingesting, buffer it with only the id index knowing of it; the
+    // lists, history and month tree take it when the buffer is compacted.
+    // Without a complete index, lookups walk the lists, so it goes in now.
+    if (!lsm.enabled || expense_id_index.partial || !lsmAppend(new_expense)) {
+        store_version++;
+        openExpenseVersion(user, new_expense);
+        linkExpenseToUser(user, new_expense);
+        linkExpenseByAmount(user, new_expense);
+        addToPartition(new_expense);
+    }
+
+    // Update user and family totals
+    user->expense_count++;
+    adjustExpenseTotals(user, category, amount);
+    
+    return new_expense;
+}
+
+//month first, then key: the order in which a batch is merged into the month trees
+static int compareExpensesByMonth(const void* a, const void* b){
+    const ExpenseNode* ea = *(ExpenseNode* const*)a;
+    const ExpenseNode* eb = *(ExpenseNode* const*)b;
+    int ma = monthKey(ea->date);
+    int mb = monthKey(eb->date);
+    if (ma != mb) {
+        return (ma > mb) - (ma < mb);
+    }
+    ExpenseKey ka = makeExpenseKey(ea->user_id, ea->expense_id);
+    ExpenseKey kb = makeExpenseKey(eb->user_id, eb->expense_id);
+    return (ka > kb) - (ka < kb);
+}
+
+static int compareInts(const void* a, const void* b){
+    int ia = *(const int*)a;
+    int ib = *(const int*)b;
+    return (ia > ib) - (ia < ib);
+}
+
+//most keys a subtree of the given height can hold
+static long expenseSubtreeCapacity(int height){
+    long capacity = M - 1;
+    for (int h = 0; h < height; h++) {
+        capacity = capacity * M + (M - 1);
+    }
+    return capacity;
+}
+
+// Build a tree of the given height bottom-up from sorted expenses. Keys are
+// spread evenly over the fewest children that can hold them.
+static BTreeNodeExpense* buildExpenseSubtree(ExpenseNode** sorted, int count, int height){
+    BTreeNodeExpense* node = createExpenseNode(height == 0);
+    if (!node) {
+        return NULL;
+    }
+    if (height == 0) {
+        for (int i = 0; i < count; i++) {
+            node->keys[i] = sorted[i];
+            node->key_codes[i] = makeExpenseKey(sorted[i]->user_id, sorted[i]->expense_id);
+        }
+        node->num_keys = count;
+        return node;
+    }
+
+    long child_capacity = expenseSubtreeCapacity(height - 1);
+    int children = (int)((count + child_capacity + 1) / (child_capacity + 1));
+    children = (children < 2) ? 2 : children;
+    int child_keys = count - (children - 1);
+    int pos = 0;
+    for (int i = 0; i < children; i++) {
+        int size = child_keys / children + (i < child_keys % children);
+        node->children[i] = buildExpenseSubtree(sorted + pos, size, height - 1);
+        pos += size;
+        if (i < children - 1) {
+            node->keys[i] = sorted[pos];
+            node->key_codes[i] = makeExpenseKey(sorted[pos]->user_id, sorted[pos]->expense_id);
+            pos++;
+        }
+    }
+    node->num_keys = children - 1;
+    return node;
+}
+
+static BTreeNodeExpense* buildExpenseTree(ExpenseNode** sorted, int count){
+    int height = 0;
+    while (expenseSubtreeCapacity(height) < count) {
+        height++;
+    }
+    return buildExpenseSubtree(sorted, count, height);
+}
+
+// Rebuild a month tree bottom-up from the merge of its records with sorted new
+// ones, if there are at least a quarter as many new ones as it holds; fewer
+// are cheaper to insert. Tombstones are dropped, including any a new record
+// replaces. Returns false if the tree was left for the caller to insert into.
+static bool mergeIntoExpenseTree(ExpensePartition* part, ExpenseNode** rows, int count){
+    int tree_count = part->expense_count - (part->compressed ? part->compressed->record_count : 0) +
+                     part->tombstone_count;
+    if (count * 4 < tree_count) {
+        return false;
+    }
+    ExpenseNode** merged = (ExpenseNode**)malloc((tree_count + count + 1) * sizeof(ExpenseNode*));
+    if (!merged) {
+        return false;
+    }
+
+    //the tree's records sit after the first count slots, so the merge never overtakes them
+    ExpenseNode** tree = merged + count;
+    int tree_size = 0;
+    collectExpenses(part->root, tree, &tree_size);
+    int i = 0, j = 0, out = 0;
+    while (i < tree_size || j < count) {
+        if (i < tree_size && tree[i]->tombstone) {
+            free(tree[i++]);
+        }
+        else if (j == count || (i < tree_size && compareExpenseKeys(&tree[i], &rows[j]) < 0)) {
+            merged[out++] = tree[i++];
+        }
+        else {
+            merged[out++] = rows[j++];
+        }
+    }
+
+    releaseExpenseTree(part->root);
+    part->root = buildExpenseTree(merged, out);
+    part->tombstone_count = 0;
+    free(merged);
+    return true;
+}
+
+// Add expenses to their month trees, reordering rows by month. A new month's
+// tree is built bottom-up; an existing one is rebuilt from a merge when the
+// rows are many next to it, otherwise the rows are inserted in key order.
+void addToPartitions(ExpenseNode** rows, int count){
+    qsort(rows, count, sizeof(ExpenseNode*), compareExpensesByMonth);
+    for (int first = 0; first < count; ) {
+        int month_key = monthKey(rows[first]->date);
+        int end = first;
+        while (end < count && monthKey(rows[end]->date) == month_key) {
+            end++;
+        }
+        ExpensePartition* part = getOrCreatePartition(month_key);
+        if (part) {
+            if (!part->root) {
+                part->root = buildExpenseTree(rows + first, end - first);
+            }
+            else if (!mergeIntoExpenseTree(part, rows + first, end - first)) {
+                for (int i = first; i < end; i++) {
+                    if (!part->tombstone_count || !reviveTombstone(part, rows[i])) {
+                        insertExpense(&part->root, rows[i]);
+                    }
+                }
+            }
+            for (int i = first; i < end; i++) {
+                part->expense_count++;
+                part->total_expense += rows[i]->amount;
+                part->category_expenses[rows[i]->category] += rows[i]->amount;
+            }
+        }
+        first = end;
+    }
+}
+
+// Merge one user's batch rows (sorted by expense id) into its lists and totals.
+// Rows that duplicate an existing id, in memory or in a cold tier, or an
+// earlier row are freed and set to NULL.
+static int mergeUserExpenses(UserNode* user, ExpenseNode** rows, int count){
+    //stored ids in the batch's id range; the rows are sorted, so one range
+    //covers them all. In-memory ids are checked via the id index.
+    ExpenseRecord* cold = NULL;
+    int cold_count = collectColdExpenses(user->user_id, rows[0]->expense_id, rows[count - 1]->expense_id, &cold);
+    int* existing = (int*)malloc((cold_count + 1) * sizeof(int));
+    if (!existing) {
+        printf("Failed to allocate memory for batch\n");
+        free(cold);
+        for (int i = 0; i < count; i++) {
+            free(rows[i]);
+            rows[i] = NULL;
+        }
+        return 0;
+    }
+    int existing_count = cold_count;
+    for (int i = 0; i < cold_count; i++) {
+        existing[i] = cold[i].expense_id;
+    }
+    free(cold);
+    qsort(existing, existing_count, sizeof(int), compareInts);
+
+    int accepted = 0;
+    ExpenseNode* last_accepted = NULL;
+    float category_sums[MAX_CATEGORIES] = {0};
+    for (int i = 0; i < count; i++) {
+        int id = rows[i]->expense_id;
+        bool duplicate = (last_accepted && last_accepted->expense_id == id) ||
+                         searchExpenseForUser(user, id) ||
+                         bsearch(&id, existing, existing_count, sizeof(int), compareInts) != NULL;
+        if (duplicate) {
+            printf("Error: User %d already has expense with ID %d\n", user->user_id, id);
+            free(rows[i]);
+            rows[i] = NULL;
+            continue;
+        }
+        //rows are in id order, so the list keeps insertion order within the batch
+        appendExpenseToUser(user, rows[i]);
+        category_sums[rows[i]->category] += rows[i]->amount;
+        openExpenseVersion(user, rows[i]);
+        linkExpenseByAmount(user, rows[i]);
+        last_accepted = rows[i];
+        accepted++;
+    }
+
+    user->expense_count += accepted;
+    for (int c = 0; c < MAX_CATEGORIES; c++) {
+        if (category_sums[c] != 0.0f) {
+            adjustExpenseTotals(user, c, category_sums[c]);
+        }
+    }
+    free(existing);
+    return accepted;
+}
+
+// Add a batch of expenses. Rows are validated and sorted by (user, expense)
+// once; each user is looked up, deduplicated and totalled once; the months are
+// filled by addToPartitions. Returns the number of expenses added.
+int addExpenses(const ExpenseInput* batch, int count){
+    //buffered expenses first, so the lists keep the order expenses were added in
+    lsmCompact();
+    ExpenseNode** rows = (ExpenseNode**)malloc((count + 1) * sizeof(ExpenseNode*));
+    if (!rows) {
+        printf("Failed to allocate memory for batch\n");
+        return 0;
+    }
+
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        const ExpenseInput* input = &batch[i];
+        if (!isValidDate(input->date)) {
+            printf("Error: Invalid date %d/%d/%d\n", input->date.day, input->date.month, input->date.year);
+            continue;
+        }
+        if (input->category < 0 || input->category >= MAX_CATEGORIES) {
+            printf("Error: Invalid category %d\n", input->category);
+            continue;
+        }
+        ExpenseNode* expense = (ExpenseNode*)malloc(sizeof(ExpenseNode));
+        if (!expense) {
+            perror("Error allocating memory for expense");
+            continue;
+        }
+        expense->expense_id = input->expense_id;
+        expense->user_id = input->user_id;
+        expense->amount = input->amount;
+        expense->category = input->category;
+        expense->date = packDate(input->date);
+        expense->tombstone = false;
+        expense->prev_by_amount = NULL;
+        expense->next_by_amount = NULL;
+        expense->amount_skip = NULL;
+        expense->amount_levels = 0;
+        expense->version = NULL;
+        rows[n++] = expense;
+    }
+    qsort(rows, n, sizeof(ExpenseNode*), compareExpenseKeys);
+
+    store_version++;
+    int added = 0;
+    for (int first = 0; first < n; ) {
+        int end = first;
+        while (end < n && rows[end]->user_id == rows[first]->user_id) {
+            end++;
+        }
+        UserNode* user = searchUser(user_root, rows[first]->user_id);
+        if (user) {
+            added += mergeUserExpenses(user, rows + first, end - first);
+        }
+        else {
+            printf("Error: User %d not found\n", rows[first]->user_id);
+            for (int i = first; i < end; i++) {
+                free(rows[i]);
+                rows[i] = NULL;
+            }
+        }
+        first = end;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        if (rows[i]) {
+            rows[kept++] = rows[i];
+        }
+    }
+
+    invalidateFrozenIndex();
+    addToPartitions(rows, kept);
+    free(rows);
+    return added;
+}
+
+// Mark a user changed. Its family and the global generation change with it,
+// since family and period reports include the user's expenses.
+void bumpUserGeneration(UserNode* user){
+    user->details->generation = ++generation_clock;
+    if (user->family) {
+        user->family->generation = generation_clock;
+    }
+    global_generation = generation_clock;
+}
+
+void bumpFamilyGeneration(FamilyNode* family){
+    family->generation = ++generation_clock;
+    global_generation = generation_clock;
+}
+
+static CachedReport* findCachedReport(ReportKind kind, long a, long b){
+    CachedReport* ret_val = NULL;
+    for (int i = 0; i < REPORT_CACHE_ENTRIES && !ret_val; i++) {
+        CachedReport* entry = &report_cache.entries[i];
+        if (entry->used && entry->kind == kind && entry->args[0] == a && entry->args[1] == b) {
+            ret_val = entry;
+        }
+    }
+    return ret_val;
+}
+
+static void dropCachedReport(CachedReport* entry){
+    free(entry->output);
+    memset(entry, 0, sizeof(*entry));
+}
+
+// Print a cached report if it is no older than generation. A stale copy is dropped.
+bool printCachedReport(ReportKind kind, long a, long b, unsigned long generation){
+    CachedReport* entry = findCachedReport(kind, a, b);
+    bool hit = entry && generation <= entry->filled_at;
+    if (hit) {
+        entry->referenced = true;
+        fwrite(entry->output, 1, entry->output_size, stdout);
+    }
+    else if (entry) {
+        dropCachedReport(entry);
+    }
+    return hit;
+}
+
+// Stream a report should be written to so that its output can be cached
+FILE* beginReportCapture(ReportCapture* capture){
+    capture->text = NULL;
+    capture->size = 0;
+    capture->out = open_memstream(&capture->text, &capture->size);
+    if (!capture->out) {
+        capture->out = stdout;
+    }
+    return capture->out;
+}
+
+// Print the captured output and, if keep is set and it is short enough, cache it.
+// A free slot is used if there is one, otherwise the clock hand picks a victim.
+void endReportCapture(ReportCapture* capture, ReportKind kind, long a, long b, bool keep){
+    if (capture->out == stdout) {
+        return;
+    }
+    fclose(capture->out);
+    fwrite(capture->text, 1, capture->size, stdout);
+    if (!keep || capture->size > REPORT_CACHE_MAX_OUTPUT) {
+        free(capture->text);
+        return;
+    }
+
+    CachedReport* entry = findCachedReport(kind, a, b);
+    for (int i = 0; i < REPORT_CACHE_ENTRIES && !entry; i++) {
+        if (!report_cache.entries[i].used) {
+            entry = &report_cache.entries[i];
+        }
+    }
+    while (!entry) {
+        CachedReport* candidate = &report_cache.entries[report_cache.clock_hand];
+        report_cache.clock_hand = (report_cache.clock_hand + 1) % REPORT_CACHE_ENTRIES;
+        if (candidate->referenced) {
+            candidate->referenced = false;
+        }
+        else {
+            entry = candidate;
+        }
+    }
+    dropCachedReport(entry);
+    entry->used = true;
+    entry->kind = kind;
+    entry->args[0] = a;
+    entry->args[1] = b;
+    entry->filled_at = generation_clock;
+    entry->output = capture->text;
+    entry->output_size = capture->size;
+}
+
+// Forget every cached report. Used when expenses move between tiers, which
+// changes how reports print them without changing any user.
+void clearReportCache(){
+    for (int i = 0; i < REPORT_CACHE_ENTRIES; i++) {
+        dropCachedReport(&report_cache.entries[i]);
+    }
+    report_cache.clock_hand = 0;
+}
+
+void getTotalExpense(int family_id, long as_of){
+    FamilyNode* family = findFamily(family_id);
+    if(!family) {
+        printf("Family not found\n");
+        return;
+    }
+
+    float total_expense = family->total_expense;
+    if(!isCurrentVersion(as_of)){
+        total_expense = 0.0f;
+        for(int i = 0; i < family->member_count; i++){
+            total_expense += userExpenseAsOf(family->members[i], as_of, NULL);
+        }
+        printf("As of version %ld\n", as_of);
+    }
+
+    printf("Family: %s (ID: %d)\n", family->family_name, family->family_id);
+    printf("Total Income: %.2f\n", family->total_income);
+    printf("Total Expenses: %.2f\n", total_expense);
+    if(archive.file && isCurrentVersion(as_of)){
+        printf("Archived before %d/%d: %.2f\n", archive.header.cutoff_month % 100,
+               archive.header.cutoff_month / 100, archivedFamilyExpense(family_id));
+    }
+
+    float balance = family->total_income - total_expense;
+    if(balance < 0){
+        printf("Warning: Expenses exceed income by %.2f\n", -balance);
+    }
+    else{
+        printf("Remaining balance: %.2f\n", balance);
+    }
+}
+
+typedef struct {
+    UserNode* user;
+    float amount;
+} Contribution;
+
+//descending by amount, ties keep member order
+static int compareContributions(const void* a, const void* b){
+    const Contribution* ca = (const Contribution*)a;
+    const Contribution* cb = (const Contribution*)b;
+    int ret_val = (ca->amount < cb->amount) - (ca->amount > cb->amount);
+    if (ret_val == 0) {
+        ret_val = (ca->user->user_id > cb->user->user_id) - (ca->user->user_id < cb->user->user_id);
+    }
+    return ret_val;
+}
+
+static bool writeCategoricalExpense(FILE* out, FamilyNode* family, ExpenseCategory category, long as_of){
+    // Collect individual contributions; an empty family still gets one slot, as malloc(0) may return NULL
+    int capacity = (family->member_count > 0) ? family->member_count : 1;
+    Contribution* contributions = (Contribution*)malloc(capacity * sizeof(Contribution));
+    if (!contributions) {
+        printf("Failed to allocate memory for contributions\n");
+        return false;
+    }
+    int count = 0;
+    float family_total = 0.0f;
+
+    for(int i = 0; i < family->member_count; i++){
+        contributions[count].user = family->members[i];
+        if (isCurrentVersion(as_of)) {
+            contributions[count].amount = family->members[i]->category_expenses[category];
+        }
+        else {
+            float category_expenses[MAX_CATEGORIES];
+            userExpenseAsOf(family->members[i], as_of, category_expenses);
+            contributions[count].amount = category_expenses[category];
+        }
+        family_total += contributions[count].amount;
+        count++;
+    }
+    if (isCurrentVersion(as_of)) {
+        family_total = family->category_expenses[category];
+    }
+    else {
+        fprintf(out, "As of version %ld\n", as_of);
+    }
+
+    fprintf(out, "Category: %s\n", category_names[category]);
+    fprintf(out, "Total family expense: %.2f\n", family_total);
+
+    // Sort contributions by amount (descending)
+    qsort(contributions, count, sizeof(Contribution), compareContributions);
+
+    // Print sorted contributions
+    fprintf(out, "Individual contributions:\n");
+    for (int i = 0; i < count; i++){
+        fprintf(out, "%s (ID: %d): %.2f\n",
+                contributions[i].user->details->user_name,
+                contributions[i].user->user_id,
+                contributions[i].amount);
+    }
+    free(contributions);
+    return true;
+}
+
+void getCategoricalExpense(int family_id, ExpenseCategory category, long as_of){
+    FamilyNode* family = findFamily(family_id);
+    if (!family) {
+        printf("Family not found\n");
+    }
+    else if (!isCurrentVersion(as_of)) {
+        writeCategoricalExpense(stdout, family, category, as_of);
+    }
+    else if (!printCachedReport(ReportCategorical, family_id, category, family->generation)) {
+        ReportCapture capture;
+        bool ok = writeCategoricalExpense(beginReportCapture(&capture), family, category, as_of);
+        endReportCapture(&capture, ReportCategorical, family_id, category, ok);
+    }
+}
+
+static void writeHighestExpenseDay(FILE* out, FamilyNode* family, long as_of){
+    DateKey max_date = 0;
+    float max_amount = 0.0f;
+
+    for(int i = 0; i < family->member_count; i++){
+        UserNode* user = family->members[i];
+        if(isCurrentVersion(as_of)){
+            ExpenseNode* expense = user->expenses_head;
+            while(expense){
+                if(expense->amount > max_amount){
+                    max_amount = expense->amount;
+                    max_date = expense->date;
+                }
+                expense = expense->next;
+            }
+
+            ExpenseRecord* records;
+            int count = collectColdExpenses(user->user_id, INT_MIN, INT_MAX, &records);
+            for(int j = 0; j < count; j++){
+                if(records[j].amount > max_amount){
+                    max_amount = records[j].amount;
+                    max_date = records[j].date;
+                }
+            }
+            free(records);
+        }
+        else{
+            for(ExpenseVersion* version = user->details->history; version; version = version->next){
+                if(version->valid_from <= as_of && as_of < version->valid_to && version->amount > max_amount){
+                    max_amount = version->amount;
+                    max_date = version->date;
+                }
+            }
+
+            ExpenseRecord* records;
+            int count = collectFoldedExpenses(user->user_id, INT_MIN, INT_MAX, &records);
+            for(int j = 0; j < count; j++){
+                if(records[j].amount > max_amount){
+                    max_amount = records[j].amount;
+                    max_date = records[j].date;
+                }
+            }
+            free(records);
+        }
+    }
+
+    if(max_amount > 0){
+        fprintf(out, "Highest expense day: %d/%d/%d (Amount: %.2f)\n",
+            DATE_DAY(max_date), DATE_MONTH(max_date), DATE_YEAR(max_date), max_amount);
+    }
+    else{
+        fprintf(out, "No expenses found for this family\n");
+    }
+}
+
+void getHighestExpenseDay(int family_id, long as_of){
+    //buffered expenses are not in the lists yet
+    lsmCompact();
+    FamilyNode* family = findFamily(family_id);
+    if(!family){
+        printf("Family not found\n");
+    }
+    else if(!isCurrentVersion(as_of)){
+        writeHighestExpenseDay(stdout, family, as_of);
+    }
+    else if(!printCachedReport(ReportHighestDay, family_id, 0, family->generation)){
+        ReportCapture capture;
+        writeHighestExpenseDay(beginReportCapture(&capture), family, as_of);
+        endReportCapture(&capture, ReportHighestDay, family_id, 0, true);
+    }
+}
+
+//descending amount order for expense history entries
+static int compareVersionsByAmount(const void* a, const void* b){
+    float amount_a = (*(const ExpenseVersion* const*)a)->amount;
+    float amount_b = (*(const ExpenseVersion* const*)b)->amount;
+    return (amount_a < amount_b) - (amount_a > amount_b);
+}
+
+static int compareRecordsByAmount(const void* a, const void* b){
+    float amount_a = ((const ExpenseRecord*)a)->amount;
+    float amount_b = ((const ExpenseRecord*)b)->amount;
+    return (amount_a < amount_b) - (amount_a > amount_b);
+}
+
+//print a user's compressed, archived and paged expenses with ids in [start_id, end_id], largest first
+static int printColdUserExpenses(FILE* out, int user_id, int start_id, int end_id){
+    ExpenseRecord* records;
+    int count = collectColdExpenses(user_id, start_id, end_id, &records);
+    if (count > 0) {
+        qsort(records, count, sizeof(ExpenseRecord), compareRecordsByAmount);
+        fprintf(out, "Compressed, archived and paged:\n");
+    }
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "ID: %d, Amount: %.2f, Category: %s, Date: %d/%d/%d\n",
+               records[i].expense_id,
+               records[i].amount,
+               category_names[records[i].category],
+               DATE_DAY(records[i].date),
+               DATE_MONTH(records[i].date),
+               DATE_YEAR(records[i].date));
+    }
+    free(records);
+    return count;
+}
+
+// Report a user's expenses as they stood at version as_of, from the history
+static void printIndividualExpenseAsOf(UserNode* user, long as_of){
+    float category_expenses[MAX_CATEGORIES];
+    float total = userExpenseAsOf(user, as_of, category_expenses);
+
+    printf("As of version %ld\n", as_of);
+    printf("Total expenses: %.2f\n", total);
+    printf("Expenses by category:\n");
+    for (int i = 0; i < MAX_CATEGORIES; i++) {
+        if (category_expenses[i] > 0) {
+            printf("%s: %.2f\n", category_names[i], category_expenses[i]);
+        }
+    }
+
+    int count = 0;
+    for (ExpenseVersion* version = user->details->history; version; version = version->next) {
+        count += (version->valid_from <= as_of && as_of < version->valid_to);
+    }
+    ExpenseVersion** visible = (ExpenseVersion**)malloc((count + 1) * sizeof(ExpenseVersion*));
+    if (!visible) {
+        printf("Failed to allocate memory for expense history\n");
+        return;
+    }
+    count = 0;
+    for (ExpenseVersion* version = user->details->history; version; version = version->next) {
+        if (version->valid_from <= as_of && as_of < version->valid_to) {
+            visible[count++] = version;
+        }
+    }
+    qsort(visible, count, sizeof(ExpenseVersion*), compareVersionsByAmount);
+
+    printf("All expenses:\n");
+    for (int i = 0; i < count; i++) {
+        printf("ID: %d, Amount: %.2f, Category: %s, Date: %d/%d/%d\n",
+               visible[i]->expense_id,
+               visible[i]->amount,
+               category_names[visible[i]->category],
+               DATE_DAY(visible[i]->date),
+               DATE_MONTH(visible[i]->date),
+               DATE_YEAR(visible[i]->date));
+    }
+    free(visible);
+
+    ExpenseRecord* records;
+    int folded = collectFoldedExpenses(user->user_id, INT_MIN, INT_MAX, &records);
+    if (folded > 0) {
+        qsort(records, folded, sizeof(ExpenseRecord), compareRecordsByAmount);
+        printf("Archived and paged:\n");
+    }
+    for (int i = 0; i < folded; i++) {
+        printf("ID: %d, Amount: %.2f, Category: %s, Date: %d/%d/%d\n",
+               records[i].expense_id,
+               records[i].amount,
+               category_names[records[i].category],
+               DATE_DAY(records[i].date),
+               DATE_MONTH(records[i].date),
+               DATE_YEAR(records[i].date));
+    }
+    free(records);
+}
+
+static void writeIndividualExpense(FILE* out, UserNode* user){
+    fprintf(out, "User: %s (ID: %d)\n", user->details->user_name, user->user_id);
+    fprintf(out, "Total expenses: %.2f\n", user->total_expense);
+
+    fprintf(out, "Expenses by category:\n");
+    for (int i = 0; i < MAX_CATEGORIES; i++) {
+        if (user->category_expenses[i] > 0) {
+            fprintf(out, "%s: %.2f\n", category_names[i], user->category_expenses[i]);
+        }
+    }
+
+    //print all expenses sorted by amount
+    fprintf(out, "All expenses:\n");
+    for (ExpenseNode* current = user->amount_head; current; current = current->next_by_amount) {
+        fprintf(out, "ID: %d, Amount: %.2f, Category: %s, Date: %d/%d/%d\n",
+               current->expense_id,
+               current->amount,
+               category_names[current->category],
+               DATE_DAY(current->date),
+               DATE_MONTH(current->date),
+               DATE_YEAR(current->date));
+    }
+    printColdUserExpenses(out, user->user_id, INT_MIN, INT_MAX);
+}
+
+void getIndividualExpense(int user_id, long as_of){
+    lsmCompact();
+    UserNode* user = findUser(user_id);
+    if(!user){
+        printf("User not found\n");
+    }
+    else if(!isCurrentVersion(as_of)){
+        printf("User: %s (ID: %d)\n", user->details->user_name, user->user_id);
+        printIndividualExpenseAsOf(user, as_of);
+    }
+    else if(!printCachedReport(ReportIndividual, user_id, 0, user->details->generation)){
+        ReportCapture capture;
+        writeIndividualExpense(beginReportCapture(&capture), user);
+        endReportCapture(&capture, ReportIndividual, user_id, 0, true);
+    }
+}
+
+// Print the n largest expenses of a user
+void getTopExpenses(int user_id, int n){
+    lsmCompact();
+    UserNode* user = findUser(user_id);
+    if(!user){
+        printf("User not found\n");
+        return;
+    }
+
+    //merge the amount chain with the user's compressed, archived and paged expenses
+    ExpenseRecord* cold;
+    int cold_count = collectColdExpenses(user_id, INT_MIN, INT_MAX, &cold);
+    if (cold_count > 0) {
+        qsort(cold, cold_count, sizeof(ExpenseRecord), compareRecordsByAmount);
+    }
+
+    printf("Top %d expenses for %s (ID: %d):\n", n, user->details->user_name, user->user_id);
+    ExpenseNode* current = user->amount_head;
+    int next_cold = 0;
+    for (int i = 0; i < n && (current || next_cold < cold_count); i++) {
+        ExpenseRecord record;
+        if (current && (next_cold == cold_count || current->amount >= cold[next_cold].amount)) {
+            record.expense_id = current->expense_id;
+            record.amount = current->amount;
+            record.category = current->category;
+            record.date = current->date;
+            current = current->next_by_amount;
+        }
+        else {
+            record = cold[next_cold++];
+        }
+        printf("%d. ID: %d, Amount: %.2f, Category: %s, Date: %d/%d/%d\n",
+               i + 1,
+               record.expense_id,
+               record.amount,
+               category_names[record.category],
+               DATE_DAY(record.date),
+               DATE_MONTH(record.date),
+               DATE_YEAR(record.date));
+    }
+    free(cold);
+}
+
+//append to the user's list in insertion order, index it and make the user its owner
+void appendExpenseToUser(UserNode* user, ExpenseNode* expense){
+    expenseIndexInsert(expense);
+    expense->user = user;
+    linkExpenseToUser(user, expense);
+}
+
+//append an already indexed expense to the end of its user's list
+void linkExpenseToUser(UserNode* user, ExpenseNode* expense){
+    expense->prev = user->expenses_tail;
+    expense->next = NULL;
+    if (user->expenses_tail) {
+        user->expenses_tail->next = expense;
+    }
+    else {
+        user->expenses_head = expense;
+    }
+    user->expenses_tail = expense;
+}
+
+//a sorts before b in a user's amount order: larger amounts first, then lower ids
+static bool amountBefore(const ExpenseNode* a, const ExpenseNode* b){
+    return a->amount > b->amount || (a->amount == b->amount && a->expense_id < b->expense_id);
+}
+
+//the link to the expense after node on a skip list level; a NULL node is the user's head
+static ExpenseNode** amountLink(UserNode* user, ExpenseNode* node, int level){
+    if (level == 0) {
+        return node ? &node->next_by_amount : &user->amount_head;
+    }
+    return node ? &node->amount_skip[level - 1] : &user->details->amount_skip_head[level - 1];
+}
+
+//levels for a new skip list entry: each further level with probability 1/4
+static int randomAmountLevels(){
+    amount_level_seed ^= amount_level_seed << 13;
+    amount_level_seed ^= amount_level_seed >> 17;
+    amount_level_seed ^= amount_level_seed << 5;
+    unsigned int bits = amount_level_seed;
+    int levels = 1;
+    while (levels < AMOUNT_SKIP_LEVELS && (bits & 3) == 0) {
+        levels++;
+        bits >>= 2;
+    }
+    return levels;
+}
+
+//last expense before the given one on every level, NULL standing for the head
+static void findAmountPredecessors(UserNode* user, const ExpenseNode* expense, ExpenseNode** preds){
+    ExpenseNode* node = NULL;
+    for (int level = AMOUNT_SKIP_LEVELS - 1; level >= 0; level--) {
+        ExpenseNode* next;
+        while ((next = *amountLink(user, node, level)) && amountBefore(next, expense)) {
+            node = next;
+        }
+        preds[level] = node;
+    }
+}
+
+// Insert into the user's amount skip list in O(log n) expected time.
+// The expense must not change amount while it is linked.
+void linkExpenseByAmount(UserNode* user, ExpenseNode* expense){
+    ExpenseNode* preds[AMOUNT_SKIP_LEVELS];
+    findAmountPredecessors(user, expense, preds);
+
+    int levels = randomAmountLevels();
+    expense->amount_skip = NULL;
+    expense->amount_levels = 1;
+    if (levels > 1) {
+        //out of memory the expense is only linked on level 0, which stays correct
+        expense->amount_skip = (ExpenseNode**)malloc((levels - 1) * sizeof(ExpenseNode*));
+        if (expense->amount_skip) {
+            expense->amount_levels = (unsigned char)levels;
+        }
+    }
+    for (int level = 1; level < expense->amount_levels; level++) {
+        ExpenseNode** link = amountLink(user, preds[level], level);
+        expense->amount_skip[level - 1] = *link;
+        *link = expense;
+    }
+
+    ExpenseNode* prev = preds[0];
+    ExpenseNode* current = *amountLink(user, prev, 0);
+    expense->prev_by_amount = prev;
+    expense->next_by_amount = current;
+    if (prev) {
+        prev->next_by_amount = expense;
+    }
+    else {
+        user->amount_head = expense;
+    }
+    if (current) {
+        current->prev_by_amount = expense;
+    }
+}
+
+// Level 0 is doubly linked, so most expenses unlink in O(1); taller ones
+// search for their predecessors on the upper levels
+void unlinkExpenseByAmount(UserNode* user, ExpenseNode* expense){
+    if (expense->amount_levels > 1) {
+        ExpenseNode* preds[AMOUNT_SKIP_LEVELS];
+        findAmountPredecessors(user, expense, preds);
+        for (int level = 1; level < expense->amount_levels; level++) {
+            *amountLink(user, preds[level], level) = expense->amount_skip[level - 1];
+        }
+    }
+    free(expense->amount_skip);
+    expense->amount_skip = NULL;
+    expense->amount_levels = 0;
+    if (expense->prev_by_amount) {
+        expense->prev_by_amount->next_by_amount = expense->next_by_amount;
+    }
+    else {
+        user->amount_head = expense->next_by_amount;
+    }
+    if (expense->next_by_amount) {
+        expense->next_by_amount->prev_by_amount = expense->prev_by_amount;
+    }
+    expense->prev_by_amount = NULL;
+    expense->next_by_amount = NULL;
+}
+
+//take an expense out of both of its user's lists in O(1); totals are left alone
+void unlinkExpenseLists(UserNode* user, ExpenseNode* expense){
+    expenseIndexRemove(expense);
+    if (expense->prev) {
+        expense->prev->next = expense->next;
+    }
+    else {
+        user->expenses_head = expense->next;
+    }
+    if (expense->next) {
+        expense->next->prev = expense->prev;
+    }
+    else {
+        user->expenses_tail = expense->prev;
+    }
+    unlinkExpenseByAmount(user, expense);
+}
+
+static int compareExpenseAmountDesc(const void* a, const void* b){
+    const ExpenseNode* ea = *(ExpenseNode* const*)a;
+    const ExpenseNode* eb = *(ExpenseNode* const*)b;
+    int ret_val = (ea->amount < eb->amount) - (ea->amount > eb->amount);
+    if (ret_val == 0) {
+        ret_val = (ea->expense_id > eb->expense_id) - (ea->expense_id < eb->expense_id);
+    }
+    return ret_val;
+}
+
+static int compareExpenseCategory(const void* a, const void* b){
+    const ExpenseNode* ea = *(ExpenseNode* const*)a;
+    const ExpenseNode* eb = *(ExpenseNode* const*)b;
+    int ret_val = (int)ea->category - (int)eb->category;
+    if (ret_val == 0) {
+        ret_val = compareExpenseAmountDesc(a, b);
+    }
+    return ret_val;
+}
+
+// Sort descending by amount
+void sortExpensesByAmount(ExpenseNode** expenses, int count){
+    qsort(expenses, count, sizeof(ExpenseNode*), compareExpenseAmountDesc);
+}
+
+// Sort by category, then descending by amount within a category
+void sortExpensesByCategory(ExpenseNode** expenses, int count){
+    qsort(expenses, count, sizeof(ExpenseNode*), compareExpenseCategory);
+}
+
+static int daysInMonth(int month, int year){
+    static const int days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int ret_val = days[month - 1];
+    if (month == 2 && ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0)) {
+        ret_val = 29;
+    }
+    return ret_val;
+}
+
+bool isValidDate(Date date){
+    return date.year >= 1 && date.year <= 9999 &&
+           date.month >= 1 && date.month <= 12 &&
+           date.day >= 1 && date.day <= daysInMonth(date.month, date.year);
+}
+
+DateKey packDate(Date date){
+    return (DateKey)(date.year * 10000 + date.month * 100 + date.day);
+}
+
+int dateCompare(DateKey d1, DateKey d2){
+    return (d1 > d2) - (d1 < d2);
+}
+
+//print the expenses of one partition tree that fall in [start, end], adding them to total
+static int printExpensesInPeriod(FILE* out, BTreeNodeExpense* root, DateKey start, DateKey end, double* total){
+    int count = 0;
+    if(root != NULL){
+        for(int i = 0; i < root->num_keys; i++){
+            if(!root->is_leaf){
+                count += printExpensesInPeriod(out, root->children[i], start, end, total);
+            }
+    
+            ExpenseNode* expense = root->keys[i];
+            if(!expense->tombstone && dateInRange(expense->date, start, end)){
+                fprintExpense(out, expense);
+                *total += expense->amount;
+                count++;
+            }
+        }
+    
+        if(!root->is_leaf){
+            count += printExpensesInPeriod(out, root->children[root->num_keys], start, end, total);
+        }
+    }
+    return count;
+}
+
+static void runExpenseScanTask(ReportTask* task, FILE* out){
+    task->count = printExpensesInPeriod(out, (BTreeNodeExpense*)task->source, task->start, task->end, &task->total);
+    ExpenseNode* expense = task->separator;
+    if(expense && !expense->tombstone && dateInRange(expense->date, task->start, task->end)){
+        fprintExpense(out, expense);
+        task->total += expense->amount;
+        task->count++;
+    }
+}
+
+static void runCompressedScanTask(ReportTask* task, FILE* out){
+    float total = 0.0f;
+    task->count = printCompressedInPeriod(out, (const CompressedMonth*)task->source, task->key,
+                                          task->start, task->end, &total);
+    task->total = total;
+}
+
+//Split the in-order scan of a month tree into subtree tasks, depth levels
+//down. Each key above those subtrees rides along with the subtree before it.
+static bool splitExpenseScan(ReportTaskList* list, const ReportTask* base, BTreeNodeExpense* node,
+                             ExpenseNode* separator, int depth){
+    bool done = true;
+    if (depth == 0 || node->is_leaf) {
+        ReportTask task = *base;
+        task.source = node;
+        task.separator = separator;
+        done = addReportTask(list, &task);
+    }
+    else {
+        for (int i = 0; done && i <= node->num_keys; i++) {
+            done = splitExpenseScan(list, base, node->children[i],
+                                    (i < node->num_keys) ? node->keys[i] : separator, depth - 1);
+        }
+    }
+    return done;
+}
+
+//Tasks for the months overlapping [start, end]: about target subtree tasks
+//in all, then one task per compressed month
+static bool addExpenseScanTasks(ReportTaskList* list, DateKey start, DateKey end,
+                                ReportTaskFn tree_run, ReportTaskFn compressed_run, const void* params){
+    int first = partitionLowerBound(monthKey(start));
+    int last = first;
+    while (last < expense_store.count && expense_store.partitions[last].month_key <= monthKey(end)) {
+        last++;
+    }
+    int target = reportThreadCount() * EXECUTOR_TASKS_PER_THREAD;
+    int per_month = (last > first) ? (target + (last - first) - 1) / (last - first) : 1;
+
+    bool done = true;
+    for (int i = first; done && i < last; i++) {
+        const ExpensePartition* part = &expense_store.partitions[i];
+        ReportTask base;
+        memset(&base, 0, sizeof(base));
+        base.key = part->month_key;
+        base.start = start;
+        base.end = end;
+        base.params = params;
+        if (part->root) {
+            int depth = 0;
+            int pieces = 1;
+            for (BTreeNodeExpense* node = part->root; !node->is_leaf && pieces < per_month; node = node->children[0]) {
+                pieces *= node->num_keys + 1;
+                depth++;
+            }
+            base.run = tree_run;
+            done = splitExpenseScan(list, &base, part->root, NULL, depth);
+        }
+        if (done && part->compressed) {
+            base.run = compressed_run;
+            base.source = part->compressed;
+            done = addReportTask(list, &base);
+        }
+    }
+    return done;
+}
+
+//Tokens are words (letters, digits and . / - _ *) or one of , ( ) = and the
+//two-character <= and >=. Words are lower-cased.
+static const char* nextQueryToken(const char* pos, char* token){
+    while (isspace((unsigned char)*pos)) {
+        pos++;
+    }
+    int len = 0;
+    if ((*pos == '<' || *pos == '>') && pos[1] == '=') {
+        token[len++] = *pos;
+        token[len++] = '=';
+        pos += 2;
+    }
+    else if (*pos == ',' || *pos == '(' || *pos == ')' || *pos == '=' || *pos == '<' || *pos == '>') {
+        token[len++] = *pos++;
+    }
+    else {
+        while (*pos && (isalnum((unsigned char)*pos) || strchr("./-_*", *pos))) {
+            if (len < QUERY_TOKEN_LEN - 1) {
+                token[len++] = (char)tolower((unsigned char)*pos);
+            }
+            pos++;
+        }
+    }
+    token[len] = '\0';
+    return pos;
+}
+
+static bool parseQueryInt(const char* token, int* out){
+    char* end;
+    long value = strtol(token, &end, 10);
+    bool ok = *token && *end == '\0' && value >= INT_MIN && value <= INT_MAX;
+    if (ok) {
+        *out = (int)value;
+    }
+    return ok;
+}
+
+//column names, plus "expense" for id and "day" for date
+static int parseQueryColumn(const char* token){
+    int ret_val = -1;
+    for (int i = 0; i < QUERY_COLUMN_COUNT && ret_val < 0; i++) {
+        if (strcmp(token, query_column_names[i]) == 0) {
+            ret_val = i;
+        }
+    }
+    if (strcmp(token, "expense") == 0) {
+        ret_val = ColumnId;
+    }
+    else if (strcmp(token, "day") == 0) {
+        ret_val = ColumnDate;
+    }
+    return ret_val;
+}
+
+//value of a predicate on column; dates are dd/mm/yyyy and categories a name or number
+static bool parseQueryValue(QueryColumn column, const char* token, double* out){
+    bool ok = false;
+    int value;
+    if (column == ColumnDate) {
+        Date date;
+        char tail;
+        ok = sscanf(token, "%d/%d/%d%c", &date.day, &date.month, &date.year, &tail) == 3 && isValidDate(date);
+        *out = ok ? packDate(date) : 0;
+    }
+    else if (column == ColumnCategory) {
+        for (int i = 0; i < MAX_CATEGORIES && !ok; i++) {
+            char name[NAME_LEN];
+            int len = 0;
+            for (; category_names[i][len]; len++) {
+                name[len] = (char)tolower((unsigned char)category_names[i][len]);
+            }
+            name[len] = '\0';
+            ok = strcmp(token, name) == 0;
+            *out = i;
+        }
+        if (!ok && parseQueryInt(token, &value) && value >= 0 && value < MAX_CATEGORIES) {
+            ok = true;
+            *out = value;
+        }
+    }
+    else if (column == ColumnAmount) {
+        char* end;
+        *out = strtod(token, &end);
+        ok = *token && *end == '\0';
+    }
+    else if (parseQueryInt(token, &value)) {
+        ok = true;
+        *out = value;
+    }
+    return ok;
+}
+
+//narrow the column's range to [low, high]
+static void restrictQuery(ExpenseQuery* query, QueryColumn column, double low, double high){
+    switch (column) {
+        case ColumnUser:
+            query->user_low = (low > query->user_low) ? (int)low : query->user_low;
+            query->user_high = (high < query->user_high) ? (int)high : query->user_high;
+            break;
+        case ColumnId:
+            query->id_low = (low > query->id_low) ? (int)low : query->id_low;
+            query->id_high = (high < query->id_high) ? (int)high : query->id_high;
+            break;
+        case ColumnFamily:
+            query->family_filter = true;
+            query->family_low = (low > query->family_low) ? (int)low : query->family_low;
+            query->family_high = (high < query->family_high) ? (int)high : query->family_high;
+            break;
+        case ColumnAmount:
+            query->amount_low = (low > query->amount_low) ? (float)low : query->amount_low;
+            query->amount_high = (high < query->amount_high) ? (float)high : query->amount_high;
+            break;
+        case ColumnCategory:
+            query->category_low = (low > query->category_low) ? (int)low : query->category_low;
+            query->category_high = (high < query->category_high) ? (int)high : query->category_high;
+            break;
+        case ColumnDate:
+            query->date_low = (low > query->date_low) ? (DateKey)low : query->date_low;
+            query->date_high = (high < query->date_high) ? (DateKey)high : query->date_high;
+            break;
+    }
+}
+
+// Parse a query of the form
+//   [explain] [select * | count | sum | column, ...]
+//   [where column = v | column <= v | column >= v | column between v and v [and ...]]
+//   [order by column [asc | desc]] [limit n]
+// over the columns user, id, family, amount, category and date
+bool parseQuery(const char* text, ExpenseQuery* query){
+    char token[QUERY_TOKEN_LEN];
+    const char* pos = nextQueryToken(text, token);
+    bool ok = true;
+
+    memset(query, 0, sizeof(*query));
+    query->user_low = INT_MIN;
+    query->user_high = INT_MAX;
+    query->family_low = INT_MIN;
+    query->family_high = INT_MAX;
+    query->category_low = 0;
+    query->category_high = MAX_CATEGORIES - 1;
+    query->id_low = INT_MIN;
+    query->id_high = INT_MAX;
+    query->date_low = 0;
+    query->date_high = ~(DateKey)0;
+    query->amount_low = -1e30f;
+    query->amount_high = 1e30f;
+    query->limit = -1;
+
+    if (strcmp(token, "explain") == 0) {
+        query->explain = true;
+        pos = nextQueryToken(pos, token);
+    }
+    if (strcmp(token, "select") == 0) {
+        do {
+            pos = nextQueryToken(pos, token);
+            int column = parseQueryColumn(token);
+            if (strcmp(token, "*") == 0 && query->column_count == 0) {
+                for (int i = 0; i < QUERY_COLUMN_COUNT; i++) {
+                    query->columns[query->column_count++] = (QueryColumn)i;
+                }
+            }
+            else if (strcmp(token, "count") == 0 || strcmp(token, "sum") == 0) {
+                bool is_count = token[0] == 'c';
+                query->count = query->count || is_count;
+                query->sum = query->sum || !is_count;
+                const char* after = nextQueryToken(pos, token);
+                if (strcmp(token, "(") == 0) {
+                    after = nextQueryToken(after, token);
+                    pos = nextQueryToken(after, token);
+                    ok = strcmp(token, ")") == 0;
+                }
+            }
+            else if (column >= 0 && query->column_count < QUERY_COLUMN_COUNT) {
+                query->columns[query->column_count++] = (QueryColumn)column;
+            }
+            else {
+                printf("Query error: unknown column '%s'\n", token);
+                ok = false;
+            }
+            pos = nextQueryToken(pos, token);
+        } while (ok && strcmp(token, ",") == 0);
+
+        if (ok && query->column_count > 0 && (query->count || query->sum)) {
+            printf("Query error: columns cannot be mixed with count or sum\n");
+            ok = false;
+        }
+    }
+    if (ok && query->column_count == 0 && !query->count && !query->sum) {
+        for (int i = 0; i < QUERY_COLUMN_COUNT; i++) {
+            query->columns[query->column_count++] = (QueryColumn)i;
+        }
+    }
+
+    if (ok && strcmp(token, "where") == 0) {
+        do {
+            pos = nextQueryToken(pos, token);
+            int column = parseQueryColumn(token);
+            char op[QUERY_TOKEN_LEN];
+            double low;
+            double high;
+            pos = nextQueryToken(pos, op);
+            pos = nextQueryToken(pos, token);
+            ok = column >= 0 && parseQueryValue((QueryColumn)column, token, &low);
+            high = low;
+            if (ok && strcmp(op, "between") == 0) {
+                pos = nextQueryToken(pos, token);
+                ok = strcmp(token, "and") == 0;
+                pos = nextQueryToken(pos, token);
+                ok = ok && parseQueryValue((QueryColumn)column, token, &high);
+            }
+            else if (ok && strcmp(op, "<=") == 0) {
+                low = -1e30;
+            }
+            else if (ok && strcmp(op, ">=") == 0) {
+                high = 1e30;
+            }
+            else if (ok && strcmp(op, "=") != 0) {
+                ok = false;
+            }
+            if (ok) {
+                restrictQuery(query, (QueryColumn)column, low, high);
+                pos = nextQueryToken(pos, token);
+            }
+            else {
+                printf("Query error: bad condition near '%s'\n", token);
+            }
+        } while (ok && strcmp(token, "and") == 0);
+    }
+
+    if (ok && strcmp(token, "order") == 0) {
+        pos = nextQueryToken(pos, token);
+        ok = strcmp(token, "by") == 0;
+        pos = nextQueryToken(pos, token);
+        int column = parseQueryColumn(token);
+        ok = ok && column >= 0;
+        if (ok) {
+            query->ordered = true;
+            query->order_column = (QueryColumn)column;
+            pos = nextQueryToken(pos, token);
+            if (strcmp(token, "asc") == 0 || strcmp(token, "desc") == 0) {
+                query->descending = token[0] == 'd';
+                pos = nextQueryToken(pos, token);
+            }
+        }
+        else {
+            printf("Query error: bad order by\n");
+        }
+    }
+
+    if (ok && strcmp(token, "limit") == 0) {
+        pos = nextQueryToken(pos, token);
+        ok = parseQueryInt(token, &query->limit) && query->limit >= 0;
+        if (!ok) {
+            printf("Query error: bad limit '%s'\n", token);
+        }
+        pos = nextQueryToken(pos, token);
+    }
+
+    if (ok && token[0] != '\0') {
+        printf("Query error: unexpected '%s'\n", token);
+        ok = false;
+    }
+    return ok;
+}
+
+//months of the store lying wholly inside [low, high]; false if either end cuts a month
+static bool queryCoversWholeMonths(DateKey low, DateKey high){
+    bool starts = low == 0 || DATE_DAY(low) == 1;
+    bool ends = high == ~(DateKey)0 ||
+                DATE_DAY(high) == daysInMonth(DATE_MONTH(high), DATE_YEAR(high));
+    return starts && ends;
+}
+
+//rows the path has to look at, or -1 if the path cannot answer the query
+static long estimateQueryPath(const ExpenseQuery* query, QueryPath path){
+    long cost = -1;
+    bool one_user = query->user_low == query->user_high;
+    bool one_family = query->family_filter && query->family_low == query->family_high;
+    bool all_categories = query->category_low == 0 && query->category_high == MAX_CATEGORIES - 1;
+    bool one_category = query->category_low == query->category_high;
+    bool all_dates = query->date_low == 0 && query->date_high == ~(DateKey)0;
+    bool all_users = query->user_low == INT_MIN && query->user_high == INT_MAX;
+    bool all_ids = query->id_low == INT_MIN && query->id_high == INT_MAX;
+    bool all_amounts = query->amount_low <= -1e30f && query->amount_high >= 1e30f;
+    UserNode* user = one_user ? searchUser(user_root, query->user_low) : NULL;
+    FamilyNode* family = one_family ? searchFamily(family_root, query->family_low) : NULL;
+    long lsm_count = lsm.memtable_count;
+    for (int r = 0; r < lsm.run_count; r++) {
+        lsm_count += lsm.runs[r].count;
+    }
+
+    switch (path) {
+        //the lists hold buffered expenses only once they are compacted
+        case PathUserList:
+            if (one_user) {
+                cost = 1 + lsm_count + (user ? user->expense_count : 0);
+            }
+            break;
+        case PathFamilyMembers:
+            if (one_family) {
+                cost = 1 + lsm_count;
+                for (int i = 0; family && i < family->member_count; i++) {
+                    cost += family->members[i]->expense_count;
+                }
+            }
+            break;
+        case PathMonthPartitions:
+            cost = 1 + lsm_count + paged_store.record_count;
+            for (int i = 0; i < expense_store.count; i++) {
+                const ExpensePartition* part = &expense_store.partitions[i];
+                if (part->month_key >= monthKey(query->date_low) && part->month_key <= monthKey(query->date_high)) {
+                    cost += part->expense_count + part->tombstone_count;
+                }
+            }
+            if (archive.file && monthKey(query->date_low) < archive.header.cutoff_month) {
+                cost += archive.header.record_count;
+            }
+            break;
+        case PathTotals:
+            //totals cannot count by category; month totals leave out archived and paged months
+            if (query->column_count == 0 && all_ids && all_amounts &&
+                (all_categories || (one_category && !query->count))) {
+                if (one_user && !query->family_filter && all_dates) {
+                    cost = 1;
+                }
+                else if (one_family && all_users && all_dates) {
+                    cost = 1 + (family ? family->member_count : 0);
+                }
+                else if (!query->family_filter && all_users && lsm_count == 0 &&
+                         queryCoversWholeMonths(query->date_low, query->date_high) &&
+                         (!archive.file || monthKey(query->date_low) >= archive.header.cutoff_month) &&
+                         (!paged_store.file || paged_store.record_count == 0 ||
+                          monthKey(query->date_low) >= paged_store.cutoff_month)) {
+                    cost = 1 + expense_store.count;
+                }
+            }
+            break;
+    }
+    return cost;
+}
+
+// Pick the cheapest path that can answer the query; ties go to the earlier path
+QueryPath planQuery(const ExpenseQuery* query, long* cost){
+    QueryPath best = PathMonthPartitions;
+    long best_cost = estimateQueryPath(query, PathMonthPartitions);
+    for (int path = 0; path < QUERY_PATH_COUNT; path++) {
+        long path_cost = estimateQueryPath(query, (QueryPath)path);
+        if (path_cost >= 0 && path_cost < best_cost) {
+            best = (QueryPath)path;
+            best_cost = path_cost;
+        }
+    }
+    *cost = best_cost;
+    return best;
+}
+
+//keep a candidate row if it passes every predicate
+static void addQueryRow(QueryResult* result, const ExpenseQuery* query, int user_id, int expense_id,
+                        float amount, int category, DateKey date){
+    if (user_id < query->user_low || user_id > query->user_high ||
+        expense_id < query->id_low || expense_id > query->id_high ||
+        category < query->category_low || category > query->category_high ||
+        date < query->date_low || date > query->date_high ||
+        amount < query->amount_low || amount > query->amount_high) {
+        return;
+    }
+    int family_id = GROUP_NONE;
+    if (result->needs_family) {
+        UserNode* user = searchUser(user_root, user_id);
+        family_id = (user && user->family) ? user->family->family_id : GROUP_NONE;
+        if (query->family_filter && (family_id == GROUP_NONE ||
+                                     family_id < query->family_low || family_id > query->family_high)) {
+            return;
+        }
+    }
+
+    if (result->count == result->capacity) {
+        int new_capacity = (result->capacity == 0) ? 64 : result->capacity * 2;
+        QueryRow* grown = (QueryRow*)realloc(result->rows, new_capacity * sizeof(QueryRow));
+        if (!grown) {
+            result->failed = true;
+            return;
+        }
+        result->rows = grown;
+        result->capacity = new_capacity;
+    }
+    QueryRow* row = &result->rows[result->count++];
+    row->record.user_id = user_id;
+    row->record.expense_id = expense_id;
+    row->record.amount = amount;
+    row->record.category = category;
+    row->record.date = date;
+    row->family_id = family_id;
+    row->sort_key = 0.0;
+}
+
+static void queryPagedSubtree(QueryResult* result, const ExpenseQuery* query, unsigned int page_id,
+                              ExpenseKey low, ExpenseKey high){
+    ExpensePage* page = pinPage(&paged_store, page_id);
+    if (page) {
+        int i = nodeLowerBoundExpense(page->key_codes, page->num_keys, low);
+        for (; i <= page->num_keys; i++) {
+            if (!page->is_leaf) {
+                queryPagedSubtree(result, query, page->children[i], low, high);
+            }
+            if (i == page->num_keys || page->key_codes[i] > high) {
+                break;
+            }
+            const ExpenseRecord* record = &page->records[i];
+            addQueryRow(result, query, record->user_id, record->expense_id, record->amount,
+                        record->category, record->date);
+        }
+        unpinPage(&paged_store, page, false);
+    }
+}
+
+//a user's expenses in every tier, found through the user's list and id ranges
+static void queryUserExpenses(QueryResult* result, const ExpenseQuery* query, int user_id){
+    lsmCompact();
     UserNode* user = searchUser(user_root, user_id);
-    FamilyNode* family = searchFamily(family_root, family_id);
-    bool done;
+    for (ExpenseNode* expense = user ? user->expenses_head : NULL; expense; expense = expense->next) {
+        addQueryRow(result, query, expense->user_id, expense->expense_id, expense->amount,
+                    expense->category, expense->date);
+    }
+    ExpenseRecord* cold;
+    int cold_count = collectColdExpenses(user_id, query->id_low, query->id_high, &cold);
+    for (int i = 0; i < cold_count; i++) {
+        addQueryRow(result, query, cold[i].user_id, cold[i].expense_id, cold[i].amount,
+                    cold[i].category, cold[i].date);
+    }
+    free(cold);
+}
 
-    if(!user || !family){
-        printf("Error: User %d or Family %d not found\n", user_id, family_id);
-        done = false;
+static void queryExpenseTree(QueryResult* result, const ExpenseQuery* query, const BTreeNodeExpense* root){
+    if (root) {
+        for (int i = 0; i < root->num_keys; i++) {
+            if (!root->is_leaf) {
+                queryExpenseTree(result, query, root->children[i]);
+            }
+            const ExpenseNode* expense = root->keys[i];
+            if (!expense->tombstone) {
+                addQueryRow(result, query, expense->user_id, expense->expense_id, expense->amount,
+                            expense->category, expense->date);
+            }
+        }
+        if (!root->is_leaf) {
+            queryExpenseTree(result, query, root->children[root->num_keys]);
+        }
     }
-    else if(user->family){
-        printf("Error: User %d already belongs to family %d\n", user_id, user->family->family_id);
-        done = false;
+}
+
+//every tier, visiting only the months inside the date range
+static void queryMonthPartitions(QueryResult* result, const ExpenseQuery* query){
+    ExpenseRecord block[COMPRESSED_BLOCK_RECORDS];
+    for (int i = partitionLowerBound(monthKey(query->date_low));
+         i < expense_store.count && expense_store.partitions[i].month_key <= monthKey(query->date_high); i++) {
+        const ExpensePartition* part = &expense_store.partitions[i];
+        queryExpenseTree(result, query, part->root);
+        for (int b = 0; part->compressed && b < part->compressed->block_count; b++) {
+            int n = decodeBlock(part->compressed, b, part->month_key, block);
+            for (int j = 0; j < n; j++) {
+                addQueryRow(result, query, block[j].user_id, block[j].expense_id, block[j].amount,
+                            block[j].category, block[j].date);
+            }
+        }
     }
-    else if(family->member_count >= MAX_FAMILY_MEMBERS) {
-        printf("Error: Family %d is full (max %d members)\n", family_id, MAX_FAMILY_MEMBERS);
-        done = false;
+
+    for (int i = 0; i < lsm.memtable_count; i++) {
+        const ExpenseNode* expense = lsm.memtable[i];
+        addQueryRow(result, query, expense->user_id, expense->expense_id, expense->amount,
+                    expense->category, expense->date);
     }
-    else{
-        //ddd user to family
-        family->members[family->member_count++] = user;
-        family->total_income += user->income;
-        family->total_expense += user->total_expense;
-        
-        //update category expenses
-        for (int i = 0; i < MAX_CATEGORIES; i++) {
-            family->category_expenses[i] += user->category_expenses[i];
+    for (int r = 0; r < lsm.run_count; r++) {
+        for (int i = 0; i < lsm.runs[r].count; i++) {
+            const ExpenseNode* expense = lsm.runs[r].expenses[i];
+            addQueryRow(result, query, expense->user_id, expense->expense_id, expense->amount,
+                        expense->category, expense->date);
+        }
+    }
+
+    DateKey dates[ARCHIVE_SCAN_ROWS];
+    ExpenseRecord rows[ARCHIVE_SCAN_ROWS];
+    bool ok = archive.file && monthKey(query->date_low) < archive.header.cutoff_month;
+    for (int first = 0; ok && first < archive.header.record_count; first += ARCHIVE_SCAN_ROWS) {
+        int n = archive.header.record_count - first;
+        n = (n < ARCHIVE_SCAN_ROWS) ? n : ARCHIVE_SCAN_ROWS;
+        ok = readArchiveColumn(4, first, n, dates, sizeof(DateKey));
+        bool any = false;
+        for (int i = 0; ok && i < n && !any; i++) {
+            any = dateInRange(dates[i], query->date_low, query->date_high);
+        }
+        if (any && (ok = readArchiveRows(first, n, rows))) {
+            for (int i = 0; i < n; i++) {
+                addQueryRow(result, query, rows[i].user_id, rows[i].expense_id, rows[i].amount,
+                            rows[i].category, rows[i].date);
+            }
+        }
+    }
+
+    if (paged_store.file && paged_store.root_page != 0) {
+        queryPagedSubtree(result, query, paged_store.root_page, 0, ~(ExpenseKey)0);
+    }
+}
+
+//count and sum straight from the user, family or month totals
+static void queryTotals(const ExpenseQuery* query, long* count, double* sum){
+    bool all_categories = query->category_low == 0 && query->category_high == MAX_CATEGORIES - 1;
+    *count = 0;
+    *sum = 0.0;
+    if (query->user_low == query->user_high) {
+        UserNode* user = searchUser(user_root, query->user_low);
+        if (user) {
+            *count = user->expense_count;
+            *sum = all_categories ? user->total_expense : user->category_expenses[query->category_low];
+        }
+    }
+    else if (query->family_filter) {
+        FamilyNode* family = searchFamily(family_root, query->family_low);
+        for (int i = 0; family && i < family->member_count; i++) {
+            *count += family->members[i]->expense_count;
+        }
+        if (family) {
+            *sum = all_categories ? family->total_expense : family->category_expenses[query->category_low];
+        }
+    }
+    else {
+        for (int i = 0; i < expense_store.count; i++) {
+            const ExpensePartition* part = &expense_store.partitions[i];
+            if (part->month_key >= monthKey(query->date_low) && part->month_key <= monthKey(query->date_high)) {
+                *count += part->expense_count;
+                *sum += all_categories ? part->total_expense : part->category_expenses[query->category_low];
+            }
         }
+    }
+}
 
-        //set user's family
-        user->family = family;
-        done = true;
+//order key first, then (user, id), so every path returns rows in the same order
+static int compareQueryRows(const void* a, const void* b){
+    const QueryRow* ra = (const QueryRow*)a;
+    const QueryRow* rb = (const QueryRow*)b;
+    int ret_val = (ra->sort_key > rb->sort_key) - (ra->sort_key < rb->sort_key);
+    if (ret_val == 0) {
+        ExpenseKey ka = makeExpenseKey(ra->record.user_id, ra->record.expense_id);
+        ExpenseKey kb = makeExpenseKey(rb->record.user_id, rb->record.expense_id);
+        ret_val = (ka > kb) - (ka < kb);
     }
-    return done;
+    return ret_val;
 }
 
-ExpenseNode* addExpense(int user_id, int expense_id, float amount, ExpenseCategory category, Date date) {
-    UserNode* user = searchUser(user_root, user_id);
-    if (!user) {
-        printf("Error: User %d not found\n", user_id);
-        return NULL;
+static double queryColumnValue(const QueryRow* row, QueryColumn column){
+    double ret_val = 0.0;
+    switch (column) {
+        case ColumnUser: ret_val = row->record.user_id; break;
+        case ColumnId: ret_val = row->record.expense_id; break;
+        case ColumnFamily: ret_val = row->family_id; break;
+        case ColumnAmount: ret_val = row->record.amount; break;
+        case ColumnCategory: ret_val = row->record.category; break;
+        case ColumnDate: ret_val = row->record.date; break;
     }
+    return ret_val;
+}
 
-    // Check if this user already has an expense with this ID
-    if (searchExpenseForUser(user, expense_id)) {
-        printf("Error: User %d already has expense with ID %d\n", user_id, expense_id);
-        return NULL;
+static void printQueryRow(const ExpenseQuery* query, const QueryRow* row){
+    for (int i = 0; i < query->column_count; i++) {
+        const ExpenseRecord* record = &row->record;
+        switch (query->columns[i]) {
+            case ColumnUser: printf("%-8d ", record->user_id); break;
+            case ColumnId: printf("%-8d ", record->expense_id); break;
+            case ColumnFamily:
+                if (row->family_id == GROUP_NONE) {
+                    printf("%-8s ", "-");
+                }
+                else {
+                    printf("%-8d ", row->family_id);
+                }
+                break;
+            case ColumnAmount: printf("%10.2f ", record->amount); break;
+            case ColumnCategory: printf("%-10s ", category_names[record->category]); break;
+            case ColumnDate:
+                printf("%02d/%02d/%04d ", DATE_DAY(record->date), DATE_MONTH(record->date), DATE_YEAR(record->date));
+                break;
+        }
     }
+    printf("\n");
+}
 
-    ExpenseNode* new_expense = (ExpenseNode*)malloc(sizeof(ExpenseNode));
-    if (!new_expense) {
-        perror("Error allocating memory for expense");
-        return NULL;
+// Parse, plan and run one query. Rows are gathered through the chosen path,
+// filtered on every predicate, ordered and cut to the limit.
+bool runQuery(const char* text){
+    ExpenseQuery query;
+    if (!parseQuery(text, &query)) {
+        return false;
+    }
+    long cost;
+    QueryPath path = planQuery(&query, &cost);
+    if (query.explain) {
+        printf("Plan: %s (cost %ld)\n", query_path_names[path], cost);
+        for (int i = 0; i < QUERY_PATH_COUNT; i++) {
+            long path_cost = estimateQueryPath(&query, (QueryPath)i);
+            if (path_cost >= 0) {
+                printf("  %-20s %ld\n", query_path_names[i], path_cost);
+            }
+        }
     }
 
-    new_expense->expense_id = expense_id;
-    new_expense->user_id = user_id;
-    new_expense->amount = amount;
-    new_expense->category = category;
-    new_expense->date = date;
-    new_expense->next = NULL;
+    long count = 0;
+    double sum = 0.0;
+    QueryResult result = {NULL, 0, 0, query.family_filter || (query.ordered && query.order_column == ColumnFamily), false};
+    for (int i = 0; i < query.column_count; i++) {
+        result.needs_family = result.needs_family || query.columns[i] == ColumnFamily;
+    }
 
-    // Add to user's expense list
-    if(!user->expenses_head){
-        user->expenses_head = new_expense;
+    if (path == PathTotals) {
+        queryTotals(&query, &count, &sum);
     }
-    else{
-        ExpenseNode* current = user->expenses_head;
-        while (current->next) {
-            current = current->next;
+    else {
+        if (path == PathUserList) {
+            queryUserExpenses(&result, &query, query.user_low);
+        }
+        else if (path == PathFamilyMembers) {
+            FamilyNode* family = searchFamily(family_root, query.family_low);
+            for (int i = 0; family && i < family->member_count; i++) {
+                queryUserExpenses(&result, &query, family->members[i]->user_id);
+            }
+        }
+        else {
+            queryMonthPartitions(&result, &query);
         }
-        current->next = new_expense;
+        if (result.failed) {
+            printf("Failed to allocate memory for query\n");
+            free(result.rows);
+            return false;
+        }
+        for (int i = 0; i < result.count; i++) {
+            count++;
+            sum += result.rows[i].record.amount;
+            if (query.ordered) {
+                double value = queryColumnValue(&result.rows[i], query.order_column);
+                result.rows[i].sort_key = query.descending ? -value : value;
+            }
+        }
+        qsort(result.rows, result.count, sizeof(QueryRow), compareQueryRows);
     }
 
-    // Update user totals
-    user->expense_count++;
-    user->total_expense += amount;
-    user->category_expenses[category] += amount;
-
-    // Update family totals if user is in a family
-    if (user->family) {
-        user->family->total_expense += amount;
-        user->family->category_expenses[category] += amount;
+    if (query.column_count == 0) {
+        if (query.count) {
+            printf("count: %ld\n", count);
+        }
+        if (query.sum) {
+            printf("sum: %.2f\n", sum);
+        }
     }
+    else {
+        int shown = (query.limit >= 0 && query.limit < result.count) ? query.limit : result.count;
+        for (int i = 0; i < query.column_count; i++) {
+            printf(query.columns[i] == ColumnAmount ? "%10s " : query.columns[i] == ColumnDate ? "%-10s " :
+                   query.columns[i] == ColumnCategory ? "%-10s " : "%-8s ", query_column_names[query.columns[i]]);
+        }
+        printf("\n");
+        for (int i = 0; i < shown; i++) {
+            printQueryRow(&query, &result.rows[i]);
+        }
+        printf("%d rows\n", shown);
+    }
+    free(result.rows);
+    return true;
+}
 
-    // Insert into expense B-tree
-    insertExpense(&expense_root, new_expense);
-    
-    return new_expense;
+//days since 1 Jan 1970 of a packed date, by civil calendar arithmetic
+static long daysFromDateKey(DateKey date){
+    long year = DATE_YEAR(date) - (DATE_MONTH(date) <= 2);
+    long month = DATE_MONTH(date);
+    long era = year / 400;
+    long year_of_era = year - era * 400;
+    long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + DATE_DAY(date) - 1;
+    long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
 }
 
-void getTotalExpense(int family_id){
-    FamilyNode* family = searchFamily(family_root, family_id);
-    if(!family) {
-        printf("Family not found\n");
-        return;
+static DateKey dateKeyFromDays(long days){
+    days += 719468;
+    long era = days / 146097;
+    long day_of_era = days - era * 146097;
+    long year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    long day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    long shifted_month = (5 * day_of_year + 2) / 153;
+    long day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+    long month = (shifted_month < 10) ? shifted_month + 3 : shifted_month - 9;
+    long year = year_of_era + era * 400 + (month <= 2);
+    return (DateKey)(year * 10000 + month * 100 + day);
+}
+
+//value of one grouping field for an expense; weekday counts from Monday = 0
+//and a week is keyed by the date of its Monday
+static int groupValue(GroupField field, int user_id, int family_id, ExpenseCategory category, DateKey date){
+    int ret_val = 0;
+    long days;
+    switch (field) {
+        case GroupByUser: ret_val = user_id; break;
+        case GroupByFamily: ret_val = family_id; break;
+        case GroupByCategory: ret_val = category; break;
+        case GroupByDay: ret_val = (int)date; break;
+        case GroupByWeekday: ret_val = (int)(((daysFromDateKey(date) + 3) % 7 + 7) % 7); break;
+        case GroupByWeek:
+            days = daysFromDateKey(date);
+            ret_val = (int)dateKeyFromDays(days - ((days + 3) % 7 + 7) % 7);
+            break;
+        case GroupByMonth: ret_val = monthKey(date); break;
+        case GroupByYear: ret_val = DATE_YEAR(date); break;
     }
+    return ret_val;
+}
 
-    printf("Family: %s (ID: %d)\n", family->family_name, family->family_id);
-    printf("Total Income: %.2f\n", family->total_income);
-    printf("Total Expenses: %.2f\n", family->total_expense);
+static unsigned int hashGroupValues(const int* values, int count){
+    unsigned int hash = 0;
+    for (int i = 0; i < count; i++) {
+        hash = mixHashKey((unsigned int)values[i], hash);
+    }
+    return hash;
+}
 
-    float balance = family->total_income - family->total_expense;
-    if(balance < 0){
-        printf("Warning: Expenses exceed income by %.2f\n", -balance);
+static bool growGroupTable(GroupTable* table){
+    int new_capacity = (table->capacity == 0) ? 64 : table->capacity * 2;
+    int* slots = (int*)malloc(new_capacity * sizeof(int));
+    GroupEntry* entries = (GroupEntry*)realloc(table->entries, (size_t)new_capacity * 7 / 10 * sizeof(GroupEntry));
+    if (!slots || !entries) {
+        free(slots);
+        if (entries) {
+            table->entries = entries;
+        }
+        table->failed = true;
+        return false;
     }
-    else{
-        printf("Remaining balance: %.2f\n", balance);
+    table->entries = entries;
+    memset(slots, -1, new_capacity * sizeof(int));
+    for (int i = 0; i < table->count; i++) {
+        int pos = hashGroupValues(entries[i].values, GROUP_FIELD_COUNT) & (new_capacity - 1);
+        while (slots[pos] >= 0) {
+            pos = (pos + 1) & (new_capacity - 1);
+        }
+        slots[pos] = i;
     }
+    free(table->slots);
+    table->slots = slots;
+    table->capacity = new_capacity;
+    return true;
 }
 
-void getCategoricalExpense(int family_id, ExpenseCategory category){
-    FamilyNode* family = searchFamily(family_root, family_id);
-    if (!family) {
-        printf("Family not found\n");
-        return;
+//group with the given values, created empty if new; NULL if memory ran out
+static GroupEntry* findGroup(GroupTable* table, const int* values){
+    if ((table->count + 1) * 10 > table->capacity * 7 && !growGroupTable(table)) {
+        return NULL;
     }
+    int pos = hashGroupValues(values, GROUP_FIELD_COUNT) & (table->capacity - 1);
+    while (table->slots[pos] >= 0) {
+        GroupEntry* entry = &table->entries[table->slots[pos]];
+        if (memcmp(entry->values, values, sizeof(entry->values)) == 0) {
+            return entry;
+        }
+        pos = (pos + 1) & (table->capacity - 1);
+    }
+    GroupEntry* entry = &table->entries[table->count];
+    memcpy(entry->values, values, sizeof(entry->values));
+    entry->count = 0;
+    entry->sum = 0.0;
+    entry->min = 0.0f;
+    entry->max = 0.0f;
+    table->slots[pos] = table->count++;
+    return entry;
+}
 
-    printf("Category: %s\n", category_names[category]);
-    printf("Total family expense: %.2f\n", family->category_expenses[category]);
-
-    // Collect individual contributions
-    typedef struct {
-        UserNode* user;
-        float amount;
-    } Contribution;
-
-    Contribution contributions[MAX_FAMILY_MEMBERS];
-    int count = 0;
+//fold one expense into its group if it passes the query's filters
+static void groupExpense(GroupTable* table, const GroupQuery* query, int user_id, const UserNode* user,
+                         ExpenseCategory category, float amount, DateKey date){
+    if (!dateInRange(date, query->start, query->end) || (query->category >= 0 && (int)category != query->category)) {
+        return;
+    }
+    int family_id = GROUP_NONE;
+    for (int i = 0; i < query->field_count; i++) {
+        if (query->fields[i] == GroupByFamily) {
+            //records of users deleted since they were archived have no family
+            if (!user) {
+                user = searchUser(user_root, user_id);
+            }
+            family_id = (user && user->family) ? user->family->family_id : GROUP_NONE;
+        }
+    }
 
-    for(int i = 0; i < family->member_count; i++){
-        contributions[count].user = family->members[i];
-        contributions[count].amount = family->members[i]->category_expenses[category];
-        count++;
+    int values[GROUP_FIELD_COUNT] = {0};
+    for (int i = 0; i < query->field_count; i++) {
+        values[i] = groupValue(query->fields[i], user_id, family_id, category, date);
+    }
+    GroupEntry* entry = findGroup(table, values);
+    if (entry) {
+        if (entry->count == 0 || amount < entry->min) {
+            entry->min = amount;
+        }
+        if (entry->count == 0 || amount > entry->max) {
+            entry->max = amount;
+        }
+        entry->count++;
+        entry->sum += amount;
     }
+}
 
-    // Sort contributions by amount (descending)
-    for(int i = 0; i < count - 1; i++){
-        for(int j = 0; j < count - i - 1; j++){
-            if(contributions[j].amount < contributions[j + 1].amount){
-                Contribution temp = contributions[j];
-                contributions[j] = contributions[j + 1];
-                contributions[j + 1] = temp;
+static void groupExpenseTree(GroupTable* table, const GroupQuery* query, const BTreeNodeExpense* root){
+    if (root) {
+        for (int i = 0; i < root->num_keys; i++) {
+            if (!root->is_leaf) {
+                groupExpenseTree(table, query, root->children[i]);
+            }
+            const ExpenseNode* expense = root->keys[i];
+            if (!expense->tombstone) {
+                groupExpense(table, query, expense->user_id, expense->user, expense->category, expense->amount, expense->date);
             }
         }
+        if (!root->is_leaf) {
+            groupExpenseTree(table, query, root->children[root->num_keys]);
+        }
     }
+}
 
-    // Print sorted contributions
-    printf("Individual contributions:\n");
-    for (int i = 0; i < count; i++){
-        printf("%s (ID: %d): %.2f\n",
-               contributions[i].user->user_name,
-               contributions[i].user->user_id,
-               contributions[i].amount);
+static void runGroupTreeTask(ReportTask* task, FILE* out){
+    (void)out;
+    const GroupQuery* query = (const GroupQuery*)task->params;
+    groupExpenseTree((GroupTable*)task->partial, query, (const BTreeNodeExpense*)task->source);
+    const ExpenseNode* expense = task->separator;
+    if (expense && !expense->tombstone) {
+        groupExpense((GroupTable*)task->partial, query, expense->user_id, expense->user,
+                     expense->category, expense->amount, expense->date);
     }
 }
 
-void getHighestExpenseDay(int family_id){
-    FamilyNode* family = searchFamily(family_root, family_id);
-    if(!family){
-        printf("Family not found\n");
+static void runGroupCompressedTask(ReportTask* task, FILE* out){
+    (void)out;
+    const CompressedMonth* month = (const CompressedMonth*)task->source;
+    ExpenseRecord block[COMPRESSED_BLOCK_RECORDS];
+    for (int b = 0; b < month->block_count; b++) {
+        int n = decodeBlock(month, b, task->key, block);
+        for (int i = 0; i < n; i++) {
+            groupExpense((GroupTable*)task->partial, (const GroupQuery*)task->params, block[i].user_id, NULL,
+                         block[i].category, block[i].amount, block[i].date);
+        }
     }
-    else{
-        Date max_date = {0};
-        float max_amount = 0.0f;
+}
 
-        for(int i = 0; i < family->member_count; i++){
-            UserNode* user = family->members[i];
-            ExpenseNode* expense = user->expenses_head;
-            while(expense){
-                if(expense->amount > max_amount){
-                    max_amount = expense->amount;
-                    max_date = expense->date;
-                }
-                expense = expense->next;
+static void groupPagedSubtree(GroupTable* table, const GroupQuery* query, unsigned int page_id){
+    ExpensePage* page = pinPage(&paged_store, page_id);
+    if (page) {
+        for (int i = 0; i <= page->num_keys; i++) {
+            if (!page->is_leaf) {
+                groupPagedSubtree(table, query, page->children[i]);
+            }
+            if (i < page->num_keys) {
+                const ExpenseRecord* record = &page->records[i];
+                groupExpense(table, query, record->user_id, NULL, record->category, record->amount, record->date);
             }
         }
+        unpinPage(&paged_store, page, false);
+    }
+}
+
+//the tiers that are read through shared state: ingest buffer, archive file and page file
+static void groupColdExpenses(GroupTable* table, const GroupQuery* query){
+    for (int i = 0; i < lsm.memtable_count; i++) {
+        const ExpenseNode* expense = lsm.memtable[i];
+        groupExpense(table, query, expense->user_id, expense->user, expense->category, expense->amount, expense->date);
+    }
+    for (int r = 0; r < lsm.run_count; r++) {
+        for (int i = 0; i < lsm.runs[r].count; i++) {
+            const ExpenseNode* expense = lsm.runs[r].expenses[i];
+            groupExpense(table, query, expense->user_id, expense->user, expense->category, expense->amount, expense->date);
+        }
+    }
 
-        if(max_amount > 0){
-            printf("Highest expense day: %d/%d/%d (Amount: %.2f)\n",
-                max_date.day, max_date.month, max_date.year, max_amount);
+    DateKey dates[ARCHIVE_SCAN_ROWS];
+    ExpenseRecord rows[ARCHIVE_SCAN_ROWS];
+    bool ok = archive.file && monthKey(query->start) < archive.header.cutoff_month;
+    for (int first = 0; ok && first < archive.header.record_count; first += ARCHIVE_SCAN_ROWS) {
+        int n = archive.header.record_count - first;
+        n = (n < ARCHIVE_SCAN_ROWS) ? n : ARCHIVE_SCAN_ROWS;
+        ok = readArchiveColumn(4, first, n, dates, sizeof(DateKey));
+        bool any = false;
+        for (int i = 0; ok && i < n && !any; i++) {
+            any = dateInRange(dates[i], query->start, query->end);
         }
-        else{
-            printf("No expenses found for this family\n");
+        if (any && (ok = readArchiveRows(first, n, rows))) {
+            for (int i = 0; i < n; i++) {
+                groupExpense(table, query, rows[i].user_id, NULL, rows[i].category, rows[i].amount, rows[i].date);
+            }
         }
     }
-    
+
+    if (paged_store.file && paged_store.root_page != 0) {
+        groupPagedSubtree(table, query, paged_store.root_page);
+    }
 }
 
-void getIndividualExpense(int user_id){
-    UserNode* user = searchUser(user_root, user_id);
-    if(!user){
-        printf("User not found\n");
+static void mergeGroupTable(GroupTable* into, const GroupTable* from){
+    into->failed = into->failed || from->failed;
+    for (int i = 0; i < from->count; i++) {
+        const GroupEntry* part = &from->entries[i];
+        GroupEntry* entry = findGroup(into, part->values);
+        if (entry) {
+            if (entry->count == 0 || part->min < entry->min) {
+                entry->min = part->min;
+            }
+            if (entry->count == 0 || part->max > entry->max) {
+                entry->max = part->max;
+            }
+            entry->count += part->count;
+            entry->sum += part->sum;
+        }
+    }
+}
+
+void freeGroupTable(GroupTable* table){
+    free(table->entries);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+static int compareGroupEntries(const void* a, const void* b){
+    const GroupEntry* ga = (const GroupEntry*)a;
+    const GroupEntry* gb = (const GroupEntry*)b;
+    int ret_val = 0;
+    for (int i = 0; i < GROUP_FIELD_COUNT && ret_val == 0; i++) {
+        ret_val = (ga->values[i] > gb->values[i]) - (ga->values[i] < gb->values[i]);
+    }
+    return ret_val;
+}
+
+static void printGroupValue(GroupField field, int value){
+    static const char* weekdays[7] = {"Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday", "Sunday"};
+    char text[16];
+    switch (field) {
+        case GroupByFamily:
+            if (value == GROUP_NONE) {
+                snprintf(text, sizeof(text), "-");
+            }
+            else {
+                snprintf(text, sizeof(text), "%d", value);
+            }
+            break;
+        case GroupByCategory: snprintf(text, sizeof(text), "%s", category_names[value]); break;
+        case GroupByDay:
+        case GroupByWeek:
+            snprintf(text, sizeof(text), "%02d/%02d/%04d", DATE_DAY(value), DATE_MONTH(value), DATE_YEAR(value));
+            break;
+        case GroupByWeekday: snprintf(text, sizeof(text), "%s", weekdays[value]); break;
+        case GroupByMonth: snprintf(text, sizeof(text), "%02d/%04d", value % 100, value / 100); break;
+        default: snprintf(text, sizeof(text), "%d", value); break;
+    }
+    printf("%-12s ", text);
+}
+
+// Aggregate expenses by any combination of fields with count, sum, min, max
+// and average per group. Month trees and compressed months inside the window
+// are aggregated into per-task hash tables, on the report pool when asked,
+// and merged in task order; the other tiers are folded in afterwards.
+void groupExpenses(const GroupQuery* query){
+    if (query->field_count < 1 || query->field_count > GROUP_FIELD_COUNT || query->start > query->end) {
+        printf("Invalid group-by query\n");
         return;
     }
-    
-    printf("User: %s (ID: %d)\n", user->user_name, user->user_id);
-    printf("Total expenses: %.2f\n", user->total_expense);
 
-    printf("Expenses by category:\n");
-    for (int i = 0; i < MAX_CATEGORIES; i++) {
-        if (user->category_expenses[i] > 0) {
-            printf("%s: %.2f\n", category_names[i], user->category_expenses[i]);
+    ReportTaskList list = {NULL, 0, 0};
+    GroupTable result = {NULL, NULL, 0, 0, false};
+    GroupTable* partials = NULL;
+    bool done = addExpenseScanTasks(&list, query->start, query->end,
+                                    runGroupTreeTask, runGroupCompressedTask, query);
+    if (done && list.count > 0) {
+        partials = (GroupTable*)calloc(list.count, sizeof(GroupTable));
+        done = partials != NULL;
+    }
+    if (done) {
+        for (int i = 0; i < list.count; i++) {
+            list.tasks[i].partial = &partials[i];
         }
+        if (query->parallel) {
+            runReportTasks(list.tasks, list.count);
+        }
+        //tasks print nothing; the ones the pool did not run are run here
+        for (int i = 0; i < list.count; i++) {
+            if (!list.tasks[i].buffered) {
+                list.tasks[i].run(&list.tasks[i], NULL);
+            }
+            free(list.tasks[i].output);
+            mergeGroupTable(&result, &partials[i]);
+            freeGroupTable(&partials[i]);
+        }
+        groupColdExpenses(&result, query);
     }
+    free(list.tasks);
+    free(partials);
 
-    //print all expenses sorted by amount
-    printf("All expenses:\n");
-    ExpenseNode* expenses[MAX_EXPENSES_PER_USER];
-    int count = 0;
-    
-    ExpenseNode* current = user->expenses_head;
-    while (current && count < MAX_EXPENSES_PER_USER) {
-        expenses[count++] = current;
-        current = current->next;
+    if (!done || result.failed) {
+        printf("Failed to allocate memory for group-by\n");
     }
-
-    //sort expenses by amount descending
-    for (int i = 0; i < count - 1; i++) {
-        for (int j = 0; j < count - i - 1; j++) {
-            if (expenses[j]->amount < expenses[j + 1]->amount) {
-                ExpenseNode* temp = expenses[j];
-                expenses[j] = expenses[j + 1];
-                expenses[j + 1] = temp;
+    else if (result.count == 0) {
+        printf("Expense Not Found!!\n");
+    }
+    else {
+        qsort(result.entries, result.count, sizeof(GroupEntry), compareGroupEntries);
+        for (int i = 0; i < query->field_count; i++) {
+            printf("%-12s ", group_field_names[query->fields[i]]);
+        }
+        printf("%8s %12s %10s %10s %10s\n", "Count", "Sum", "Min", "Max", "Avg");
+        for (int i = 0; i < result.count; i++) {
+            const GroupEntry* entry = &result.entries[i];
+            for (int f = 0; f < query->field_count; f++) {
+                printGroupValue(query->fields[f], entry->values[f]);
             }
+            printf("%8d %12.2f %10.2f %10.2f %10.2f\n", entry->count, entry->sum,
+                   entry->min, entry->max, entry->sum / entry->count);
         }
+        printf("%d groups\n", result.count);
     }
+    freeGroupTable(&result);
+}
 
-    for (int i = 0; i < count; i++) {
-        printf("ID: %d, Amount: %.2f, Category: %s, Date: %d/%d/%d\n",
-               expenses[i]->expense_id,
-               expenses[i]->amount,
-               category_names[expenses[i]->category],
-               expenses[i]->date.day,
-               expenses[i]->date.month,
-               expenses[i]->date.year);
-    }
-}
-
-int dateCompare(Date d1, Date d2){
-    int ret_val;
-    if(d1.year != d2.year){
-        ret_val = d1.year - d2.year;
-    } 
-    else if(d1.month != d2.month){
-        ret_val = d1.month - d2.month;
-    }  
+// Only the months overlapping [start, end] are visited. Their trees are split
+// into subtree tasks on the report pool; the total is summed from what is printed.
+static void writeExpensesInPeriod(FILE* out, DateKey start_key, DateKey end_key) {
+    int count = 0;
+    float total = 0.0f;
+
+    if(start_key <= end_key){
+        //in-memory months are scanned in parallel and merged in month order
+        ReportTaskList list = {NULL, 0, 0};
+        if (addExpenseScanTasks(&list, start_key, end_key, runExpenseScanTask, runCompressedScanTask, NULL)) {
+            runReportTasks(list.tasks, list.count);
+        }
+        double scanned = 0.0;
+        for (int i = 0; i < list.count; i++) {
+            count += list.tasks[i].count;
+            scanned += list.tasks[i].total;
+        }
+        total = (float)scanned;
+        flushReportTasks(out, list.tasks, list.count);
+        free(list.tasks);
+
+        count += lsmPrintInPeriod(out, start_key, end_key, &total);
+        count += printArchivedInPeriod(out, start_key, end_key, &total);
+
+        //months paged out to disk; the page file is keyed by id, so scan it all
+        count += pagedPrintRange(out, &paged_store, 0, ~(ExpenseKey)0, start_key, end_key, &total);
+    }
+
+    if(count == 0){
+        fprintf(out, "Expense Not Found!!\n");
+    }
     else{
-       ret_val = d1.day - d2.day;
-    } 
+        fprintf(out, "%d expenses, total: %.2f\n", count, total);
+    }
+}
 
+//date order, then key order, for expense records
+static int compareRecordsByDate(const void* a, const void* b){
+    const ExpenseRecord* ra = (const ExpenseRecord*)a;
+    const ExpenseRecord* rb = (const ExpenseRecord*)b;
+    int ret_val = (ra->date > rb->date) - (ra->date < rb->date);
+    if (ret_val == 0) {
+        ret_val = compareRecordKeys(a, b);
+    }
     return ret_val;
 }
 
-void getExpensesInPeriod(BTreeNodeExpense* root, Date start, Date end) {
-    if(root == NULL){
-        printf("Expense Not Found!!\n");
-    }
-    else{
-        for(int i = 0; i < root->num_keys; i++){
-            if(!root->is_leaf){
-                getExpensesInPeriod(root->children[i], start, end);
+//append the history entries of every user visible at as_of and dated within [start, end]
+static bool collectUserTreeVersions(BTreeNodeUser* root, long as_of, DateKey start, DateKey end,
+                                    ExpenseRecord** records, int* count, int* capacity){
+    bool ok = true;
+    if (root) {
+        for (int i = 0; i <= root->num_keys && ok; i++) {
+            if (!root->is_leaf) {
+                ok = collectUserTreeVersions(root->children[i], as_of, start, end, records, count, capacity);
             }
-    
-            ExpenseNode* expense = root->keys[i];
-            if(expense != NULL){
-                int cmp_start = dateCompare(expense->date, start);
-                int cmp_end = dateCompare(expense->date, end);
-                
-                if(cmp_start >= 0 && cmp_end <= 0){
-                    printExpense(expense);
+            if (i < root->num_keys) {
+                UserNode* user = root->keys[i];
+                for (ExpenseVersion* version = user->details->history; version && ok; version = version->next) {
+                    if (version->valid_from <= as_of && as_of < version->valid_to &&
+                        dateInRange(version->date, start, end)) {
+                        ExpenseRecord record = {user->user_id, version->expense_id, version->amount,
+                                                version->category, version->date};
+                        ok = appendRecord(records, count, capacity, &record);
+                    }
                 }
             }
         }
-    
-        if(!root->is_leaf){
-            getExpensesInPeriod(root->children[root->num_keys], start, end);
+    }
+    return ok;
+}
+
+// Expenses dated within [start, end] as they stood at version as_of, in date
+// order from the histories, followed by the archive and the page file, which
+// have not changed since the history horizon
+static void writeExpensesInPeriodAsOf(FILE* out, DateKey start_key, DateKey end_key, long as_of) {
+    ExpenseRecord* records = NULL;
+    int count = 0;
+    int capacity = 0;
+    float total = 0.0f;
+
+    fprintf(out, "As of version %ld\n", as_of);
+    if (start_key <= end_key) {
+        collectUserTreeVersions(user_root, as_of, start_key, end_key, &records, &count, &capacity);
+        if (count > 0) {
+            qsort(records, count, sizeof(ExpenseRecord), compareRecordsByDate);
+        }
+        for (int i = 0; i < count; i++) {
+            fprintExpenseRecord(out, &records[i]);
+            total += records[i].amount;
         }
+        count += printArchivedInPeriod(out, start_key, end_key, &total);
+        count += pagedPrintRange(out, &paged_store, 0, ~(ExpenseKey)0, start_key, end_key, &total);
+    }
+    free(records);
+
+    if (count == 0) {
+        fprintf(out, "Expense Not Found!!\n");
+    }
+    else {
+        fprintf(out, "%d expenses, total: %.2f\n", count, total);
     }
 }
 
-void getExpensesInRange(int user_id, int start_id, int end_id) {
-    UserNode* user = searchUser(user_root, user_id);
+// Any change to any user or expense is newer than the cached copy, so it is
+// served only while nothing at all has changed. Past versions are not cached.
+void getExpensesInPeriod(Date start, Date end, long as_of) {
+    DateKey start_key = packDate(start);
+    DateKey end_key = packDate(end);
+    if (!isCurrentVersion(as_of)) {
+        writeExpensesInPeriodAsOf(stdout, start_key, end_key, as_of);
+    }
+    else if (!printCachedReport(ReportPeriod, start_key, end_key, global_generation)) {
+        ReportCapture capture;
+        writeExpensesInPeriod(beginReportCapture(&capture), start_key, end_key);
+        endReportCapture(&capture, ReportPeriod, start_key, end_key, true);
+    }
+}
+
+// A user's expenses with ids in [start_id, end_id] as they stood at version
+// as_of, from the history, followed by the archived and paged ones
+static void printExpensesInRangeAsOf(UserNode* user, int start_id, int end_id, long as_of){
+    ExpenseRecord* records = NULL;
+    int count = 0;
+    int capacity = 0;
+    bool ok = true;
+    for (ExpenseVersion* version = user->details->history; version && ok; version = version->next) {
+        if (version->valid_from <= as_of && as_of < version->valid_to &&
+            version->expense_id >= start_id && version->expense_id <= end_id) {
+            ExpenseRecord record = {user->user_id, version->expense_id, version->amount,
+                                    version->category, version->date};
+            ok = appendRecord(&records, &count, &capacity, &record);
+        }
+    }
+    if (count > 0) {
+        qsort(records, count, sizeof(ExpenseRecord), compareRecordKeys);
+    }
+
+    ExpenseRecord* folded;
+    int folded_count = collectFoldedExpenses(user->user_id, start_id, end_id, &folded);
+    printf("As of version %ld\n", as_of);
+    for (int i = 0; i < count + folded_count; i++) {
+        const ExpenseRecord* record = (i < count) ? &records[i] : &folded[i - count];
+        if (i == count) {
+            printf("Archived and paged:\n");
+        }
+        printf("ID: %d, Amount: %.2f, Category: %s, Date: %d/%d/%d\n",
+               record->expense_id,
+               record->amount,
+               category_names[record->category],
+               DATE_DAY(record->date),
+               DATE_MONTH(record->date),
+               DATE_YEAR(record->date));
+    }
+    free(records);
+    free(folded);
+}
+
+void getExpensesInRange(int user_id, int start_id, int end_id, long as_of) {
+    lsmCompact();
+    UserNode* user = findUser(user_id);
     if(!user){
         printf("User not found\n");
     }
+    else if(!isCurrentVersion(as_of)){
+        printf("Expenses for user %s (ID: %d) between expense IDs %d and %d:\n",
+           user->details->user_name, user->user_id, start_id, end_id);
+        printExpensesInRangeAsOf(user, start_id, end_id, as_of);
+    }
     else{
         printf("Expenses for user %s (ID: %d) between expense IDs %d and %d:\n",
-           user->user_name, user->user_id, start_id, end_id);
+           user->details->user_name, user->user_id, start_id, end_id);
 
         ExpenseNode* current = user->expenses_head;
         while (current) {
@@ -955,48 +6540,27 @@ void getExpensesInRange(int user_id, int start_id, int end_id) {
                     current->expense_id,
                     current->amount,
                     category_names[current->category],
-                    current->date.day,
-                    current->date.month,
-                    current->date.year);
+                    DATE_DAY(current->date),
+                    DATE_MONTH(current->date),
+                    DATE_YEAR(current->date));
             }
             current = current->next;
         }
+
+        printColdUserExpenses(stdout, user_id, start_id, end_id);
     }
     
 }
 
 int find_key_index_individual(BTreeNodeUser* node, int user_id) {
-    int idx = 0;
-    while (idx < node->num_keys && node->keys[idx]->user_id < user_id) {
-        idx++;
-    }
-    return idx;
+    return nodeLowerBound(node->key_ids, node->num_keys, user_id);
 }
 
-void removeFromLeafIndividual(BTreeNodeUser* node, int idx) {
-    //update any related data
-    UserNode* user = node->keys[idx];
-    if (user->family) {
-        // Remove user from family if needed
-        bool found = false;
-        for(int i = 0; i < user->family->member_count && !found; i++){
-            if (user->family->members[i] == user) {
-                // Shift remaining members
-                for(int j = i; j < user->family->member_count-1; j++){
-                    user->family->members[j] = user->family->members[j+1];
-                }
-                user->family->member_count--;
-                user->family->total_income -= user->income;
-                found = true;
-            }
-        }
-    }
-    
-    free(node->keys[idx]);
-    
-    // Shift keys
+void removeFromLeafIndividual(BTreeNodeUser* node, int idx) {
+    // Shift keys; the user itself is unlinked and freed by removeUser
     for(int i = idx+1; i < node->num_keys; i++){
         node->keys[i-1] = node->keys[i];
+        node->key_ids[i-1] = node->key_ids[i];
     }
     node->num_keys--;
 }
@@ -1035,6 +6599,7 @@ void borrowFromLeftIndividual(BTreeNodeUser* parent, int idx){
     // Shift child's keys right
     for(int i = child->num_keys-1; i >= 0; i--){
         child->keys[i+1] = child->keys[i];
+        child->key_ids[i+1] = child->key_ids[i];
     }
     if(!child->is_leaf){
         for (int i = child->num_keys; i >= 0; i--)
@@ -1043,11 +6608,13 @@ void borrowFromLeftIndividual(BTreeNodeUser* parent, int idx){
 
     // Move key from parent to child
     child->keys[0] = parent->keys[idx-1];
+    child->key_ids[0] = parent->key_ids[idx-1];
     if(!child->is_leaf)
         child->children[0] = sibling->children[sibling->num_keys];
 
     // Move key from sibling to parent
     parent->keys[idx-1] = sibling->keys[sibling->num_keys-1];
+    parent->key_ids[idx-1] = sibling->key_ids[sibling->num_keys-1];
 
     child->num_keys++;
     sibling->num_keys--;
@@ -1059,15 +6626,18 @@ void borrowFromRightIndividual(BTreeNodeUser* parent, int idx){
 
     // Move key from parent to child
     child->keys[child->num_keys] = parent->keys[idx];
+    child->key_ids[child->num_keys] = parent->key_ids[idx];
     if(!child->is_leaf)
         child->children[child->num_keys+1] = sibling->children[0];
 
     // Move key from sibling to parent
     parent->keys[idx] = sibling->keys[0];
+    parent->key_ids[idx] = sibling->key_ids[0];
 
     // Shift sibling's keys left
     for(int i = 1; i < sibling->num_keys; i++){
         sibling->keys[i-1] = sibling->keys[i];
+        sibling->key_ids[i-1] = sibling->key_ids[i];
     }
     if(!sibling->is_leaf){
         for(int i = 1; i <= sibling->num_keys; i++)
@@ -1084,10 +6654,12 @@ void mergeIndividualNodes(BTreeNodeUser* node, int idx){
 
     // Move key from parent to child
     child->keys[M/2-1] = node->keys[idx];
+    child->key_ids[M/2-1] = node->key_ids[idx];
 
     // Copy keys from sibling to child
     for(int i = 0; i < sibling->num_keys; i++){
         child->keys[i+M/2] = sibling->keys[i];
+        child->key_ids[i+M/2] = sibling->key_ids[i];
     }
     if(!child->is_leaf){
         for(int i = 0; i <= sibling->num_keys; i++)
@@ -1097,6 +6669,7 @@ void mergeIndividualNodes(BTreeNodeUser* node, int idx){
     // Shift parent's keys and children
     for(int i = idx+1; i < node->num_keys; i++){
         node->keys[i-1] = node->keys[i];
+        node->key_ids[i-1] = node->key_ids[i];
     }
     for(int i = idx+2; i <= node->num_keys; i++)
         node->children[i-1] = node->children[i];
@@ -1110,7 +6683,7 @@ void mergeIndividualNodes(BTreeNodeUser* node, int idx){
 void deleteFromIndividualSubtree(BTreeNodeUser* node, int user_id){
     int idx = find_key_index_individual(node, user_id);
 
-    if (idx < node->num_keys && node->keys[idx]->user_id == user_id) {
+    if (idx < node->num_keys && node->key_ids[idx] == user_id) {
         if (node->is_leaf) {
             removeFromLeafIndividual(node, idx);
         }
@@ -1118,11 +6691,13 @@ void deleteFromIndividualSubtree(BTreeNodeUser* node, int user_id){
             if (node->children[idx]->num_keys >= M/2) {
                 UserNode* pred = getIndividualPredecessor(node, idx);
                 node->keys[idx] = pred;
+                node->key_ids[idx] = pred->user_id;
                 deleteFromIndividualSubtree(node->children[idx], pred->user_id);
             }
             else if(node->children[idx+1]->num_keys >= M/2){
                 UserNode* succ = getIndividualSuccessor(node, idx);
                 node->keys[idx] = succ;
+                node->key_ids[idx] = succ->user_id;
                 deleteFromIndividualSubtree(node->children[idx+1], succ->user_id);
             }
             else{
@@ -1149,11 +6724,18 @@ void deleteFromIndividualSubtree(BTreeNodeUser* node, int user_id){
 }
 
 bool deleteIndividual(BTreeNodeUser** root, int user_id){
+    invalidateFrozenIndex();
+
     if(*root == NULL){
         printf("User with ID %d not found!\n", user_id);
         return false;
     }
 
+    UserNode* user = searchUser(*root, user_id);
+    if (user) {
+        nameIndexRemove(&user_name_index, user->details->user_name, user_id);
+    }
+
     deleteFromIndividualSubtree(*root, user_id);
 
     if((*root)->num_keys == 0){
@@ -1169,25 +6751,14 @@ bool deleteIndividual(BTreeNodeUser** root, int user_id){
 }
 
 int find_key_index_family(BTreeNodeFamily* node, int key) {
-    int idx = 0;
-    while (idx < node->num_keys && node->keys[idx]->family_id < key) {
-        idx++;
-    }
-    return idx;
+    return nodeLowerBound(node->key_ids, node->num_keys, key);
 }
 
 void removeFromLeafFamily(BTreeNodeFamily* node, int idx) {
-    // First remove all members from this family
-    for (int i = 0; i < node->keys[idx]->member_count; i++) {
-        if (node->keys[idx]->members[i]) {
-            node->keys[idx]->members[i]->family = NULL;
-        }
-    }
-    free(node->keys[idx]); // Free family memory
-    
-    // Shift keys and values
+    // Shift keys and values; the family itself is freed by removeFamily
     for (int i = idx+1; i < node->num_keys; i++) {
         node->keys[i-1] = node->keys[i];
+        node->key_ids[i-1] = node->key_ids[i];
     }
     node->num_keys--;
 }
@@ -1226,6 +6797,7 @@ void borrowFromLeftFamily(BTreeNodeFamily* parent, int idx) {
     // Shift child's keys and children right
     for (int i = child->num_keys-1; i >= 0; i--) {
         child->keys[i+1] = child->keys[i];
+        child->key_ids[i+1] = child->key_ids[i];
     }
     if (!child->is_leaf) {
         for (int i = child->num_keys; i >= 0; i--)
@@ -1234,11 +6806,13 @@ void borrowFromLeftFamily(BTreeNodeFamily* parent, int idx) {
 
     // Move key from parent to child
     child->keys[0] = parent->keys[idx-1];
+    child->key_ids[0] = parent->key_ids[idx-1];
     if (!child->is_leaf)
         child->children[0] = sibling->children[sibling->num_keys];
 
     // Move key from sibling to parent
     parent->keys[idx-1] = sibling->keys[sibling->num_keys-1];
+    parent->key_ids[idx-1] = sibling->key_ids[sibling->num_keys-1];
 
     child->num_keys++;
     sibling->num_keys--;
@@ -1250,15 +6824,18 @@ void borrowFromRightFamily(BTreeNodeFamily* parent, int idx) {
 
     // Move key from parent to child
     child->keys[child->num_keys] = parent->keys[idx];
+    child->key_ids[child->num_keys] = parent->key_ids[idx];
     if (!child->is_leaf)
         child->children[child->num_keys+1] = sibling->children[0];
 
     // Move key from sibling to parent
     parent->keys[idx] = sibling->keys[0];
+    parent->key_ids[idx] = sibling->key_ids[0];
 
     // Shift sibling's keys and children left
     for (int i = 1; i < sibling->num_keys; i++) {
         sibling->keys[i-1] = sibling->keys[i];
+        sibling->key_ids[i-1] = sibling->key_ids[i];
     }
     if (!sibling->is_leaf) {
         for (int i = 1; i <= sibling->num_keys; i++)
@@ -1275,10 +6852,12 @@ void mergeFamilyNodes(BTreeNodeFamily* node, int idx) {
 
     // Move key from parent to child
     child->keys[M/2-1] = node->keys[idx];
+    child->key_ids[M/2-1] = node->key_ids[idx];
 
     // Copy keys and children from sibling to child
     for (int i = 0; i < sibling->num_keys; i++) {
         child->keys[i+M/2] = sibling->keys[i];
+        child->key_ids[i+M/2] = sibling->key_ids[i];
     }
     if (!child->is_leaf) {
         for (int i = 0; i <= sibling->num_keys; i++)
@@ -1288,6 +6867,7 @@ void mergeFamilyNodes(BTreeNodeFamily* node, int idx) {
     // Shift parent's keys and children
     for (int i = idx+1; i < node->num_keys; i++) {
         node->keys[i-1] = node->keys[i];
+        node->key_ids[i-1] = node->key_ids[i];
     }
     for (int i = idx+2; i <= node->num_keys; i++)
         node->children[i-1] = node->children[i];
@@ -1301,17 +6881,19 @@ void mergeFamilyNodes(BTreeNodeFamily* node, int idx) {
 void deleteFromFamilySubtree(BTreeNodeFamily* node, int family_id) {
     int idx = find_key_index_family(node, family_id);
 
-    if (idx < node->num_keys && node->keys[idx]->family_id == family_id) {
+    if (idx < node->num_keys && node->key_ids[idx] == family_id) {
         if (node->is_leaf) {
             removeFromLeafFamily(node, idx);
         } else {
             if (node->children[idx]->num_keys >= M/2) {
                 FamilyNode* pred = getFamilyPredecessor(node, idx);
                 node->keys[idx] = pred;
+                node->key_ids[idx] = pred->family_id;
                 deleteFromFamilySubtree(node->children[idx], pred->family_id);
             } else if (node->children[idx+1]->num_keys >= M/2) {
                 FamilyNode* succ = getFamilySuccessor(node, idx);
                 node->keys[idx] = succ;
+                node->key_ids[idx] = succ->family_id;
                 deleteFromFamilySubtree(node->children[idx+1], succ->family_id);
             } else {
                 mergeFamilyNodes(node, idx);
@@ -1336,11 +6918,18 @@ void deleteFromFamilySubtree(BTreeNodeFamily* node, int family_id) {
 }
 
 bool deleteFamily(BTreeNodeFamily** root, int family_id) {
+    invalidateFrozenIndex();
+
     if (*root == NULL) {
         printf("Family with ID %d not found!\n", family_id);
         return false;
     }
 
+    FamilyNode* family = searchFamily(*root, family_id);
+    if (family) {
+        nameIndexRemove(&family_name_index, family->family_name, family_id);
+    }
+
     deleteFromFamilySubtree(*root, family_id);
 
     if ((*root)->num_keys == 0) {
@@ -1355,54 +6944,41 @@ bool deleteFamily(BTreeNodeFamily** root, int family_id) {
     return true;
 }
 
-int find_key_index_expense(BTreeNodeExpense* node, int user_id, int expense_id){
-    int idx = 0;
-    while(idx < node->num_keys && 
-          (node->keys[idx]->user_id < user_id || 
-           (node->keys[idx]->user_id == user_id && node->keys[idx]->expense_id < expense_id))){
-        idx++;
-    }
-    return idx;
+int find_key_index_expense(BTreeNodeExpense* node, ExpenseKey key){
+    return nodeLowerBoundExpense(node->key_codes, node->num_keys, key);
 }
 
 void removeFromLeafExpense(BTreeNodeExpense* node, int idx){
-    // First update user and family totals
-    UserNode* user = searchUser(user_root, node->keys[idx]->user_id);
-    if(user){
-        user->total_expense -= node->keys[idx]->amount;
-        user->category_expenses[node->keys[idx]->category] -= node->keys[idx]->amount;
-        
-        if(user->family){
-            user->family->total_expense -= node->keys[idx]->amount;
-            user->family->category_expenses[node->keys[idx]->category] -= node->keys[idx]->amount;
-        }
-        
-        // Remove from user's linked list
-        ExpenseNode* prev = NULL;
-        ExpenseNode* current = user->expenses_head;
-        while (current && current != node->keys[idx]) {
-            prev = current;
-            current = current->next;
-        }
-        
-        if(current){
-            if(prev){
-                prev->next = current->next;
-            }else{
-                user->expenses_head = current->next;
-            }
-        }
-    }
-    
-    free(node->keys[idx]); // Free expense memory
-    
-    // Shift keys
+    // Shift keys; the record itself is detached and freed by removeExpense
     for (int i = idx+1; i < node->num_keys; i++) {
+        node->key_codes[i-1] = node->key_codes[i];
         node->keys[i-1] = node->keys[i];
     }
     node->num_keys--;
 }
 
+// Add amount (negative to subtract) to the user's and family's totals
+void adjustExpenseTotals(UserNode* user, ExpenseCategory category, float amount){
+    bumpUserGeneration(user);
+    user->total_expense += amount;
+    user->category_expenses[category] += amount;
+
+    if(user->family){
+        user->family->total_expense += amount;
+        user->family->category_expenses[category] += amount;
+    }
+}
+
+// Take an expense out of its user's lists and the user/family totals
+void unlinkExpenseFromUser(ExpenseNode* expense){
+    UserNode* user = expense->user;
+    if(user){
+        user->expense_count--;
+        adjustExpenseTotals(user, expense->category, -expense->amount);
+        unlinkExpenseLists(user, expense);
+    }
+}
+
 ExpenseNode* getExpensePredecessor(BTreeNodeExpense* node, int idx) {
     BTreeNodeExpense* curr = node->children[idx];
     while (!curr->is_leaf)
@@ -1417,163 +6993,779 @@ ExpenseNode* getExpenseSuccessor(BTreeNodeExpense* node, int idx){
     return curr->keys[0];
 }
 
-void fillExpenseChild(BTreeNodeExpense* node, int idx){
-    if(idx != 0 && node->children[idx-1]->num_keys >= M/2)
-        borrowFromLeftExpense(node, idx);
-    else if(idx != node->num_keys && node->children[idx+1]->num_keys >= M/2)
-        borrowFromRightExpense(node, idx);
-    else{
-        if(idx != node->num_keys)
-            mergeExpenseNodes(node, idx);
-        else
-            mergeExpenseNodes(node, idx-1);
+void fillExpenseChild(BTreeNodeExpense* node, int idx){
+    if(idx != 0 && node->children[idx-1]->num_keys >= M/2)
+        borrowFromLeftExpense(node, idx);
+    else if(idx != node->num_keys && node->children[idx+1]->num_keys >= M/2)
+        borrowFromRightExpense(node, idx);
+    else{
+        if(idx != node->num_keys)
+            mergeExpenseNodes(node, idx);
+        else
+            mergeExpenseNodes(node, idx-1);
+    }
+}
+
+void borrowFromLeftExpense(BTreeNodeExpense* parent, int idx){
+    BTreeNodeExpense* child = parent->children[idx];
+    BTreeNodeExpense* sibling = parent->children[idx-1];
+
+    // Shift child's keys right
+    for(int i = child->num_keys-1; i >= 0; i--){
+        child->key_codes[i+1] = child->key_codes[i];
+        child->keys[i+1] = child->keys[i];
+    }
+    if(!child->is_leaf){
+        for (int i = child->num_keys; i >= 0; i--)
+            child->children[i+1] = child->children[i];
+    }
+
+    // Move key from parent to child
+    child->key_codes[0] = parent->key_codes[idx-1];
+    child->keys[0] = parent->keys[idx-1];
+    if (!child->is_leaf)
+        child->children[0] = sibling->children[sibling->num_keys];
+
+    // Move key from sibling to parent
+    parent->key_codes[idx-1] = sibling->key_codes[sibling->num_keys-1];
+    parent->keys[idx-1] = sibling->keys[sibling->num_keys-1];
+
+    child->num_keys++;
+    sibling->num_keys--;
+}
+
+void borrowFromRightExpense(BTreeNodeExpense* parent, int idx) {
+    BTreeNodeExpense* child = parent->children[idx];
+    BTreeNodeExpense* sibling = parent->children[idx+1];
+
+    // Move key from parent to child
+    child->key_codes[child->num_keys] = parent->key_codes[idx];
+    child->keys[child->num_keys] = parent->keys[idx];
+    if(!child->is_leaf)
+        child->children[child->num_keys+1] = sibling->children[0];
+
+    // Move key from sibling to parent
+    parent->key_codes[idx] = sibling->key_codes[0];
+    parent->keys[idx] = sibling->keys[0];
+
+    // Shift sibling's keys left
+    for(int i = 1; i < sibling->num_keys; i++){
+        sibling->key_codes[i-1] = sibling->key_codes[i];
+        sibling->keys[i-1] = sibling->keys[i];
+    }
+    if(!sibling->is_leaf){
+        for (int i = 1; i <= sibling->num_keys; i++)
+            sibling->children[i-1] = sibling->children[i];
+    }
+
+    child->num_keys++;
+    sibling->num_keys--;
+}
+
+void mergeExpenseNodes(BTreeNodeExpense* node, int idx) {
+    BTreeNodeExpense* child = node->children[idx];
+    BTreeNodeExpense* sibling = node->children[idx+1];
+
+    // Move key from parent to child
+    child->key_codes[M/2-1] = node->key_codes[idx];
+    child->keys[M/2-1] = node->keys[idx];
+
+    // Copy keys from sibling to child
+    for (int i = 0; i < sibling->num_keys; i++) {
+        child->key_codes[i+M/2] = sibling->key_codes[i];
+        child->keys[i+M/2] = sibling->keys[i];
+    }
+    if (!child->is_leaf) {
+        for (int i = 0; i <= sibling->num_keys; i++)
+            child->children[i+M/2] = sibling->children[i];
+    }
+
+    // Shift parent's keys and children
+    for (int i = idx+1; i < node->num_keys; i++) {
+        node->key_codes[i-1] = node->key_codes[i];
+        node->keys[i-1] = node->keys[i];
+    }
+    for (int i = idx+2; i <= node->num_keys; i++)
+        node->children[i-1] = node->children[i];
+
+    child->num_keys += sibling->num_keys + 1;
+    node->num_keys--;
+
+    free(sibling);
+}
+
+void deleteFromExpenseSubtree(BTreeNodeExpense* node, ExpenseKey key) {
+    int idx = find_key_index_expense(node, key);
+
+    if (idx < node->num_keys && node->key_codes[idx] == key){
+        if(node->is_leaf){
+            removeFromLeafExpense(node, idx);
+        }
+        else{
+            if(node->children[idx]->num_keys >= M/2){
+                ExpenseNode* pred = getExpensePredecessor(node, idx);
+                node->keys[idx] = pred;
+                node->key_codes[idx] = makeExpenseKey(pred->user_id, pred->expense_id);
+                deleteFromExpenseSubtree(node->children[idx], node->key_codes[idx]);
+            }
+            else if(node->children[idx+1]->num_keys >= M/2){
+                ExpenseNode* succ = getExpenseSuccessor(node, idx);
+                node->keys[idx] = succ;
+                node->key_codes[idx] = makeExpenseKey(succ->user_id, succ->expense_id);
+                deleteFromExpenseSubtree(node->children[idx+1], node->key_codes[idx]);
+            }
+            else{
+                mergeExpenseNodes(node, idx);
+                deleteFromExpenseSubtree(node->children[idx], key);
+            }
+        }
+    }
+    else{
+        if(node->is_leaf){
+            return;
+        }
+
+        bool flag = (idx == node->num_keys);
+        if(node->children[idx]->num_keys < M/2)
+            fillExpenseChild(node, idx);
+
+        if(flag && idx > node->num_keys)
+            deleteFromExpenseSubtree(node->children[idx-1], key);
+        else
+            deleteFromExpenseSubtree(node->children[idx], key);
+    }
+}
+
+bool deleteExpense(BTreeNodeExpense** root, int user_id, int expense_id){
+    invalidateFrozenIndex();
+
+    if (*root == NULL || !searchExpense(*root, user_id, expense_id)) {
+        printf("Expense with ID %d for user %d not found!\n", expense_id, user_id);
+        return false;
+    }
+
+    deleteFromExpenseSubtree(*root, makeExpenseKey(user_id, expense_id));
+
+    if((*root)->num_keys == 0){
+        BTreeNodeExpense* temp = *root;
+        if ((*root)->is_leaf)
+            *root = NULL;
+        else
+            *root = (*root)->children[0];
+        free(temp);
+    }
+
+    return true;
+}
+
+static bool expenseNodeUnderfull(const BTreeNodeExpense* node){
+    return node->num_keys < M/2 - 1;
+}
+
+static void bufferExpenseKeys(ExpenseNodeBuffer* buffer, const BTreeNodeExpense* node, int from, int to){
+    for (int i = from; i < to; i++) {
+        buffer->keys[buffer->num_keys++] = node->keys[i];
+    }
+}
+
+static void bufferExpenseChildren(ExpenseNodeBuffer* buffer, const BTreeNodeExpense* node, int from, int to){
+    for (int i = from; i < to; i++) {
+        buffer->children[buffer->num_children++] = node->children[i];
+    }
+}
+
+//write a buffer back into left, or split it over left and right around the returned separator
+static ExpenseNode* storeExpenseBuffer(const ExpenseNodeBuffer* buffer, BTreeNodeExpense* left, BTreeNodeExpense* right){
+    int left_keys = (buffer->num_keys <= M - 1) ? buffer->num_keys : buffer->num_keys / 2;
+    for (int i = 0; i < left_keys; i++) {
+        left->keys[i] = buffer->keys[i];
+        left->key_codes[i] = makeExpenseKey(buffer->keys[i]->user_id, buffer->keys[i]->expense_id);
+    }
+    for (int i = 0; i < buffer->num_children && i <= left_keys; i++) {
+        left->children[i] = buffer->children[i];
+    }
+    left->num_keys = left_keys;
+    if (left_keys == buffer->num_keys) {
+        return NULL;
+    }
+
+    int right_keys = buffer->num_keys - left_keys - 1;
+    for (int i = 0; i < right_keys; i++) {
+        right->keys[i] = buffer->keys[left_keys + 1 + i];
+        right->key_codes[i] = makeExpenseKey(right->keys[i]->user_id, right->keys[i]->expense_id);
+    }
+    for (int i = 0; left_keys + 1 + i < buffer->num_children; i++) {
+        right->children[i] = buffer->children[left_keys + 1 + i];
+    }
+    right->num_keys = right_keys;
+    return buffer->keys[left_keys];
+}
+
+static void rebalanceBufferChild(ExpenseNodeBuffer* buffer, int idx);
+
+//rebalance every underfull child that has a sibling in the buffer
+static void fixExpenseBuffer(ExpenseNodeBuffer* buffer){
+    for (int i = 0; i < buffer->num_children && buffer->num_keys > 0; ) {
+        if (expenseNodeUnderfull(buffer->children[i])) {
+            rebalanceBufferChild(buffer, i);
+            i = (i > 0) ? i - 1 : 0;
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+// Merge an underfull child with a sibling and the key between them, splitting
+// the result again if it does not fit one node. The child may itself hold a
+// single underfull child left by a range delete, so the merge is fixed first.
+static void rebalanceBufferChild(ExpenseNodeBuffer* buffer, int idx){
+    int pos = (idx > 0) ? idx - 1 : idx;
+    BTreeNodeExpense* left = buffer->children[pos];
+    BTreeNodeExpense* right = buffer->children[pos + 1];
+
+    ExpenseNodeBuffer merged = {0};
+    bufferExpenseKeys(&merged, left, 0, left->num_keys);
+    merged.keys[merged.num_keys++] = buffer->keys[pos];
+    bufferExpenseKeys(&merged, right, 0, right->num_keys);
+    if (!left->is_leaf) {
+        bufferExpenseChildren(&merged, left, 0, left->num_keys + 1);
+        bufferExpenseChildren(&merged, right, 0, right->num_keys + 1);
+        fixExpenseBuffer(&merged);
+    }
+
+    ExpenseNode* separator = storeExpenseBuffer(&merged, left, right);
+    if (separator) {
+        buffer->keys[pos] = separator;
+    }
+    else {
+        free(right);
+        memmove(&buffer->keys[pos], &buffer->keys[pos + 1], (buffer->num_keys - pos - 1) * sizeof(ExpenseNode*));
+        memmove(&buffer->children[pos + 1], &buffer->children[pos + 2],
+                (buffer->num_children - pos - 2) * sizeof(BTreeNodeExpense*));
+        buffer->num_keys--;
+        buffer->num_children--;
+    }
+}
+
+// Join two writable trees of equal height whose keys are all ordered left before
+// right. Returns NULL when everything fits in left (right is freed), otherwise
+// the separator between left and right. Only the seam between them is visited.
+static ExpenseNode* joinExpenseNodes(BTreeNodeExpense* left, BTreeNodeExpense* right){
+    ExpenseNodeBuffer joined = {0};
+    bufferExpenseKeys(&joined, left, 0, left->num_keys);
+    if (!left->is_leaf) {
+        BTreeNodeExpense* seam_left = left->children[left->num_keys];
+        BTreeNodeExpense* seam_right = right->children[0];
+        ExpenseNode* seam = joinExpenseNodes(seam_left, seam_right);
+        bufferExpenseChildren(&joined, left, 0, left->num_keys);
+        joined.children[joined.num_children++] = seam_left;
+        if (seam) {
+            joined.keys[joined.num_keys++] = seam;
+            joined.children[joined.num_children++] = seam_right;
+        }
+        bufferExpenseChildren(&joined, right, 1, right->num_keys + 1);
+    }
+    bufferExpenseKeys(&joined, right, 0, right->num_keys);
+    if (!left->is_leaf) {
+        fixExpenseBuffer(&joined);
+    }
+
+    ExpenseNode* separator = storeExpenseBuffer(&joined, left, right);
+    if (!separator) {
+        free(right);
+    }
+    return separator;
+}
+
+// Remove keys in [low, high] below a writable node. Children wholly inside the
+// range are released, the two boundary children are trimmed and joined, and
+// only nodes on those paths are rebalanced. The node itself may be left
+// underfull for its parent to fix.
+static void deleteExpenseRangeFrom(BTreeNodeExpense* node, ExpenseKey low, ExpenseKey high){
+    int first = find_key_index_expense(node, low);
+    int end = first;
+    while (end < node->num_keys && node->key_codes[end] <= high) {
+        end++;
+    }
+
+    if (node->is_leaf) {
+        for (int i = end; i < node->num_keys; i++) {
+            node->keys[i - (end - first)] = node->keys[i];
+            node->key_codes[i - (end - first)] = node->key_codes[i];
+        }
+        node->num_keys -= end - first;
+        return;
+    }
+
+    ExpenseNodeBuffer buffer = {0};
+    bufferExpenseKeys(&buffer, node, 0, first);
+    bufferExpenseChildren(&buffer, node, 0, first);
+    BTreeNodeExpense* left = node->children[first];
+    deleteExpenseRangeFrom(left, low, high);
+    buffer.children[buffer.num_children++] = left;
+    if (end > first) {
+        BTreeNodeExpense* right = node->children[end];
+        deleteExpenseRangeFrom(right, low, high);
+        for (int i = first + 1; i < end; i++) {
+            releaseExpenseTree(node->children[i]);
+        }
+        ExpenseNode* separator = joinExpenseNodes(left, right);
+        if (separator) {
+            buffer.keys[buffer.num_keys++] = separator;
+            buffer.children[buffer.num_children++] = right;
+        }
+    }
+    bufferExpenseKeys(&buffer, node, end, node->num_keys);
+    bufferExpenseChildren(&buffer, node, end + 1, node->num_keys + 1);
+    fixExpenseBuffer(&buffer);
+    storeExpenseBuffer(&buffer, node, NULL);
+}
+
+// Remove every key in [low, high] from a tree in O(log n + k). Records are not
+// freed; callers free them once their lists and totals are updated.
+void deleteExpenseRange(BTreeNodeExpense** root, ExpenseKey low, ExpenseKey high){
+    invalidateFrozenIndex();
+    if (*root == NULL) {
+        return;
+    }
+
+    deleteExpenseRangeFrom(*root, low, high);
+
+    //a root emptied by the delete hands over to its only child
+    while (*root && (*root)->num_keys == 0) {
+        BTreeNodeExpense* temp = *root;
+        *root = temp->is_leaf ? NULL : temp->children[0];
+        free(temp);
+    }
+}
+
+// Remove an expense from its month, its user's lists and all totals
+bool removeExpense(int user_id, int expense_id){
+    UserNode* user = searchUser(user_root, user_id);
+    ExpenseNode* expense = searchExpenseForUser(user, expense_id);
+    if (!expense) {
+        printf("Expense with ID %d for user %d not found!\n", expense_id, user_id);
+        return false;
+    }
+
+    store_version++;
+    closeExpenseVersion(expense);
+    if (lsmRemove(expense)) {
+        //still buffered, so only the id index and the totals hold it
+        expenseIndexRemove(expense);
+        user->expense_count--;
+        adjustExpenseTotals(user, expense->category, -expense->amount);
+        free(expense);
+    }
+    else if (tombstone_deletes) {
+        tombstoneExpense(expense);
+        unlinkExpenseFromUser(expense);
+    }
+    else {
+        removeFromPartition(expense);
+        unlinkExpenseFromUser(expense);
+        free(expense);
+    }
+    return true;
+}
+
+void setTombstoneDeletes(bool enabled){
+    if (!enabled) {
+        compactTombstones(true);
     }
+    tombstone_deletes = enabled;
 }
 
-void borrowFromLeftExpense(BTreeNodeExpense* parent, int idx){
-    BTreeNodeExpense* child = parent->children[idx];
-    BTreeNodeExpense* sibling = parent->children[idx-1];
-
-    // Shift child's keys right
-    for(int i = child->num_keys-1; i >= 0; i--){
-        child->keys[i+1] = child->keys[i];
-    }
-    if(!child->is_leaf){
-        for (int i = child->num_keys; i >= 0; i--)
-            child->children[i+1] = child->children[i];
+// Delete an expense from its month in O(log n): the record stays in the tree
+// marked as a tombstone, while the month's totals drop it at once
+void tombstoneExpense(ExpenseNode* expense){
+    invalidateFrozenIndex();
+    ExpensePartition* part = findPartition(monthKey(expense->date));
+    if (part) {
+        expense->tombstone = true;
+        part->tombstone_count++;
+        part->expense_count--;
+        part->total_expense -= expense->amount;
+        part->category_expenses[expense->category] -= expense->amount;
     }
+}
 
-    // Move key from parent to child
-    child->keys[0] = parent->keys[idx-1];
-    if (!child->is_leaf)
-        child->children[0] = sibling->children[sibling->num_keys];
-
-    // Move key from sibling to parent
-    parent->keys[idx-1] = sibling->keys[sibling->num_keys-1];
+// Put a re-added expense into the slot its tombstone still holds, so the
+// month tree never carries the same key twice
+bool reviveTombstone(ExpensePartition* part, ExpenseNode* expense){
+    ExpenseKey key = makeExpenseKey(expense->user_id, expense->expense_id);
 
-    child->num_keys++;
-    sibling->num_keys--;
+    BTreeNodeExpense* node = part->root;
+    int i = 0;
+    while (node) {
+        i = find_key_index_expense(node, key);
+        if (i < node->num_keys && node->key_codes[i] == key) {
+            break;
+        }
+        node = node->is_leaf ? NULL : node->children[i];
+    }
+    if (!node || !node->keys[i]->tombstone) {
+        return false;
+    }
+    free(node->keys[i]);
+    node->keys[i] = expense;
+    part->tombstone_count--;
+    return true;
 }
 
-void borrowFromRightExpense(BTreeNodeExpense* parent, int idx) {
-    BTreeNodeExpense* child = parent->children[idx];
-    BTreeNodeExpense* sibling = parent->children[idx+1];
-
-    // Move key from parent to child
-    child->keys[child->num_keys] = parent->keys[idx];
-    if(!child->is_leaf)
-        child->children[child->num_keys+1] = sibling->children[0];
+//rebuild a month tree from its live records, freeing the tombstones
+static void compactPartition(ExpensePartition* part){
+    int tree_count = part->expense_count - (part->compressed ? part->compressed->record_count : 0) +
+                     part->tombstone_count;
+    ExpenseNode** expenses = (ExpenseNode**)malloc((tree_count + 1) * sizeof(ExpenseNode*));
+    if (!expenses) {
+        printf("Failed to allocate memory for compaction\n");
+        return;
+    }
+    int pos = 0;
+    collectExpenses(part->root, expenses, &pos);
+    int live = 0;
+    for (int i = 0; i < pos; i++) {
+        if (expenses[i]->tombstone) {
+            free(expenses[i]);
+        }
+        else {
+            expenses[live++] = expenses[i];
+        }
+    }
+    releaseExpenseTree(part->root);
+    part->root = live ? buildExpenseTree(expenses, live) : NULL;
+    part->tombstone_count = 0;
+    free(expenses);
+}
 
-    // Move key from sibling to parent
-    parent->keys[idx] = sibling->keys[0];
+// Physically remove tombstones. With all set every month holding one is
+// rebuilt; otherwise only months past TOMBSTONE_COMPACT_PERCENT are, at most
+// TOMBSTONE_COMPACT_BATCH per call, so idle passes stay short.
+// Returns the number of months compacted.
+int compactTombstones(bool all){
+    int compacted = 0;
+    for (int i = expense_store.count - 1; i >= 0 && (all || compacted < TOMBSTONE_COMPACT_BATCH); i--) {
+        ExpensePartition* part = &expense_store.partitions[i];
+        int tree_count = part->expense_count - (part->compressed ? part->compressed->record_count : 0) +
+                         part->tombstone_count;
+        bool dense = part->tombstone_count * 100 > tree_count * TOMBSTONE_COMPACT_PERCENT;
+        if (part->tombstone_count > 0 && (all || dense)) {
+            compactPartition(part);
+            removeEmptyPartition(part);
+            compacted++;
+        }
+    }
+    return compacted;
+}
+// Take the records in range out of a compressed month and encode the rest
+// again. Blocks outside the key range are only decoded when something matches.
+static int removeCompressedRange(ExpensePartition* part, const ExpenseRange* range){
+    CompressedMonth* month = part->compressed;
+    if (!month || part->month_key < (int)(range->first_date / 100) || part->month_key > (int)(range->last_date / 100)) {
+        return 0;
+    }
+
+    ExpenseRecord block[COMPRESSED_BLOCK_RECORDS];
+    bool present = false;
+    for (int b = compressedBlockFor(month, range->low_key);
+         b < month->block_count && month->blocks[b].first_key <= range->high_key && !present; b++) {
+        int n = decodeBlock(month, b, part->month_key, block);
+        for (int i = 0; i < n && !present; i++) {
+            present = expenseInRange(range, block[i].user_id, block[i].expense_id, block[i].date);
+        }
+    }
+    if (!present) {
+        return 0;
+    }
 
-    // Shift sibling's keys left
-    for(int i = 1; i < sibling->num_keys; i++){
-        sibling->keys[i-1] = sibling->keys[i];
+    ExpenseRecord* records;
+    int count = decodeCompressedMonth(part, &records);
+    ExpenseNode* nodes = (ExpenseNode*)malloc((count + 1) * sizeof(ExpenseNode));
+    ExpenseNode** kept = (ExpenseNode**)malloc((count + 1) * sizeof(ExpenseNode*));
+    if (!records || !nodes || !kept) {
+        printf("Failed to allocate memory for compressed month %d/%d\n", part->month_key % 100, part->month_key / 100);
+        free(records);
+        free(nodes);
+        free(kept);
+        return 0;
     }
-    if(!sibling->is_leaf){
-        for (int i = 1; i <= sibling->num_keys; i++)
-            sibling->children[i-1] = sibling->children[i];
+
+    int kept_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (!expenseInRange(range, records[i].user_id, records[i].expense_id, records[i].date)) {
+            ExpenseNode* node = &nodes[kept_count];
+            memset(node, 0, sizeof(ExpenseNode));
+            node->user_id = records[i].user_id;
+            node->expense_id = records[i].expense_id;
+            node->amount = records[i].amount;
+            node->category = records[i].category;
+            node->date = records[i].date;
+            kept[kept_count] = node;
+            kept_count++;
+        }
     }
 
-    child->num_keys++;
-    sibling->num_keys--;
+    int removed = 0;
+    CompressedMonth* encoded = kept_count ? encodeMonth(kept, kept_count) : NULL;
+    if (kept_count == 0 || encoded) {
+        UserNode* user = NULL;
+        for (int i = 0; i < count; i++) {
+            if (expenseInRange(range, records[i].user_id, records[i].expense_id, records[i].date)) {
+                part->expense_count--;
+                part->total_expense -= records[i].amount;
+                part->category_expenses[records[i].category] -= records[i].amount;
+                if (!user || user->user_id != records[i].user_id) {
+                    user = searchUser(user_root, records[i].user_id);
+                }
+                if (user) {
+                    dropColdExpense(user, &records[i]);
+                }
+                removed++;
+            }
+        }
+        releaseCompressedMonth(month);
+        part->compressed = encoded;
+    }
+    free(records);
+    free(nodes);
+    free(kept);
+    return removed;
 }
 
-void mergeExpenseNodes(BTreeNodeExpense* node, int idx) {
-    BTreeNodeExpense* child = node->children[idx];
-    BTreeNodeExpense* sibling = node->children[idx+1];
+//drop partitions emptied by a range delete
+static void removeEmptyPartitions(){
+    for (int i = expense_store.count - 1; i >= 0; i--) {
+        removeEmptyPartition(&expense_store.partitions[i]);
+    }
+}
 
-    // Move key from parent to child
-    child->keys[M/2-1] = node->keys[idx];
+// Remove a user's expenses with ids in [start_id, end_id]. The user's lists are
+// filtered in one pass, totals are adjusted once per category and each month
+// loses the matching keys in one range delete. Archived and paged expenses in
+// the range are purged from their files. Returns the number removed.
+int removeExpensesInRange(int user_id, int start_id, int end_id){
+    UserNode* user = searchUser(user_root, user_id);
+    if (!user) {
+        printf("User with ID %d not found!\n", user_id);
+        return 0;
+    }
+
+    invalidateFrozenIndex();
+    lsmCompact();
+    store_version++;
+    ExpenseRange range = {makeExpenseKey(user_id, start_id), makeExpenseKey(user_id, end_id), 0, UINT_MAX};
+
+    int live_count = 0;
+    for (ExpenseNode* expense = user->expenses_head; expense; expense = expense->next) {
+        live_count++;
+    }
+    ExpenseNode** removed = (ExpenseNode**)malloc((live_count + 1) * sizeof(ExpenseNode*));
+    if (!removed) {
+        printf("Failed to allocate memory for range delete\n");
+        return 0;
+    }
+    int removed_count = 0;
+    for (ExpenseNode* expense = user->expenses_head; expense; expense = expense->next) {
+        if (expenseInRange(&range, expense->user_id, expense->expense_id, expense->date)) {
+            ExpensePartition* part = findPartition(monthKey(expense->date));
+            if (part) {
+                //tombstones in the key range would be left in the tree unfreed
+                if (part->tombstone_count) {
+                    compactPartition(part);
+                }
+                part->expense_count--;
+                part->total_expense -= expense->amount;
+                part->category_expenses[expense->category] -= expense->amount;
+            }
+            removed[removed_count++] = expense;
+        }
+    }
+    pruneUserExpenses(user, &range);
 
-    // Copy keys from sibling to child
-    for (int i = 0; i < sibling->num_keys; i++) {
-        child->keys[i+M/2] = sibling->keys[i];
+    qsort(removed, removed_count, sizeof(ExpenseNode*), compareExpensesByMonth);
+    for (int i = 0; i < removed_count; i++) {
+        if (i == 0 || monthKey(removed[i]->date) != monthKey(removed[i - 1]->date)) {
+            ExpensePartition* part = findPartition(monthKey(removed[i]->date));
+            if (part) {
+                deleteExpenseRange(&part->root, range.low_key, range.high_key);
+            }
+        }
     }
-    if (!child->is_leaf) {
-        for (int i = 0; i <= sibling->num_keys; i++)
-            child->children[i+M/2] = sibling->children[i];
+    for (int i = 0; i < removed_count; i++) {
+        free(removed[i]);
     }
+    free(removed);
 
-    // Shift parent's keys and children
-    for (int i = idx+1; i < node->num_keys; i++) {
-        node->keys[i-1] = node->keys[i];
+    int total = removed_count;
+    for (int i = 0; i < expense_store.count; i++) {
+        total += removeCompressedRange(&expense_store.partitions[i], &range);
     }
-    for (int i = idx+2; i <= node->num_keys; i++)
-        node->children[i-1] = node->children[i];
-
-    child->num_keys += sibling->num_keys + 1;
-    node->num_keys--;
+    removeEmptyPartitions();
 
-    free(sibling);
+    //cold rows count only once their file has been rewritten without them
+    int archived = purgeArchivedExpenses(&range);
+    int paged = purgePagedExpenses(&range);
+    total += (archived > 0) ? archived : 0;
+    total += (paged > 0) ? paged : 0;
+    return total;
 }
 
-void deleteFromExpenseSubtree(BTreeNodeExpense* node, int user_id, int expense_id) {
-    int idx = find_key_index_expense(node, user_id, expense_id);
-
-    if (idx < node->num_keys && 
-        node->keys[idx]->user_id == user_id && 
-        node->keys[idx]->expense_id == expense_id){
-        if(node->is_leaf){
-            removeFromLeafExpense(node, idx);
+// Remove every expense dated within [start, end]. Months wholly inside the
+// window are released whole; the boundary months are rebuilt once from the
+// records they keep. Each affected user is then pruned in a single pass.
+// Archived and paged expenses in the window are purged by rewriting their file,
+// and the history is compacted up to the new version.
+int removeExpensesInPeriod(Date start, Date end){
+    if (!isValidDate(start) || !isValidDate(end) || packDate(start) > packDate(end)) {
+        printf("Error: Invalid period %d/%d/%d - %d/%d/%d\n", start.day, start.month, start.year,
+               end.day, end.month, end.year);
+        return 0;
+    }
+
+    invalidateFrozenIndex();
+    lsmCompact();
+    store_version++;
+    ExpenseRange range = {makeExpenseKey(INT_MIN, INT_MIN), makeExpenseKey(INT_MAX, INT_MAX),
+                          packDate(start), packDate(end)};
+    int first = partitionLowerBound(monthKey(range.first_date));
+    int last = first;
+    int live_count = 0;
+    while (last < expense_store.count && expense_store.partitions[last].month_key <= monthKey(range.last_date)) {
+        ExpensePartition* part = &expense_store.partitions[last];
+        live_count += part->expense_count - (part->compressed ? part->compressed->record_count : 0);
+        last++;
+    }
+    int cold_removed = 0;
+    int archived = purgeArchivedExpenses(&range);
+    int paged = purgePagedExpenses(&range);
+    cold_removed += (archived > 0) ? archived : 0;
+    cold_removed += (paged > 0) ? paged : 0;
+    if (first == last) {
+        compactHistory();
+        return cold_removed;
+    }
+
+    ExpenseNode** removed = (ExpenseNode**)malloc((live_count + 1) * sizeof(ExpenseNode*));
+    ExpenseNode** kept = (ExpenseNode**)malloc((live_count + 1) * sizeof(ExpenseNode*));
+    if (!removed || !kept) {
+        printf("Failed to allocate memory for range delete\n");
+        free(removed);
+        free(kept);
+        compactHistory();
+        return cold_removed;
+    }
+
+    int removed_count = 0;
+    int total = cold_removed;
+    for (int i = first; i < last; i++) {
+        ExpensePartition* part = &expense_store.partitions[i];
+        bool whole_month = range.first_date <= (DateKey)part->month_key * 100 + 1 &&
+                           range.last_date >= (DateKey)part->month_key * 100 + 31;
+        if (part->tombstone_count) {
+            compactPartition(part);
         }
-        else{
-            if(node->children[idx]->num_keys >= M/2){
-                ExpenseNode* pred = getExpensePredecessor(node, idx);
-                node->keys[idx] = pred;
-                deleteFromExpenseSubtree(node->children[idx], pred->user_id, pred->expense_id);
-            }
-            else if(node->children[idx+1]->num_keys >= M/2){
-                ExpenseNode* succ = getExpenseSuccessor(node, idx);
-                node->keys[idx] = succ;
-                deleteFromExpenseSubtree(node->children[idx+1], succ->user_id, succ->expense_id);
+        int pos = 0;
+        collectExpenses(part->root, kept, &pos);
+        int kept_count = 0;
+        for (int j = 0; j < pos; j++) {
+            ExpenseNode* expense = kept[j];
+            if (whole_month || dateInRange(expense->date, range.first_date, range.last_date)) {
+                removed[removed_count++] = expense;
+                part->expense_count--;
+                part->total_expense -= expense->amount;
+                part->category_expenses[expense->category] -= expense->amount;
+                total++;
             }
-            else{
-                mergeExpenseNodes(node, idx);
-                deleteFromExpenseSubtree(node->children[idx], user_id, expense_id);
+            else {
+                kept[kept_count++] = expense;
             }
         }
-    }
-    else{
-        if(node->is_leaf){
-            printf("Expense ID %d for user %d not found.\n", expense_id, user_id);
-            return;
+        if (kept_count < pos) {
+            releaseExpenseTree(part->root);
+            part->root = kept_count ? buildExpenseTree(kept, kept_count) : NULL;
         }
 
-        bool flag = (idx == node->num_keys);
-        if(node->children[idx]->num_keys < M/2)
-            fillExpenseChild(node, idx);
+        if (whole_month && part->compressed) {
+            int cold = part->compressed->record_count;
+            for (int c = 0; c < MAX_CATEGORIES; c++) {
+                part->category_expenses[c] = 0.0f;
+            }
+            part->total_expense = 0.0f;
+            part->expense_count -= cold;
+            dropCompressedExpenses(part);
+            total += cold;
+        }
+        else {
+            total += removeCompressedRange(part, &range);
+        }
+    }
 
-        if(flag && idx > node->num_keys)
-            deleteFromExpenseSubtree(node->children[idx-1], user_id, expense_id);
-        else
-            deleteFromExpenseSubtree(node->children[idx], user_id, expense_id);
+    //removed records are grouped by user so each affected user is pruned once
+    qsort(removed, removed_count, sizeof(ExpenseNode*), compareExpenseKeys);
+    for (int i = 0; i < removed_count; i++) {
+        if (i == 0 || removed[i]->user_id != removed[i - 1]->user_id) {
+            UserNode* user = searchUser(user_root, removed[i]->user_id);
+            if (user) {
+                pruneUserExpenses(user, &range);
+            }
+        }
+    }
+    for (int i = 0; i < removed_count; i++) {
+        free(removed[i]);
     }
+    free(removed);
+    free(kept);
+    removeEmptyPartitions();
+    compactHistory();
+    return total;
 }
 
-bool deleteExpense(BTreeNodeExpense** root, int user_id, int expense_id){
-    if (*root == NULL) {
-        printf("Expense with ID %d for user %d not found!\n", expense_id, user_id);
+// Delete a user with everything it owns. Its expenses go through one id range
+// delete over the user's whole key range, which also purges its archived and
+// paged rows. If a cold file could not be rewritten the user is kept, so its
+// rows are never left without an owner; deleting again retries the purge.
+bool removeUser(int user_id){
+    UserNode* user = searchUser(user_root, user_id);
+    if (!user) {
+        printf("User with ID %d not found!\n", user_id);
+        return false;
+    }
+
+    removeExpensesInRange(user_id, INT_MIN, INT_MAX);
+    if (user->expense_count > 0) {
+        printf("User with ID %d still has stored expenses; user kept\n", user_id);
         return false;
     }
+    leaveFamily(user);
+    deleteIndividual(&user_root, user_id);
+    freeUser(user);
+    return true;
+}
 
-    deleteFromExpenseSubtree(*root, user_id, expense_id);
 
-    if((*root)->num_keys == 0){
-        BTreeNodeExpense* temp = *root;
-        if ((*root)->is_leaf)
-            *root = NULL;
-        else
-            *root = (*root)->children[0];
-        free(temp);
+// Delete a family together with all of its members. The family stays if a
+// member could not be removed.
+bool removeFamily(int family_id){
+    FamilyNode* family = searchFamily(family_root, family_id);
+    if (!family) {
+        printf("Family with ID %d not found!\n", family_id);
+        return false;
     }
 
+    while (family->member_count > 0) {
+        if (!removeUser(family->members[family->member_count - 1]->user_id)) {
+            return false;
+        }
+    }
+    deleteFamily(&family_root, family_id);
+    freeFamily(family);
     return true;
 }
 
 // Update individual or family details
-void updateOrDeleteIndividualFamilyDetails(BTreeNodeUser** user_root,BTreeNodeFamily** family_root,BTreeNodeExpense** expense_root) {
+void updateOrDeleteIndividualFamilyDetails(BTreeNodeUser** user_root,BTreeNodeFamily** family_root) {
     int choice;
     printf("\n1. Update Individual\n2. Update Family\n3. Delete Individual\n4. Delete Family\nEnter choice: ");
     scanf("%d", &choice);
@@ -1599,7 +7791,9 @@ void updateOrDeleteIndividualFamilyDetails(BTreeNodeUser** user_root,BTreeNodeFa
             printf("Enter new name (or - to keep): ");
             scanf("%99s", name);
             if (strcmp(name, "-") != 0) {
-                strncpy(user->user_name, name, NAME_LEN);
+                nameIndexRemove(&user_name_index, user->details->user_name, user->user_id);
+                user->details->user_name = internString(&name_pool, name);
+                nameIndexInsert(&user_name_index, user->details->user_name, user->user_id, user);
             }
             
             printf("Enter new income (or -1 to keep): ");
@@ -1611,6 +7805,7 @@ void updateOrDeleteIndividualFamilyDetails(BTreeNodeUser** user_root,BTreeNodeFa
                 }
                 user->income = income;
             }
+            bumpUserGeneration(user);
             
             printf("User updated successfully\n");
             break;
@@ -1633,7 +7828,10 @@ void updateOrDeleteIndividualFamilyDetails(BTreeNodeUser** user_root,BTreeNodeFa
             printf("Enter new family name (or - to keep): ");
             scanf("%99s", name);
             if (strcmp(name, "-") != 0) {
-                strncpy(family->family_name, name, NAME_LEN);
+                nameIndexRemove(&family_name_index, family->family_name, family->family_id);
+                family->family_name = internString(&name_pool, name);
+                nameIndexInsert(&family_name_index, family->family_name, family->family_id, family);
+                bumpFamilyGeneration(family);
             }
             
             printf("Family updated successfully\n");
@@ -1650,15 +7848,13 @@ void updateOrDeleteIndividualFamilyDetails(BTreeNodeUser** user_root,BTreeNodeFa
                 break;
             }
         
-            // Check if user is in a family and is the last member
-            if (user->family && user->family->member_count == 1) {
-                // Delete the family first
-                deleteFamily(family_root, user->family->family_id); 
-            }
-        
-            // Then delete the user
-            if (deleteIndividual(user_root, user_id)) {
+            // Delete the user with its expenses, then its family if it was the last member
+            FamilyNode* family = user->family;
+            if (removeUser(user_id)) {
                 printf("User deleted successfully\n");
+                if (family && family->member_count == 0) {
+                    removeFamily(family->family_id);
+                }
             } else {
                 printf("Failed to delete user\n");
             }
@@ -1675,15 +7871,8 @@ void updateOrDeleteIndividualFamilyDetails(BTreeNodeUser** user_root,BTreeNodeFa
                 break;
             }
         
-            // First delete all members
-            for (int i = 0; i < family->member_count; i++) {
-                if (family->members[i]) {
-                    deleteIndividual(user_root, family->members[i]->user_id);
-                }
-            }
-        
-            // Then delete the family
-            if (deleteFamily(family_root, family_id)) {
+            // Members are removed with their expenses before the family itself
+            if (removeFamily(family_id)) {
                 printf("Family and all members deleted successfully\n");
             } else {
                 printf("Failed to delete family\n");
@@ -1707,13 +7896,20 @@ void updateOrDeleteExpense() {
     printf("Enter expense ID: ");
     scanf("%d", &expense_id);
 
-    UserNode* user = searchUser(user_root, user_id);
+    UserNode* user = findUser(user_id);
     if (!user) {
         printf("User not found\n");
         return;
     }
 
-    ExpenseNode* expense = searchExpenseForUser(user, expense_id);
+    ExpenseNode* expense = findExpense(user_id, expense_id);
+    ExpenseRecord archived;
+    if (!expense && (findCompressedExpense(user_id, expense_id, &archived) ||
+                     findArchivedExpense(user_id, expense_id, &archived))) {
+        printExpenseRecord(&archived);
+        printf("Expense is in a compressed or archived month and is read-only\n");
+        return;
+    }
     if (!expense) {
         printf("Expense not found\n");
         return;
@@ -1734,42 +7930,38 @@ void updateOrDeleteExpense() {
         Date date;
         printf("Enter new date as day month year (or 0 0 0 to keep): ");
         scanf("%d %d %d", &date.day, &date.month, &date.year);
+
+        bool keep_date = (date.day == 0 && date.month == 0 && date.year == 0);
+        if (!keep_date && !isValidDate(date)) {
+            printf("Invalid date %d/%d/%d\n", date.day, date.month, date.year);
+            return;
+        }
         
-        // Calculate differences for updates
-        float amount_diff = (amount >= 0) ? (amount - expense->amount) : 0;
-        float category_diff[MAX_CATEGORIES] = {0};
-        
+        // Take the old values out of the totals, apply the changes, add them back
+        adjustExpenseTotals(user, expense->category, -expense->amount);
+        removeFromPartition(expense);
+        store_version++;
+        closeExpenseVersion(expense);
+
         if (category >= 0 && category < MAX_CATEGORIES) {
-            category_diff[expense->category] -= expense->amount;
-            category_diff[category] += (amount >= 0) ? amount : expense->amount;
             expense->category = category;
         }
-        
-        // Apply updates
         if (amount >= 0) {
+            unlinkExpenseByAmount(user, expense);
             expense->amount = amount;
+            linkExpenseByAmount(user, expense);
         }
-        if (date.day > 0 && date.month > 0 && date.year > 0) {
-            expense->date = date;
-        }
-        
-        // Update user totals
-        user->total_expense += amount_diff;
-        for (int i = 0; i < MAX_CATEGORIES; i++) {
-            user->category_expenses[i] += category_diff[i];
-        }
-        
-        // Update family totals if in family
-        if (user->family) {
-            user->family->total_expense += amount_diff;
-            for (int i = 0; i < MAX_CATEGORIES; i++) {
-                user->family->category_expenses[i] += category_diff[i];
-            }
+        if (!keep_date) {
+            expense->date = packDate(date);
         }
+
+        addToPartition(expense);
+        adjustExpenseTotals(user, expense->category, expense->amount);
+        openExpenseVersion(user, expense);
         
         printf("Expense updated successfully\n");
     } else if (choice == 2) { // Delete Expense
-        if (deleteExpense(&expense_root, user_id, expense_id)) {
+        if (removeExpense(user_id, expense_id)) {
             printf("Expense deleted successfully\n");
         } else {
             printf("Failed to delete expense\n");
@@ -1781,53 +7973,65 @@ void updateOrDeleteExpense() {
 
 // Print a single user
 void printUser(UserNode* user) {
+    fprintUser(stdout, user);
+}
+
+void fprintUser(FILE* out, UserNode* user) {
     if (!user) return;
     
-    printf("User ID: %d, Name: %s, Income: %.2f\n", 
-           user->user_id, user->user_name, user->income);
-    printf("Total Expenses: %.2f\n", user->total_expense);
-    printf("Family: %s\n", user->family ? user->family->family_name : "None");
+    fprintf(out, "User ID: %d, Name: %s, Income: %.2f\n", 
+            user->user_id, user->details->user_name, user->income);
+    fprintf(out, "Total Expenses: %.2f\n", user->total_expense);
+    fprintf(out, "Family: %s\n", user->family ? user->family->family_name : "None");
     
     // Print category expenses
-    printf("Category Expenses:\n");
+    fprintf(out, "Category Expenses:\n");
     for (int i = 0; i < MAX_CATEGORIES; i++) {
         if (user->category_expenses[i] > 0) {
-            printf("  %s: %.2f\n", category_names[i], user->category_expenses[i]);
+            fprintf(out, "  %s: %.2f\n", category_names[i], user->category_expenses[i]);
         }
     }
-    printf("\n");
+    fprintf(out, "\n");
 }
 
 // Print a single family
 void printFamily(FamilyNode* family) {
+    fprintFamily(stdout, family);
+}
+
+void fprintFamily(FILE* out, FamilyNode* family) {
     if (!family) return;
     
-    printf("Family ID: %d, Name: %s\n", family->family_id, family->family_name);
-    printf("Total Income: %.2f, Total Expense: %.2f\n", 
-           family->total_income, family->total_expense);
-    printf("Members (%d):\n", family->member_count);
+    fprintf(out, "Family ID: %d, Name: %s\n", family->family_id, family->family_name);
+    fprintf(out, "Total Income: %.2f, Total Expense: %.2f\n", 
+            family->total_income, family->total_expense);
+    fprintf(out, "Members (%d):\n", family->member_count);
     
     for (int i = 0; i < family->member_count; i++) {
         if (family->members[i]) {  // Add null check
-            printf("  Member %d: %s (ID: %d)\n", 
-                   i+1, family->members[i]->user_name, family->members[i]->user_id);
+            fprintf(out, "  Member %d: %s (ID: %d)\n", 
+                    i+1, family->members[i]->details->user_name, family->members[i]->user_id);
         }
     }
     
-    printf("Family Category Expenses:\n");
+    fprintf(out, "Family Category Expenses:\n");
     for (int i = 0; i < MAX_CATEGORIES; i++) {
         if (family->category_expenses[i] > 0) {
-            printf("  %s: %.2f\n", category_names[i], family->category_expenses[i]);
+            fprintf(out, "  %s: %.2f\n", category_names[i], family->category_expenses[i]);
         }
     }
-    printf("\n");
+    fprintf(out, "\n");
 }
 
 
 // Print a single expense
 void printExpense(ExpenseNode* expense) {
+    fprintExpense(stdout, expense);
+}
+
+void fprintExpense(FILE* out, ExpenseNode* expense) {
     if (!expense) {
-        printf("(NULL expense)\n");
+        fprintf(out, "(NULL expense)\n");
         return;
     }
     
@@ -1837,51 +8041,51 @@ void printExpense(ExpenseNode* expense) {
         category = 0;  // Default to first category if invalid
     }
     
-    printf("Expense ID: %-5d | User ID: %-5d | Amount: %-8.2f | ", 
-           expense->expense_id, expense->user_id, expense->amount);
-    printf("Category: %-10s | Date: %02d/%02d/%04d\n",
-           category_names[category],
-           expense->date.day,
-           expense->date.month,
-           expense->date.year);
+    fprintf(out, "Expense ID: %-5d | User ID: %-5d | Amount: %-8.2f | ", 
+            expense->expense_id, expense->user_id, expense->amount);
+    fprintf(out, "Category: %-10s | Date: %02d/%02d/%04d\n",
+            category_names[category],
+            DATE_DAY(expense->date),
+            DATE_MONTH(expense->date),
+            DATE_YEAR(expense->date));
 }
 
 
 // Recursive function to traverse and print all users in the B-tree
-void traverseAndPrintUsers(BTreeNodeUser* root) {
+void traverseAndPrintUsers(FILE* out, BTreeNodeUser* root) {
     if (root != NULL) {
         int i;
         for (i = 0; i < root->num_keys; i++) {
-            traverseAndPrintUsers(root->children[i]);
-            printUser(root->keys[i]);
+            traverseAndPrintUsers(out, root->children[i]);
+            fprintUser(out, root->keys[i]);
         }
-        traverseAndPrintUsers(root->children[i]);
+        traverseAndPrintUsers(out, root->children[i]);
     }
 }
 
 // Recursive function to traverse and print all families in the B-tree
-void traverseAndPrintFamilies(BTreeNodeFamily* root) {
+void traverseAndPrintFamilies(FILE* out, BTreeNodeFamily* root) {
     if (root != NULL) {
         for (int i = 0; i < root->num_keys; i++) {
-            traverseAndPrintFamilies(root->children[i]);
-            printFamily(root->keys[i]);
+            traverseAndPrintFamilies(out, root->children[i]);
+            fprintFamily(out, root->keys[i]);
         }
-        traverseAndPrintFamilies(root->children[root->num_keys]);
+        traverseAndPrintFamilies(out, root->children[root->num_keys]);
     }
 }
 
 // Recursive function to traverse and print all expenses in the B-tree
-void traverseAndPrintExpenses(BTreeNodeExpense* root) {
+void traverseAndPrintExpenses(FILE* out, BTreeNodeExpense* root) {
     if (root != NULL) {
         for (int i = 0; i < root->num_keys; i++) {
-            traverseAndPrintExpenses(root->children[i]);
-            if (root->keys[i] != NULL) {  // Explicit NULL check
-                printExpense(root->keys[i]);
+            traverseAndPrintExpenses(out, root->children[i]);
+            if (root->keys[i] != NULL && !root->keys[i]->tombstone) {  // Explicit NULL check
+                fprintExpense(out, root->keys[i]);
             }
         }
         // Don't forget the last child
         if (!root->is_leaf) {
-            traverseAndPrintExpenses(root->children[root->num_keys]);
+            traverseAndPrintExpenses(out, root->children[root->num_keys]);
         }
     }
 }
@@ -1890,17 +8094,24 @@ void traverseAndPrintExpenses(BTreeNodeExpense* root) {
 // Helper functions to print entire databases
 void printAllUsers() {
     printf("\n=== ALL USERS ===\n");
-    traverseAndPrintUsers(user_root);
+    traverseAndPrintUsers(stdout, user_root);
 }
 
 void printAllFamilies() {
     printf("\n=== ALL FAMILIES ===\n");
-    traverseAndPrintFamilies(family_root);
+    traverseAndPrintFamilies(stdout, family_root);
 }
 
 void printAllExpenses() {
     printf("\n=== ALL EXPENSES ===\n");
-    traverseAndPrintExpenses(expense_root);
+    ReportTaskList list = {NULL, 0, 0};
+    if (addExpenseScanTasks(&list, 0, ~(DateKey)0, runExpenseScanTask, runCompressedScanTask, NULL)) {
+        runReportTasks(list.tasks, list.count);
+    }
+    flushReportTasks(stdout, list.tasks, list.count);
+    free(list.tasks);
+    lsmPrintInPeriod(stdout, 0, ~(DateKey)0, NULL);
+    printArchivedInPeriod(stdout, 0, ~(DateKey)0, NULL);
 }
 
 void loadDataFromFile(const char* filename) {
@@ -1910,6 +8121,11 @@ void loadDataFromFile(const char* filename) {
         return;
     }
 
+    //expenses are collected and added as one batch once users and families exist
+    int batch_count = 0;
+    int batch_capacity = 0;
+    ExpenseInput* batch = NULL;
+
     char line[256];
     while (fgets(line, sizeof(line), file)) {
         // Skip empty lines
@@ -1949,24 +8165,47 @@ void loadDataFromFile(const char* filename) {
             date.day = atoi(strtok(NULL, " \n"));
             date.month = atoi(strtok(NULL, " \n"));
             date.year = atoi(strtok(NULL, " \n"));
-            addExpense(user_id, expense_id, amount, category, date);
+            //months already in the archive or page file come back through their totals
+            int month_key = date.year * 100 + date.month;
+            if ((archive.file && month_key < archive.header.cutoff_month) ||
+                (paged_store.file && month_key < paged_store.cutoff_month)) {
+                continue;
+            }
+            if (batch_count == batch_capacity) {
+                batch_capacity = batch_capacity ? batch_capacity * 2 : 256;
+                ExpenseInput* grown = (ExpenseInput*)realloc(batch, batch_capacity * sizeof(ExpenseInput));
+                if (!grown) {
+                    printf("Failed to allocate memory for expense batch\n");
+                    break;
+                }
+                batch = grown;
+            }
+            ExpenseInput input = {user_id, expense_id, amount, category, date};
+            batch[batch_count++] = input;
         }
     }
     fclose(file);
+    addExpenses(batch, batch_count);
+    free(batch);
+}
+
+// Free a user record and its expense history
+void freeUser(UserNode* user) {
+    ExpenseVersion* version = user->details->history;
+    while (version) {
+        ExpenseVersion* next = version->next;
+        free(version);
+        version = next;
+    }
+    free(user->details);
+    free(user);
 }
 
 void freeUserTree(BTreeNodeUser* root) {
     if (root) {
         for (int i = 0; i < root->num_keys; i++) {
-            // Free user's expense list first
-            ExpenseNode* expense = root->keys[i]->expenses_head;
-            while (expense) {
-                ExpenseNode* next = expense->next;
-                free(expense);
-                expense = next;
-            }
-            // Free the user
-            free(root->keys[i]);
+            // Expenses are owned and freed by the expense store
+            freeUser(root->keys[i]);
         }
         // Recursively free children
         if (!root->is_leaf) {
@@ -1983,7 +8222,7 @@ void freeUserTree(BTreeNodeUser* root) {
 void freeFamilyTree(BTreeNodeFamily* root) {
     if (root) {
         for (int i = 0; i < root->num_keys; i++) {
-            free(root->keys[i]); // Just free the family, members are freed in user tree
+            freeFamily(root->keys[i]); // Just free the family, members are freed in user tree
         }
         if (!root->is_leaf) {
             for (int i = 0; i <= root->num_keys; i++) {
@@ -1994,10 +8233,11 @@ void freeFamilyTree(BTreeNodeFamily* root) {
     }
 }
 
-// 3. Free all Expense nodes (if not already freed with users)
+// Free an expense tree together with the expense records it holds
 void freeExpenseTree(BTreeNodeExpense* root) {
     if (root) {
         for (int i = 0; i < root->num_keys; i++) {
+            free(root->keys[i]->amount_skip);
             free(root->keys[i]);
         }
         if (!root->is_leaf) {
@@ -2009,13 +8249,44 @@ void freeExpenseTree(BTreeNodeExpense* root) {
     }
 }
 
+void freeExpenseStore() {
+    for (int i = 0; i < expense_store.count; i++) {
+        freeExpenseTree(expense_store.partitions[i].root);
+        releaseCompressedMonth(expense_store.partitions[i].compressed);
+    }
+    free(expense_store.partitions);
+    expense_store.partitions = NULL;
+    expense_store.count = 0;
+    expense_store.capacity = 0;
+}
+
+//version a report should reflect; -1 (or the current version) means now
+long readAsOfVersion() {
+    long as_of;
+    printf("Enter version to report as of (-1 for current, now at %ld): ", store_version);
+    scanf("%ld", &as_of);
+    if (as_of >= 0 && as_of < history_horizon) {
+        printf("History before version %ld has been compacted; reporting as of it\n", history_horizon);
+        as_of = history_horizon;
+    }
+    return as_of;
+}
+
 // Main menu
 int main() {
 
+    openArchive(ARCHIVE_FILE);
+    pagedStoreOpen(&paged_store, PAGED_STORE_FILE, PAGED_POOL_FRAMES, false);
     loadDataFromFile("data.txt");
+    applyArchiveSummaries();
+    applyPagedTotals();
+    freezeIndexes();
 
     int choice;
     do {
+        //idle time: compact tombstone-heavy months before waiting for input
+        compactTombstones(false);
+
         printf("\n--- Expense Tracking System ---\n");
         printf("1. Add User\n");
         printf("2. Add Expense\n");
@@ -2031,6 +8302,19 @@ int main() {
         printf("12 Update/Delete Family Details\n");
         printf("13 Update/Delete Expense\n");
         printf("14 Exit\n");
+        printf("15 Search Users/Families by Name\n");
+        printf("16 Get Top Expenses of a User\n");
+        printf("17 Drop Expenses Before Month\n");
+        printf("18 Freeze Indexes for Reporting\n");
+        printf("19 Page Out Expenses Before Month\n");
+        printf("20 Toggle Bulk Ingest Mode\n");
+        printf("21 Compress Expenses Before Month\n");
+        printf("22 Archive Expenses Before Month\n");
+        printf("23 Delete Expenses in Period\n");
+        printf("24 Delete Expense ID Range of a User\n");
+        printf("25 Toggle Tombstone Deletes\n");
+        printf("26 Group Expenses\n");
+        printf("27 Run Query\n");
         printf("Enter your choice: ");
         scanf("%d", &choice);
 
@@ -2100,7 +8384,7 @@ int main() {
                 int family_id;
                 printf("Enter family ID: ");
                 scanf("%d", &family_id);
-                getTotalExpense(family_id);
+                getTotalExpense(family_id, readAsOfVersion());
                 break;
             }
             case 6: {
@@ -2109,21 +8393,21 @@ int main() {
                 scanf("%d", &family_id);
                 printf("Enter category (0-Rent, 1-Utility, 2-Grocery, 3-Stationary, 4-Leisure): ");
                 scanf("%d", &category);
-                getCategoricalExpense(family_id, category);
+                getCategoricalExpense(family_id, category, readAsOfVersion());
                 break;
             }
             case 7: {
                 int family_id;
                 printf("Enter family ID: ");
                 scanf("%d", &family_id);
-                getHighestExpenseDay(family_id);
+                getHighestExpenseDay(family_id, readAsOfVersion());
                 break;
             }
             case 8: {
                 int user_id;
                 printf("Enter user ID: ");
                 scanf("%d", &user_id);
-                getIndividualExpense(user_id);
+                getIndividualExpense(user_id, readAsOfVersion());
                 break;
             }
             case 9: {
@@ -2132,7 +8416,7 @@ int main() {
                 scanf("%d %d %d", &start.day, &start.month, &start.year);
                 printf("Enter end date (day month year): ");
                 scanf("%d %d %d", &end.day, &end.month, &end.year);
-                getExpensesInPeriod(expense_root,start, end);
+                getExpensesInPeriod(start, end, readAsOfVersion());
                 break;
             }
             case 10: {
@@ -2143,7 +8427,7 @@ int main() {
                 scanf("%d", &start_id);
                 printf("Enter end expense ID: ");
                 scanf("%d", &end_id);
-                getExpensesInRange(user_id, start_id, end_id);
+                getExpensesInRange(user_id, start_id, end_id, readAsOfVersion());
                 break;
             }
             case 11: {
@@ -2157,7 +8441,7 @@ int main() {
                 break;
             }
             case 12:{
-                updateOrDeleteIndividualFamilyDetails(&user_root,&family_root,&expense_root);
+                updateOrDeleteIndividualFamilyDetails(&user_root,&family_root);
                 break;
             }
             case 13:{
@@ -2168,6 +8452,137 @@ int main() {
                 printf("Exiting...");
                 break;
             }
+            case 15:{
+                int kind, mode;
+                char name[NAME_LEN];
+                printf("Search (1-Users, 2-Families): ");
+                scanf("%d", &kind);
+                printf("Match (1-Exact, 2-Prefix): ");
+                scanf("%d", &mode);
+                printf("Enter name: ");
+                scanf("%99s", name);
+
+                if (kind == 1) {
+                    searchUsersByName(name, mode == 2);
+                } else if (kind == 2) {
+                    searchFamiliesByName(name, mode == 2);
+                } else {
+                    printf("Invalid choice\n");
+                }
+                break;
+            }
+            case 16:{
+                int user_id, n;
+                printf("Enter user ID: ");
+                scanf("%d", &user_id);
+                printf("Enter number of expenses: ");
+                scanf("%d", &n);
+                getTopExpenses(user_id, n);
+                break;
+            }
+            case 17:{
+                int month, year;
+                printf("Drop all expenses before (month year): ");
+                scanf("%d %d", &month, &year);
+                printf("Dropped %d expenses\n", dropExpensesBefore(year, month));
+                break;
+            }
+            case 18:{
+                if (freezeIndexes()) {
+                    printf("Indexes frozen: %d users, %d families, %d expenses\n",
+                           frozen_index.user_count, frozen_index.family_count, frozen_index.expense_count);
+                }
+                break;
+            }
+            case 19:{
+                int month, year;
+                printf("Page out all expenses before (month year): ");
+                scanf("%d %d", &month, &year);
+                int moved = pageOutExpensesBefore(year, month);
+                if (moved >= 0) {
+                    printf("Moved %d expenses to %s (%ld on disk)\n", moved, PAGED_STORE_FILE, paged_store.record_count);
+                }
+                break;
+            }
+            case 20:{
+                setIngestMode(!lsm.enabled);
+                printf("Bulk ingest mode %s\n", lsm.enabled ? "on" : "off");
+                break;
+            }
+            case 21:{
+                int month, year;
+                printf("Compress all expenses before (month year): ");
+                scanf("%d %d", &month, &year);
+                printf("Compressed %d expenses\n", compressExpensesBefore(year, month));
+                break;
+            }
+            case 22:{
+                int month, year;
+                printf("Archive all expenses before (month year): ");
+                scanf("%d %d", &month, &year);
+                int moved = archiveExpensesBefore(year, month);
+                if (moved >= 0) {
+                    printf("Archived %d expenses to %s (%d in archive)\n", moved, ARCHIVE_FILE,
+                           archive.header.record_count);
+                }
+                break;
+            }
+            case 23:{
+                Date start, end;
+                printf("Enter start date (day month year): ");
+                scanf("%d %d %d", &start.day, &start.month, &start.year);
+                printf("Enter end date (day month year): ");
+                scanf("%d %d %d", &end.day, &end.month, &end.year);
+                printf("Deleted %d expenses\n", removeExpensesInPeriod(start, end));
+                break;
+            }
+            case 24:{
+                int user_id, start_id, end_id;
+                printf("Enter user ID: ");
+                scanf("%d", &user_id);
+                printf("Enter first and last expense ID: ");
+                scanf("%d %d", &start_id, &end_id);
+                printf("Deleted %d expenses\n", removeExpensesInRange(user_id, start_id, end_id));
+                break;
+            }
+            case 25:{
+                setTombstoneDeletes(!tombstone_deletes);
+                printf("Tombstone deletes %s\n", tombstone_deletes ? "on" : "off");
+                break;
+            }
+            case 26:{
+                GroupQuery query;
+                Date start, end;
+                memset(&query, 0, sizeof(query));
+                printf("Group by (0-User, 1-Family, 2-Category, 3-Day, 4-Weekday, 5-Week, 6-Month, 7-Year)\n");
+                printf("Enter number of fields: ");
+                scanf("%d", &query.field_count);
+                for (int i = 0; i < query.field_count && i < GROUP_FIELD_COUNT; i++) {
+                    int field;
+                    printf("Enter field %d: ", i + 1);
+                    scanf("%d", &field);
+                    query.fields[i] = (field >= 0 && field < GROUP_FIELD_COUNT) ? (GroupField)field : GroupByUser;
+                }
+                printf("Enter start date (day month year): ");
+                scanf("%d %d %d", &start.day, &start.month, &start.year);
+                printf("Enter end date (day month year): ");
+                scanf("%d %d %d", &end.day, &end.month, &end.year);
+                printf("Enter category (-1-All, 0-Rent, 1-Utility, 2-Grocery, 3-Stationary, 4-Leisure): ");
+                scanf("%d", &query.category);
+                query.start = packDate(start);
+                query.end = packDate(end);
+                query.parallel = true;
+                groupExpenses(&query);
+                break;
+            }
+            case 27:{
+                char text[QUERY_LEN];
+                printf("Enter query: ");
+                if (scanf(" %255[^\n]", text) == 1) {
+                    runQuery(text);
+                }
+                break;
+            }
             default: {
                 printf("Invalid choice\n");
                 break;
@@ -2176,14 +8591,23 @@ int main() {
     } while (choice != 14);
 
 
+stopReportExecutor();
+clearReportCache();
 freeUserTree(user_root);
 freeFamilyTree(family_root);
-freeExpenseTree(expense_root);
+freeExpenseStore();
+freeLsmIngest();
+freeExpenseIdIndex();
+pagedStoreClose(&paged_store);
+closeArchive();
+invalidateFrozenIndex();
+freeNameIndex(&user_name_index);
+freeNameIndex(&family_name_index);
+freeStringPool(&name_pool);
 
 // Reset roots to NULL
 user_root = NULL;
 family_root = NULL;
-expense_root = NULL;
 
     return 0;
 }
\ No newline at end of file